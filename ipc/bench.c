@@ -0,0 +1,565 @@
+/*
+ *               libipc benchmarks
+ *
+ * A benchmark runs its operation n times, n growing until a run takes
+ * BENCH_MS milliseconds (200 by default).  Each prints a line of tab
+ * separated fields: the name, ns, bytes allocated and allocations per
+ * operation.  Allocations are counted by wrapping malloc() at link time.
+ * Arguments select the benchmarks whose names start with one of them.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "avl.h"
+#include "bench.h"
+
+#define RECORDED 1024
+#define CHURN_ALLOCS 32
+#define REMOVE_STEP 999983
+#define AVL_MAX 1000000
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+void *__wrap_malloc(size_t);
+void *__wrap_calloc(size_t, size_t);
+void *__wrap_realloc(void *, size_t);
+
+static uint64_t allocs;
+static uint64_t alloc_bytes;
+
+void *__wrap_malloc(size_t size)
+{
+	allocs++;
+	alloc_bytes += size;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+	allocs++;
+	alloc_bytes += n * size;
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+	allocs++;
+	alloc_bytes += size;
+	return __real_realloc(p, size);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Only what runs between timer_start() and timer_stop() is measured */
+static struct {
+	uint64_t start;
+	uint64_t ns;
+	uint64_t allocs;
+	uint64_t bytes;
+} timer;
+
+static void timer_start(void)
+{
+	timer.allocs -= allocs;
+	timer.bytes -= alloc_bytes;
+	timer.start = now_ns();
+}
+
+static void timer_stop(void)
+{
+	timer.ns += now_ns() - timer.start;
+	timer.allocs += allocs;
+	timer.bytes += alloc_bytes;
+}
+
+static void fail(const char *what)
+{
+	fprintf(stderr, "%s failed\n", what);
+	exit(1);
+}
+
+/* Runs at least n operations and tells how many it has run */
+typedef uint64_t (*bench_t)(uint64_t, uintptr_t);
+
+static uint64_t target_ns = 200000000;
+static char **filters;
+static int nfilters;
+
+static void run(const char *name, bench_t bench, uintptr_t arg)
+{
+	bool selected = nfilters == 0;
+
+	for (int i = 0; i < nfilters && !selected; ++i)
+		selected = strncmp(name, filters[i], strlen(filters[i])) == 0;
+
+	if (!selected)
+		return;
+
+	uint64_t n = 1;
+	uint64_t ops;
+
+	for (;;) {
+		memset(&timer, 0, sizeof(timer));
+		ops = bench(n, arg);
+		if (timer.ns >= target_ns)
+			break;
+
+		/* Aim a bit past the target, growing at most a hundredfold */
+		uint64_t next = (timer.ns > 0) ?
+			target_ns / 5 * 6 / (timer.ns / ops + 1) : 100 * n;
+		if (next > 100 * n)
+			next = 100 * n;
+		n = (next > n) ? next : n + 1;
+	}
+
+	printf("%s\t%.2f\t%.1f\t%.3f\n", name, (double)timer.ns / ops,
+		(double)timer.bytes / ops, (double)timer.allocs / ops);
+	fflush(stdout);
+}
+
+/*
+ * An in-memory io: written data is dropped or recorded, and reads replay
+ * the recording over and over.
+ */
+struct mem {
+	uint8_t *data;
+	size_t len;
+	size_t cap;
+	size_t pos;
+};
+
+static ssize_t sink_write(struct io *io, const void *p, size_t len)
+{
+	struct mem *m = io->handle.ptr;
+
+	(void)p;
+	m->len += len;
+	return len;
+}
+
+static ssize_t record_write(struct io *io, const void *p, size_t len)
+{
+	struct mem *m = io->handle.ptr;
+
+	if (m->len + len > m->cap) {
+		size_t cap = (m->cap == 0) ? 4096 : m->cap;
+		while (cap < m->len + len)
+			cap <<= 1;
+
+		uint8_t *data = realloc(m->data, cap);
+		if (data == NULL)
+			return -1;
+
+		m->data = data;
+		m->cap = cap;
+	}
+
+	memcpy(m->data + m->len, p, len);
+	m->len += len;
+	return len;
+}
+
+static ssize_t replay_read(struct io *io, void *p, size_t len)
+{
+	struct mem *m = io->handle.ptr;
+
+	if (m->pos == m->len)
+		m->pos = 0;
+	if (len > m->len - m->pos)
+		len = m->len - m->pos;
+
+	memcpy(p, m->data + m->pos, len);
+	m->pos += len;
+	return len;
+}
+
+static void mem_ipc(struct ipc *ipc, struct mem *m, enum ipc_wire wire,
+		io_write_t write)
+{
+	memset(m, 0, sizeof(*m));
+
+	if (!ipc_init(ipc))
+		fail("ipc_init");
+
+	ipc->io = (struct io){
+		.read = replay_read,
+		.write = write,
+		.handle.ptr = m,
+	};
+	ipc->wire = wire;
+}
+
+static void mem_destroy(struct ipc *ipc, struct mem *m)
+{
+	ipc_destroy(ipc);
+	free(m->data);
+}
+
+/* Codecs, the argument is the wire encoding */
+
+static const x_stat sample_stat = {
+	.mode = 0100644,
+	.nlink = 1,
+	.uid = 1000,
+	.gid = 1000,
+	.rdev = 0,
+	.size = 123456,
+	.atime = 1700000000,
+	.mtime = 1700000001,
+	.ctime = 1700000002,
+	.atime_nsec = 123456789,
+	.mtime_nsec = 234567890,
+	.ctime_nsec = 345678901,
+};
+
+static string sample_names[] = {
+	{.cs = "."}, {.cs = ".."}, {.cs = "Makefile"}, {.cs = "avl.c"},
+	{.cs = "avl.h"}, {.cs = "client.xsl"}, {.cs = "handle.c"},
+	{.cs = "handle.h"}, {.cs = "header.xsl"}, {.cs = "io.c"},
+	{.cs = "io.h"}, {.cs = "io_file.c"}, {.cs = "ipc.c"},
+	{.cs = "ipc.h"}, {.cs = "mpool.c"}, {.cs = "mpool.h"},
+};
+
+static const list_string sample_list = {
+	.n = sizeof(sample_names) / sizeof(*sample_names),
+	._n = sizeof(sample_names) / sizeof(*sample_names),
+	.p = sample_names,
+};
+
+static uint64_t write_stat(uint64_t n, uintptr_t wire)
+{
+	struct ipc ipc;
+	struct mem m;
+
+	mem_ipc(&ipc, &m, wire, sink_write);
+	timer_start();
+
+	for (uint64_t i = 0; i < n; ++i) {
+		if (!ipc_write_x_stat(&ipc, &sample_stat))
+			fail("ipc_write_x_stat");
+	}
+
+	ipc_flush(&ipc);
+	timer_stop();
+	mem_destroy(&ipc, &m);
+	return n;
+}
+
+static uint64_t read_stat(uint64_t n, uintptr_t wire)
+{
+	struct ipc ipc;
+	struct mem m;
+	x_stat st;
+
+	mem_ipc(&ipc, &m, wire, record_write);
+	for (int i = 0; i < RECORDED; ++i)
+		ipc_write_x_stat(&ipc, &sample_stat);
+	if (!ipc_flush(&ipc))
+		fail("recording");
+
+	timer_start();
+
+	for (uint64_t i = 0; i < n; ++i) {
+		if (!ipc_read_x_stat(&ipc, &st))
+			fail("ipc_read_x_stat");
+	}
+
+	timer_stop();
+
+	if (memcmp(&st, &sample_stat, sizeof(st)) != 0)
+		fail("x_stat round trip");
+
+	mem_destroy(&ipc, &m);
+	return n;
+}
+
+static uint64_t write_list(uint64_t n, uintptr_t wire)
+{
+	struct ipc ipc;
+	struct mem m;
+
+	mem_ipc(&ipc, &m, wire, sink_write);
+	timer_start();
+
+	for (uint64_t i = 0; i < n; ++i) {
+		if (!ipc_write_list_string(&ipc, &sample_list))
+			fail("ipc_write_list_string");
+	}
+
+	ipc_flush(&ipc);
+	timer_stop();
+	mem_destroy(&ipc, &m);
+	return n;
+}
+
+/* A pool is cleaned up after each, as servers do after each call */
+static uint64_t read_list(uint64_t n, uintptr_t wire)
+{
+	struct ipc ipc;
+	struct mem m;
+	list_string l;
+
+	mem_ipc(&ipc, &m, wire, record_write);
+	mpool_keep(&ipc.mp, MPOOL_KEEP);
+	for (int i = 0; i < RECORDED; ++i)
+		ipc_write_list_string(&ipc, &sample_list);
+	if (!ipc_flush(&ipc))
+		fail("recording");
+
+	timer_start();
+
+	for (uint64_t i = 0; i < n; ++i) {
+		mpool_cleanup(&ipc.mp);
+		if (!ipc_read_list_string(&ipc, &l))
+			fail("ipc_read_list_string");
+	}
+
+	timer_stop();
+
+	if (l.n != sample_list.n || strcmp(l.p[2].cs, sample_names[2].cs))
+		fail("list_string round trip");
+
+	mem_destroy(&ipc, &m);
+	return n;
+}
+
+/* Raw bytes, the argument is the size of a write or read */
+
+static uint64_t write_raw(uint64_t n, uintptr_t size)
+{
+	struct ipc ipc;
+	struct mem m;
+	uint8_t *buf = calloc(1, size);
+
+	mem_ipc(&ipc, &m, IPC_WIRE_FIXED, sink_write);
+	timer_start();
+
+	for (uint64_t i = 0; i < n; ++i) {
+		if (!ipc_write(&ipc, buf, size))
+			fail("ipc_write");
+	}
+
+	ipc_flush(&ipc);
+	timer_stop();
+	mem_destroy(&ipc, &m);
+	free(buf);
+	return n;
+}
+
+static uint64_t read_raw(uint64_t n, uintptr_t size)
+{
+	struct ipc ipc;
+	struct mem m;
+	uint8_t *buf = calloc(1, size);
+
+	mem_ipc(&ipc, &m, IPC_WIRE_FIXED, record_write);
+	for (int i = 0; i < RECORDED; ++i)
+		ipc_write(&ipc, buf, size);
+	if (!ipc_flush(&ipc))
+		fail("recording");
+
+	timer_start();
+
+	for (uint64_t i = 0; i < n; ++i) {
+		if (!ipc_read(&ipc, buf, size))
+			fail("ipc_read");
+	}
+
+	timer_stop();
+	mem_destroy(&ipc, &m);
+	free(buf);
+	return n;
+}
+
+/*
+ * Pool churn: allocations of a call, then a cleanup.  The argument has
+ * the largest allocation shift and whether the pool keeps its chunks.
+ */
+#define CHURN_KEEP 0x100
+
+static uint64_t mpool_churn(uint64_t n, uintptr_t arg)
+{
+	struct mpool mp;
+	unsigned shifts = arg & 0xff;
+
+	mpool_init(&mp);
+	if (arg & CHURN_KEEP)
+		mpool_keep(&mp, MPOOL_KEEP);
+
+	timer_start();
+
+	for (uint64_t i = 0; i < n; ++i) {
+		for (unsigned j = 0; j < CHURN_ALLOCS; ++j) {
+			char *p = mpool_alloc(&mp, 16 << (j % shifts));
+			if (p == NULL)
+				fail("mpool_alloc");
+			*p = j;
+		}
+
+		mpool_cleanup(&mp);
+	}
+
+	timer_stop();
+	mpool_destroy(&mp);
+	return n;
+}
+
+/* Trees of random keys, the argument is the number of nodes */
+
+struct node {
+	struct avl_node avl;
+	uint64_t key;
+};
+
+static struct node *nodes;
+
+static int node_cmp(const struct node *x, const struct node *y)
+{
+	return (x->key > y->key) - (x->key < y->key);
+}
+
+static uint64_t xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static void avl_fill(struct avl *t, size_t size)
+{
+	avl_init(t, offsetof(struct node, avl), (avl_cmp_t)node_cmp);
+
+	for (size_t i = 0; i < size; ++i)
+		avl_insert(t, &nodes[i]);
+}
+
+static uint64_t avl_insert_bench(uint64_t n, uintptr_t size)
+{
+	uint64_t reps = (n + size - 1) / size;
+	struct avl t;
+
+	for (uint64_t r = 0; r < reps; ++r) {
+		avl_init(&t, offsetof(struct node, avl), (avl_cmp_t)node_cmp);
+		timer_start();
+
+		for (size_t i = 0; i < size; ++i)
+			avl_insert(&t, &nodes[i]);
+
+		timer_stop();
+	}
+
+	return reps * size;
+}
+
+static uint64_t avl_search_bench(uint64_t n, uintptr_t size)
+{
+	uint64_t s = 88172645463325252ull;
+	struct avl t;
+
+	avl_fill(&t, size);
+	timer_start();
+
+	for (uint64_t i = 0; i < n; ++i) {
+		if (avl_search(&t, &nodes[xorshift(&s) % size]) == NULL)
+			fail("avl_search");
+	}
+
+	timer_stop();
+	return n;
+}
+
+/* Nodes go in another order than they came */
+static uint64_t avl_remove_bench(uint64_t n, uintptr_t size)
+{
+	uint64_t reps = (n + size - 1) / size;
+	struct avl t;
+
+	for (uint64_t r = 0; r < reps; ++r) {
+		avl_fill(&t, size);
+		timer_start();
+
+		for (size_t i = 0; i < size; ++i) {
+			if (avl_remove(&t, &nodes[i * REMOVE_STEP % size]) ==
+				NULL)
+				fail("avl_remove");
+		}
+
+		timer_stop();
+	}
+
+	return reps * size;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *const wires[] = {"fixed", "varint", "native"};
+	static const size_t raw_sizes[] = {8, 256, 4096, 65536};
+	char name[64];
+
+	if (getenv("BENCH_MS") != NULL)
+		target_ns = strtoull(getenv("BENCH_MS"), NULL, 10) * 1000000;
+
+	filters = argv + 1;
+	nfilters = argc - 1;
+
+	printf("name\tns/op\tbytes/op\tallocs/op\n");
+
+	for (int w = IPC_WIRE_FIXED; w <= IPC_WIRE_NATIVE; ++w) {
+		if (w == IPC_WIRE_NATIVE &&
+			!(ipc_features() & IPC_FEATURE_NATIVE))
+			continue;
+
+		snprintf(name, sizeof(name), "write/x_stat/%s", wires[w]);
+		run(name, write_stat, w);
+		snprintf(name, sizeof(name), "read/x_stat/%s", wires[w]);
+		run(name, read_stat, w);
+		snprintf(name, sizeof(name), "write/list_string/%s", wires[w]);
+		run(name, write_list, w);
+		snprintf(name, sizeof(name), "read/list_string/%s", wires[w]);
+		run(name, read_list, w);
+	}
+
+	for (size_t i = 0; i < sizeof(raw_sizes) / sizeof(*raw_sizes); ++i) {
+		snprintf(name, sizeof(name), "ipc_write/%zu", raw_sizes[i]);
+		run(name, write_raw, raw_sizes[i]);
+		snprintf(name, sizeof(name), "ipc_read/%zu", raw_sizes[i]);
+		run(name, read_raw, raw_sizes[i]);
+	}
+
+	run("mpool/small", mpool_churn, 7);
+	run("mpool/small/keep", mpool_churn, 7 | CHURN_KEEP);
+	run("mpool/large", mpool_churn, 11);
+	run("mpool/large/keep", mpool_churn, 11 | CHURN_KEEP);
+
+	nodes = malloc(sizeof(*nodes) * AVL_MAX);
+	if (nodes == NULL)
+		fail("malloc");
+
+	uint64_t s = 2463534242ull;
+	for (size_t i = 0; i < AVL_MAX; ++i)
+		nodes[i].key = xorshift(&s);
+
+	for (size_t size = 1000; size <= AVL_MAX; size *= 10) {
+		snprintf(name, sizeof(name), "avl/insert/%zu", size);
+		run(name, avl_insert_bench, size);
+		snprintf(name, sizeof(name), "avl/search/%zu", size);
+		run(name, avl_search_bench, size);
+		snprintf(name, sizeof(name), "avl/remove/%zu", size);
+		run(name, avl_remove_bench, size);
+	}
+
+	free(nodes);
+	return 0;
+}
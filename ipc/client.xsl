@@ -11,19 +11,86 @@
     {
     const uint32_t id = UINT32_C(<xsl:value-of select="@id"/>);
     int32_t <xsl:value-of select="@name"/>;
+    ipc_call_start(ipc, ipc_rx(ipc));
     ipc-&gt;ok = (ipc_write_uint32_t(ipc, &amp;id)
     <xsl:for-each select="in">
       &amp;&amp; ipc_write_<xsl:value-of select="@type"/>
       (ipc, <xsl:value-of select="@name"/>)
     </xsl:for-each>
     &amp;&amp; ipc_flush(ipc)
-    &amp;&amp; ipc_read_int32_t(ipc, &amp;<xsl:value-of select="@name"/>)
-    &amp;&amp; ((<xsl:value-of select="@name"/> != 0) || (
+    &amp;&amp; (ipc_call_sent(ipc),
+    ipc_read_int32_t(ipc, &amp;<xsl:value-of select="@name"/>))
+    &amp;&amp; (ipc_call_answered(ipc),
+    (<xsl:value-of select="@name"/> != 0) || (
     <xsl:for-each select="out">
       ipc_read_<xsl:value-of select="@type"/>
       (ipc, <xsl:value-of select="@name"/>) &amp;&amp;
     </xsl:for-each> true)));
-    return ipc-&gt;ok ? <xsl:value-of select="@name"/> : INT32_C(-1);
+    if (!ipc-&gt;ok)
+    return INT32_C(-1);
+    ipc_call_received(ipc, id, <xsl:value-of select="@name"/>);
+    return <xsl:value-of select="@name"/>;
+    }
+  </xsl:template>
+  <!--
+    Steps of a compound go out in one message, the replies come back up
+    to the first failed step.  steps counts the ones that succeeded.
+    The round trip is up to the result of the first step.
+  -->
+  <xsl:template match="compound">
+    int32_t <xsl:value-of select="@name"/>
+    (struct ipc *ipc
+    <xsl:for-each select="step">
+      <xsl:variable name="i" select="position()"/>
+      <xsl:variable name="step" select="."/>
+      <xsl:for-each select="//func[@name = $step/@func]/in[not(@name = $step/bind/@name)]">
+        , const <xsl:value-of select="@type"/>
+        *s<xsl:value-of select="$i"/>_<xsl:value-of select="@name"/>
+      </xsl:for-each>
+    </xsl:for-each>
+    <xsl:for-each select="step">
+      <xsl:variable name="i" select="position()"/>
+      <xsl:variable name="step" select="."/>
+      <xsl:for-each select="//func[@name = $step/@func]/out">
+        , <xsl:value-of select="@type"/>
+        *s<xsl:value-of select="$i"/>_<xsl:value-of select="@name"/>
+      </xsl:for-each>
+    </xsl:for-each>, uint32_t *steps)
+    {
+    const uint32_t id = UINT32_C(<xsl:value-of select="@id"/>);
+    int32_t result = 0;
+    *steps = 0;
+    ipc_call_start(ipc, ipc_rx(ipc));
+    ipc-&gt;ok = (ipc_write_uint32_t(ipc, &amp;id)
+    <xsl:for-each select="step">
+      <xsl:variable name="i" select="position()"/>
+      <xsl:variable name="step" select="."/>
+      <xsl:for-each select="//func[@name = $step/@func]/in[not(@name = $step/bind/@name)]">
+        &amp;&amp; ipc_write_<xsl:value-of select="@type"/>
+        (ipc, s<xsl:value-of select="$i"/>_<xsl:value-of select="@name"/>)
+      </xsl:for-each>
+    </xsl:for-each>
+    &amp;&amp; ipc_flush(ipc));
+    ipc_call_sent(ipc);
+    <xsl:for-each select="step">
+      <xsl:variable name="i" select="position()"/>
+      <xsl:variable name="step" select="."/>
+      if (ipc-&gt;ok &amp;&amp; result == 0) {
+      ipc-&gt;ok = ipc_read_int32_t(ipc, &amp;result)
+      <xsl:if test="$i = 1">
+        &amp;&amp; (ipc_call_answered(ipc), true)
+      </xsl:if>
+      &amp;&amp; ((result != 0) || (
+      <xsl:for-each select="//func[@name = $step/@func]/out">
+        ipc_read_<xsl:value-of select="@type"/>
+        (ipc, s<xsl:value-of select="$i"/>_<xsl:value-of select="@name"/>) &amp;&amp;
+      </xsl:for-each> (++*steps, true)));
+      }
+    </xsl:for-each>
+    if (!ipc-&gt;ok)
+    return INT32_C(-1);
+    ipc_call_received(ipc, id, result);
+    return result;
     }
   </xsl:template>
   <xsl:template match="in">
@@ -0,0 +1,137 @@
+#define _XOPEN_SOURCE 600
+
+#include <stdlib.h>
+#include "handle.h"
+
+#define SLOT_LIVE UINT32_MAX
+#define SLOT_NONE (UINT32_MAX - 1)
+
+union align {
+	long double d;
+	long long l;
+	void *p;
+	void (*f)(void);
+};
+
+#define ALIGN(n) (((n) + sizeof(union align) - 1) / sizeof(union align) \
+		* sizeof(union align))
+
+struct slot {
+	uint32_t generation;
+	uint32_t next;
+};
+
+#define HDR_SIZE ALIGN(sizeof(struct slot))
+
+static struct slot *slot(const struct handle_table *t, uint32_t i)
+{
+	return (struct slot *)((char *)t->slabs[i / HANDLE_SLAB] +
+			(size_t)(i % HANDLE_SLAB) * t->stride);
+}
+
+static void *item(struct slot *s)
+{
+	return (char *)s + HDR_SIZE;
+}
+
+void handle_init(struct handle_table *t, size_t size)
+{
+	t->slabs = NULL;
+	t->nslabs = 0;
+	t->used = 0;
+	t->free = SLOT_NONE;
+	t->base = 0;
+	t->stride = HDR_SIZE + ALIGN(size);
+}
+
+void handle_destroy(struct handle_table *t)
+{
+	for (uint32_t i = 0; i < t->nslabs; ++i)
+		free(t->slabs[i]);
+
+	free(t->slabs);
+	handle_init(t, t->stride - HDR_SIZE);
+}
+
+/* Slots that are not used yet start from this generation */
+void handle_base(struct handle_table *t, uint32_t generation)
+{
+	t->base = generation;
+}
+
+void *handle_alloc(struct handle_table *t, uint64_t *handle)
+{
+	uint32_t i;
+	struct slot *s;
+
+	if (t->free != SLOT_NONE) {
+		i = t->free;
+		s = slot(t, i);
+		t->free = s->next;
+	} else {
+		if (t->used >= SLOT_NONE)
+			return NULL;
+
+		if (t->used / HANDLE_SLAB >= t->nslabs) {
+			void **slabs = realloc(t->slabs,
+					sizeof(*slabs) * (t->nslabs + 1));
+			if (slabs == NULL)
+				return NULL;
+
+			t->slabs = slabs;
+
+			slabs[t->nslabs] = malloc(t->stride * HANDLE_SLAB);
+			if (slabs[t->nslabs] == NULL)
+				return NULL;
+
+			++t->nslabs;
+		}
+
+		i = t->used++;
+		s = slot(t, i);
+		s->generation = t->base;
+	}
+
+	s->next = SLOT_LIVE;
+	*handle = (uint64_t)s->generation << 32 | i;
+	return item(s);
+}
+
+void *handle_get(const struct handle_table *t, uint64_t handle)
+{
+	uint32_t i = (uint32_t)handle;
+
+	if (i >= t->used)
+		return NULL;
+
+	struct slot *s = slot(t, i);
+
+	if (s->next != SLOT_LIVE || s->generation != handle >> 32)
+		return NULL;
+
+	return item(s);
+}
+
+bool handle_free(struct handle_table *t, uint64_t handle)
+{
+	if (handle_get(t, handle) == NULL)
+		return false;
+
+	uint32_t i = (uint32_t)handle;
+	struct slot *s = slot(t, i);
+
+	++s->generation;
+	s->next = t->free;
+	t->free = i;
+	return true;
+}
+
+void handle_traverse(struct handle_table *t, handle_process_t process)
+{
+	for (uint32_t i = 0; i < t->used; ++i) {
+		struct slot *s = slot(t, i);
+
+		if (s->next == SLOT_LIVE)
+			process(item(s));
+	}
+}
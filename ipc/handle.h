@@ -0,0 +1,39 @@
+/*
+ *               Handle table
+ *
+ * Items of a fixed size live in slabs of HANDLE_SLAB slots and are found
+ * by handle in O(1).  A handle is the slot index in the low 32 bits and
+ * the slot generation in the high 32 bits.  The generation is bumped
+ * when the slot is freed, so stale handles are rejected after reuse.
+ * Items do not move while they are allocated.
+ */
+
+#ifndef __HANDLE_H__
+#define __HANDLE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HANDLE_SLAB 1024
+
+struct handle_table {
+	void **slabs;
+	uint32_t nslabs;
+	uint32_t used;
+	uint32_t free;
+	uint32_t base;
+	size_t stride;
+};
+
+typedef void (*handle_process_t)(void *);
+
+void handle_init(struct handle_table *, size_t size);
+void handle_destroy(struct handle_table *);
+void handle_base(struct handle_table *, uint32_t generation);
+void *handle_alloc(struct handle_table *, uint64_t *handle);
+void *handle_get(const struct handle_table *, uint64_t handle);
+bool handle_free(struct handle_table *, uint64_t handle);
+void handle_traverse(struct handle_table *, handle_process_t);
+
+#endif
@@ -1,9 +1,24 @@
 <?xml version="1.0"?>
 <xsl:stylesheet version="1.0" xmlns:xsl="http://www.w3.org/1999/XSL/Transform">
+  <xsl:include href="wire.xsl"/>
   <xsl:output method="text"/>
   <xsl:template match="/">
     #include &lt;ipc.h&gt;
     extern bool ipc_process_<xsl:value-of select="//@name"/>(struct ipc *ipc);
+    extern struct ipc_stats ipc_stats_<xsl:value-of select="//@name"/>[
+    <xsl:call-template name="funcs"/>];
+    static inline const char *ipc_func_<xsl:value-of select="//@name"/>
+    (uint32_t id)
+    {
+    switch (id) {
+    <xsl:for-each select="//func | //compound">
+      case <xsl:value-of select="@id"/>:
+      return &quot;<xsl:value-of select="@name"/>&quot;;
+    </xsl:for-each>
+    default:
+    return NULL;
+    }
+    }
     <xsl:apply-templates/>
   </xsl:template>
   <xsl:template match="alias">
@@ -17,6 +32,21 @@
     (struct ipc *ipc, const <xsl:value-of select="@name"/> *p){
     return ipc_write_<xsl:value-of select="@type"/>(ipc, p);
     }
+    <xsl:variable name="size">
+      <xsl:call-template name="wire-size">
+        <xsl:with-param name="type" select="@name"/>
+      </xsl:call-template>
+    </xsl:variable>
+    <xsl:if test="not(contains($size, 'x'))">
+      static inline bool ipc_get_<xsl:value-of select="@name"/>
+      (struct ipc *ipc, <xsl:value-of select="@name"/> *p){
+      return ipc_get_<xsl:value-of select="@type"/>(ipc, p);
+      }
+      static inline bool ipc_put_<xsl:value-of select="@name"/>
+      (struct ipc *ipc, const <xsl:value-of select="@name"/> *p){
+      return ipc_put_<xsl:value-of select="@type"/>(ipc, p);
+      }
+    </xsl:if>
   </xsl:template>
   <xsl:template match="type">
     typedef struct <xsl:value-of select="@name"/> {
@@ -25,8 +55,42 @@
       <xsl:value-of select="@name"/>;
     </xsl:for-each>
     } <xsl:value-of select="@name"/>;
+    <xsl:variable name="size">
+      <xsl:call-template name="wire-size">
+        <xsl:with-param name="type" select="@name"/>
+      </xsl:call-template>
+    </xsl:variable>
+    <xsl:variable name="fixed" select="not(contains($size, 'x'))"/>
+    <!--
+      A fixed-size type is read and written in one go when the buffer
+      has room for it, field by field otherwise.
+    -->
+    <xsl:if test="$fixed">
+      static inline bool ipc_get_<xsl:value-of select="@name"/>
+      (struct ipc *ipc, <xsl:value-of select="@name"/> *p){
+      return (
+      <xsl:for-each select="field">
+        ipc_get_<xsl:value-of select="@type"/>
+        (ipc, &amp;p-&gt;<xsl:value-of select="@name"/>) &amp;&amp;
+      </xsl:for-each> true);
+      }
+      static inline bool ipc_put_<xsl:value-of select="@name"/>
+      (struct ipc *ipc, const <xsl:value-of select="@name"/> *p){
+      return (
+      <xsl:for-each select="field">
+        ipc_put_<xsl:value-of select="@type"/>
+        (ipc, &amp;p-&gt;<xsl:value-of select="@name"/>) &amp;&amp;
+      </xsl:for-each> true);
+      }
+    </xsl:if>
     static inline bool ipc_read_<xsl:value-of select="@name"/>
     (struct ipc *ipc, <xsl:value-of select="@name"/> *p){
+    <xsl:if test="$fixed">
+      if (ipc_can_read(ipc, <xsl:call-template name="max-size">
+        <xsl:with-param name="size" select="$size"/>
+      </xsl:call-template>))
+      return ipc_get_<xsl:value-of select="@name"/>(ipc, p);
+    </xsl:if>
     return (
     <xsl:for-each select="field">
       ipc_read_<xsl:value-of select="@type"/>
@@ -35,6 +99,12 @@
     }
     static inline bool ipc_write_<xsl:value-of select="@name"/>
     (struct ipc *ipc, const <xsl:value-of select="@name"/> *p){
+    <xsl:if test="$fixed">
+      if (ipc_can_write(ipc, <xsl:call-template name="max-size">
+        <xsl:with-param name="size" select="$size"/>
+      </xsl:call-template>))
+      return ipc_put_<xsl:value-of select="@name"/>(ipc, p);
+    </xsl:if>
     return (
     <xsl:for-each select="field">
       ipc_write_<xsl:value-of select="@type"/>
@@ -99,6 +169,32 @@
   <xsl:template match="func">
     int32_t <xsl:value-of select="@name"/>
     (struct ipc *ipc <xsl:apply-templates/>);
+    bool ipc_reply_<xsl:value-of select="@name"/>
+    (struct ipc *ipc, int32_t result
+    <xsl:for-each select="out">
+      , const <xsl:value-of select="@type"/>
+      *<xsl:value-of select="@name"/>
+    </xsl:for-each>);
+  </xsl:template>
+  <xsl:template match="compound">
+    int32_t <xsl:value-of select="@name"/>
+    (struct ipc *ipc
+    <xsl:for-each select="step">
+      <xsl:variable name="i" select="position()"/>
+      <xsl:variable name="step" select="."/>
+      <xsl:for-each select="//func[@name = $step/@func]/in[not(@name = $step/bind/@name)]">
+        , const <xsl:value-of select="@type"/>
+        *s<xsl:value-of select="$i"/>_<xsl:value-of select="@name"/>
+      </xsl:for-each>
+    </xsl:for-each>
+    <xsl:for-each select="step">
+      <xsl:variable name="i" select="position()"/>
+      <xsl:variable name="step" select="."/>
+      <xsl:for-each select="//func[@name = $step/@func]/out">
+        , <xsl:value-of select="@type"/>
+        *s<xsl:value-of select="$i"/>_<xsl:value-of select="@name"/>
+      </xsl:for-each>
+    </xsl:for-each>, uint32_t *steps);
   </xsl:template>
   <xsl:template match="in">
     , const <xsl:value-of select="@type"/><xsl:text> </xsl:text>
@@ -0,0 +1,66 @@
+#define _XOPEN_SOURCE 600
+
+#include <stdint.h>
+#include <string.h>
+#include "io.h"
+
+ssize_t io_readv(struct io *io, const struct iovec *iov, int cnt)
+{
+	if (io->readv != NULL)
+		return io->readv(io, iov, cnt);
+
+	for (int i = 0; i < cnt; ++i) {
+		if (iov[i].iov_len > 0)
+			return io->read(io, iov[i].iov_base, iov[i].iov_len);
+	}
+
+	return 0;
+}
+
+bool io_writev_full(struct io *io, const struct iovec *iov, int cnt)
+{
+	struct iovec v[cnt];
+	memcpy(v, iov, sizeof(v));
+
+	for (int i = 0; i < cnt;) {
+		if (v[i].iov_len == 0) {
+			++i;
+			continue;
+		}
+
+		ssize_t sent = (io->writev != NULL) ?
+			io->writev(io, v + i, cnt - i) :
+			io->write(io, v[i].iov_base, v[i].iov_len);
+		if (sent <= 0)
+			return false;
+
+		while (sent > 0) {
+			if ((size_t)sent >= v[i].iov_len) {
+				sent -= v[i].iov_len;
+				v[i++].iov_len = 0;
+			} else {
+				v[i].iov_base = (char *)v[i].iov_base + sent;
+				v[i].iov_len -= sent;
+				sent = 0;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool io_write_zeros(struct io *io, size_t len)
+{
+	static const uint8_t zeros[4096];
+
+	while (len > 0) {
+		size_t chunk = (len < sizeof(zeros)) ? len : sizeof(zeros);
+		ssize_t sent = io->write(io, zeros, chunk);
+		if (sent <= 0)
+			return false;
+
+		len -= sent;
+	}
+
+	return true;
+}
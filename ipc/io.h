@@ -1,12 +1,22 @@
 #ifndef __IO_H__
 #define __IO_H__
 
+#include <stdbool.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 struct io;
 
 typedef ssize_t (*io_read_t)(struct io *, void *, size_t);
 typedef ssize_t (*io_write_t)(struct io *, const void *, size_t);
+typedef ssize_t (*io_readv_t)(struct io *, const struct iovec *, int);
+typedef ssize_t (*io_writev_t)(struct io *, const struct iovec *, int);
+typedef int (*io_flush_t)(struct io *);
+/*
+ * Sends len bytes of a file, zeros past its end as the length may have
+ * been sent ahead, and returns how many came from the file
+ */
+typedef ssize_t (*io_sendfile_t)(struct io *, int, off_t, size_t);
 
 union io_handle {
 	void *ptr;
@@ -16,7 +26,16 @@ union io_handle {
 struct io {
 	io_read_t read;
 	io_write_t write;
+	io_readv_t readv;
+	io_writev_t writev;
+	io_flush_t flush;
+	io_sendfile_t sendfile;
 	union io_handle handle;
 };
 
+/* Vectored calls, through read and write if the io has no own */
+ssize_t io_readv(struct io *, const struct iovec *, int);
+bool io_writev_full(struct io *, const struct iovec *, int);
+bool io_write_zeros(struct io *, size_t);
+
 #endif
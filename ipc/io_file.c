@@ -4,6 +4,10 @@
 #include <unistd.h>
 #include "io_file.h"
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 static ssize_t io_file_read(struct io *io, void *p, size_t len)
 {
 	return read(io->handle.fd, p, len);
@@ -14,9 +18,48 @@ static ssize_t io_file_write(struct io *io, const void *p, size_t len)
 	return write(io->handle.fd, p, len);
 }
 
+static ssize_t io_file_readv(struct io *io, const struct iovec *iov, int cnt)
+{
+	return readv(io->handle.fd, iov, cnt);
+}
+
+static ssize_t io_file_writev(struct io *io, const struct iovec *iov,
+			int cnt)
+{
+	return writev(io->handle.fd, iov, cnt);
+}
+
+#ifdef __linux__
+static ssize_t io_file_sendfile(struct io *io, int fd, off_t offset,
+				size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = sendfile(io->handle.fd, fd, &offset, len - done);
+		if (n == -1)
+			return -1;
+		if (n == 0)
+			break;
+
+		done += n;
+	}
+
+	return io_write_zeros(io, len - done) ? (ssize_t)done : -1;
+}
+#endif
+
 void io_file_init(struct io *io, int fd)
 {
 	io->handle.fd = fd;
 	io->read = io_file_read;
 	io->write = io_file_write;
+	io->readv = io_file_readv;
+	io->writev = io_file_writev;
+	io->flush = NULL;
+#ifdef __linux__
+	io->sendfile = io_file_sendfile;
+#else
+	io->sendfile = NULL;
+#endif
 }
@@ -0,0 +1,420 @@
+#define _XOPEN_SOURCE 600
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include "io_mux.h"
+
+void io_mux_hdr_pack(void *p, uint32_t tag, uint32_t len)
+{
+	const uint32_t hdr[2] = {htonl(tag), htonl(len)};
+	memcpy(p, hdr, sizeof(hdr));
+}
+
+void io_mux_hdr_unpack(const void *p, uint32_t *tag, uint32_t *len)
+{
+	uint32_t hdr[2];
+	memcpy(hdr, p, sizeof(hdr));
+
+	*tag = ntohl(hdr[0]);
+	*len = ntohl(hdr[1]);
+}
+
+static bool read_full(struct io *io, void *p, size_t len)
+{
+	while (len > 0) {
+		ssize_t done = io->read(io, p, len);
+		if (done <= 0)
+			return false;
+
+		p = (char *)p + done;
+		len -= done;
+	}
+
+	return true;
+}
+
+static bool write_full(struct io *io, const void *p, size_t len)
+{
+	while (len > 0) {
+		ssize_t sent = io->write(io, p, len);
+		if (sent <= 0)
+			return false;
+
+		p = (const char *)p + sent;
+		len -= sent;
+	}
+
+	return true;
+}
+
+static void release_send(struct io_mux_channel *ch)
+{
+	if (ch->sending) {
+		ch->sending = false;
+		pthread_mutex_unlock(&ch->mux->send_lock);
+	}
+}
+
+static bool dropped(const struct io_mux *mux, uint32_t tag)
+{
+	unsigned n = (mux->ndropped < IO_MUX_DROPPED) ?
+		mux->ndropped : IO_MUX_DROPPED;
+
+	for (unsigned i = 0; i < n; ++i) {
+		if (mux->dropped[i] == tag)
+			return true;
+	}
+
+	return false;
+}
+
+/* Read some of a frame nobody waits for, with the lock held */
+static void drain(struct io_mux *mux)
+{
+	uint8_t buf[4096];
+	size_t len = (mux->left < sizeof(buf)) ? mux->left : sizeof(buf);
+
+	mux->reading = true;
+	pthread_mutex_unlock(&mux->lock);
+	ssize_t done = mux->io.read(&mux->io, buf, len);
+	pthread_mutex_lock(&mux->lock);
+	mux->reading = false;
+
+	if (done > 0)
+		mux->left -= done;
+	else
+		mux->failed = true;
+
+	pthread_cond_broadcast(&mux->cond);
+}
+
+static ssize_t io_mux_readv(struct io *io, const struct iovec *iov, int cnt)
+{
+	struct io_mux_channel *ch = io->handle.ptr;
+	struct io_mux *mux = ch->mux;
+	ssize_t done = -1;
+
+	pthread_mutex_lock(&mux->lock);
+
+	while (!mux->failed && ch->epoch == mux->epoch) {
+		if (mux->reading) {
+			pthread_cond_wait(&mux->cond, &mux->lock);
+			continue;
+		}
+
+		if (mux->left == 0) {
+			uint8_t hdr[IO_MUX_HDR_SIZE];
+
+			mux->reading = true;
+			pthread_mutex_unlock(&mux->lock);
+			bool ok = read_full(&mux->io, hdr, sizeof(hdr));
+			pthread_mutex_lock(&mux->lock);
+			mux->reading = false;
+
+			if (ok)
+				io_mux_hdr_unpack(hdr, &mux->tag, &mux->left);
+			else
+				mux->failed = true;
+
+			pthread_cond_broadcast(&mux->cond);
+			continue;
+		}
+
+		if (ch->server)
+			ch->tag = mux->tag;
+		else if (dropped(mux, mux->tag)) {
+			drain(mux);
+			continue;
+		}
+
+		if (mux->tag != ch->tag) {
+			pthread_cond_wait(&mux->cond, &mux->lock);
+			continue;
+		}
+
+		/* Do not read past the frame */
+		struct iovec v[cnt];
+		size_t left = mux->left;
+		int n;
+
+		for (n = 0; n < cnt && left > 0; ++n) {
+			v[n] = iov[n];
+			if (v[n].iov_len > left)
+				v[n].iov_len = left;
+
+			left -= v[n].iov_len;
+		}
+
+		mux->reading = true;
+		pthread_mutex_unlock(&mux->lock);
+		done = io_readv(&mux->io, v, n);
+		pthread_mutex_lock(&mux->lock);
+		mux->reading = false;
+
+		if (done > 0)
+			mux->left -= done;
+		else
+			mux->failed = true;
+
+		pthread_cond_broadcast(&mux->cond);
+		break;
+	}
+
+	pthread_mutex_unlock(&mux->lock);
+	return done;
+}
+
+static bool send_begin(struct io_mux_channel *ch)
+{
+	struct io_mux *mux = ch->mux;
+
+	if (!ch->sending) {
+		pthread_mutex_lock(&mux->send_lock);
+		ch->sending = true;
+
+		if (!ch->server)
+			ch->epoch = mux->epoch;
+	}
+
+	pthread_mutex_lock(&mux->lock);
+	bool ok = !mux->failed && ch->epoch == mux->epoch;
+	pthread_mutex_unlock(&mux->lock);
+
+	if (!ok)
+		release_send(ch);
+
+	return ok;
+}
+
+static void send_failed(struct io_mux_channel *ch)
+{
+	struct io_mux *mux = ch->mux;
+
+	pthread_mutex_lock(&mux->lock);
+	mux->failed = true;
+	pthread_cond_broadcast(&mux->cond);
+	pthread_mutex_unlock(&mux->lock);
+
+	release_send(ch);
+}
+
+static ssize_t io_mux_read(struct io *io, void *p, size_t len)
+{
+	return io_mux_readv(io, &(struct iovec){p, len}, 1);
+}
+
+/* The header and the data go in one call */
+static ssize_t io_mux_writev(struct io *io, const struct iovec *iov, int cnt)
+{
+	struct io_mux_channel *ch = io->handle.ptr;
+	struct io_mux *mux = ch->mux;
+
+	if (!send_begin(ch))
+		return -1;
+
+	struct iovec v[cnt + 1];
+	uint8_t hdr[IO_MUX_HDR_SIZE];
+	size_t len = 0;
+
+	for (int i = 0; i < cnt; ++i) {
+		v[i + 1] = iov[i];
+		len += iov[i].iov_len;
+	}
+
+	io_mux_hdr_pack(hdr, ch->tag, len);
+	v[0].iov_base = hdr;
+	v[0].iov_len = sizeof(hdr);
+
+	if (!io_writev_full(&mux->io, v, cnt + 1)) {
+		send_failed(ch);
+		return -1;
+	}
+
+	return len;
+}
+
+static ssize_t io_mux_write(struct io *io, const void *p, size_t len)
+{
+	return io_mux_writev(io, &(struct iovec){(void *)p, len}, 1);
+}
+
+/* The frame length is sent ahead, a file that has got shorter is padded */
+static ssize_t io_mux_sendfile(struct io *io, int fd, off_t offset,
+			size_t len)
+{
+	struct io_mux_channel *ch = io->handle.ptr;
+	struct io_mux *mux = ch->mux;
+
+	if (!send_begin(ch))
+		return -1;
+
+	uint8_t hdr[IO_MUX_HDR_SIZE];
+	io_mux_hdr_pack(hdr, ch->tag, len);
+
+	if (!write_full(&mux->io, hdr, sizeof(hdr)))
+		goto fail;
+
+	if (mux->io.sendfile != NULL) {
+		ssize_t n = mux->io.sendfile(&mux->io, fd, offset, len);
+		if (n == -1)
+			goto fail;
+
+		return n;
+	}
+
+	size_t done = 0;
+	uint8_t buf[4096];
+
+	while (done < len) {
+		size_t chunk = (len - done < sizeof(buf)) ?
+			len - done : sizeof(buf);
+		ssize_t n = pread(fd, buf, chunk, offset + done);
+
+		if (n <= 0)
+			break;
+
+		if (!write_full(&mux->io, buf, n))
+			goto fail;
+
+		done += n;
+	}
+
+	if (!io_write_zeros(&mux->io, len - done))
+		goto fail;
+
+	return done;
+
+fail:
+	send_failed(ch);
+	return -1;
+}
+
+static int io_mux_flush(struct io *io)
+{
+	release_send(io->handle.ptr);
+	return 0;
+}
+
+void io_mux_init(struct io_mux *mux, const struct io *io)
+{
+	mux->io = *io;
+	pthread_mutex_init(&mux->lock, NULL);
+	pthread_cond_init(&mux->cond, NULL);
+	pthread_mutex_init(&mux->send_lock, NULL);
+	mux->next_tag = 0;
+	mux->epoch = 0;
+	mux->failed = false;
+	mux->reading = false;
+	mux->tag = 0;
+	mux->left = 0;
+	mux->ndropped = 0;
+}
+
+void io_mux_destroy(struct io_mux *mux)
+{
+	pthread_mutex_destroy(&mux->send_lock);
+	pthread_cond_destroy(&mux->cond);
+	pthread_mutex_destroy(&mux->lock);
+}
+
+/*
+ * Switch all channels to a new underlying stream.  The caller must make
+ * the old stream fail first (e.g. shutdown() the socket) so that
+ * channels blocked in it wake up.  Channels that were in the middle of
+ * a call stay bound to the old epoch and fail.
+ */
+void io_mux_reset(struct io_mux *mux, const struct io *io)
+{
+	pthread_mutex_lock(&mux->lock);
+	mux->failed = true;
+	pthread_cond_broadcast(&mux->cond);
+
+	while (mux->reading)
+		pthread_cond_wait(&mux->cond, &mux->lock);
+
+	pthread_mutex_unlock(&mux->lock);
+
+	pthread_mutex_lock(&mux->send_lock);
+	pthread_mutex_lock(&mux->lock);
+
+	mux->io = *io;
+	mux->epoch++;
+	mux->failed = false;
+	mux->tag = 0;
+	mux->left = 0;
+	mux->ndropped = 0;
+
+	pthread_mutex_unlock(&mux->lock);
+	pthread_mutex_unlock(&mux->send_lock);
+}
+
+static void channel_init(struct io *io, struct io_mux_channel *ch,
+			struct io_mux *mux, bool server)
+{
+	ch->mux = mux;
+	ch->server = server;
+	ch->sending = false;
+
+	pthread_mutex_lock(&mux->lock);
+	ch->tag = server ? 0 : mux->next_tag++;
+	ch->epoch = mux->epoch;
+	pthread_mutex_unlock(&mux->lock);
+
+	io->handle.ptr = ch;
+	io->read = io_mux_read;
+	io->write = io_mux_write;
+	io->readv = io_mux_readv;
+	io->writev = io_mux_writev;
+	io->flush = io_mux_flush;
+	io->sendfile = server ? io_mux_sendfile : NULL;
+}
+
+void io_mux_client_init(struct io *io, struct io_mux_channel *ch,
+			struct io_mux *mux)
+{
+	channel_init(io, ch, mux, false);
+}
+
+void io_mux_server_init(struct io *io, struct io_mux_channel *ch,
+			struct io_mux *mux)
+{
+	channel_init(io, ch, mux, true);
+}
+
+bool io_mux_stale(const struct io_mux_channel *ch)
+{
+	struct io_mux *mux = ch->mux;
+
+	pthread_mutex_lock(&mux->lock);
+	bool stale = ch->epoch != mux->epoch;
+	pthread_mutex_unlock(&mux->lock);
+
+	return stale;
+}
+
+/*
+ * Give up on the call of a client channel, so that a reply read in part
+ * does not hold up the others.  The oldest tag given up on is forgotten
+ * once IO_MUX_DROPPED are.  A request sent in part cannot be taken back,
+ * the stream fails then.
+ */
+void io_mux_abandon(struct io_mux_channel *ch)
+{
+	struct io_mux *mux = ch->mux;
+
+	if (ch->sending) {
+		send_failed(ch);
+		return;
+	}
+
+	pthread_mutex_lock(&mux->lock);
+
+	if (!mux->failed && ch->epoch == mux->epoch) {
+		mux->dropped[mux->ndropped++ % IO_MUX_DROPPED] = ch->tag;
+		ch->tag = mux->next_tag++;
+		pthread_cond_broadcast(&mux->cond);
+	}
+
+	pthread_mutex_unlock(&mux->lock);
+}
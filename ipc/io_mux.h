@@ -0,0 +1,74 @@
+/*
+ *               Multiplexed transport
+ *
+ * Many channels share one underlying stream.  Every io->write() of a
+ * channel is sent as a frame tagged with the channel's tag:
+ *
+ *	uint32_t tag;
+ *	uint32_t len;
+ *	uint8_t data[len];
+ *
+ * A channel holds the stream for sending from its first write up to
+ * io->flush(), so frames of one message are never interleaved with
+ * frames of another.  Replies may come back in any order; whichever
+ * channel is reading picks up the next frame header and hands the frame
+ * over to its owner.
+ *
+ * A server channel adopts the tag of the frame it has read last, so
+ * the reply goes back to the sender of the request.  A client channel
+ * that gives up on a reply takes a new tag, the frames still to come
+ * under the old one are read and dropped.
+ * Server channels also send file ranges as frames, with sendfile()
+ * of the underlying stream if it has one.
+ */
+
+#ifndef __IO_MUX_H__
+#define __IO_MUX_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "io.h"
+
+#define IO_MUX_HDR_SIZE 8
+#define IO_MUX_DROPPED 8
+
+struct io_mux {
+	struct io io;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_mutex_t send_lock;
+	uint32_t next_tag;
+	uint32_t epoch;
+	bool failed;
+	bool reading;
+	uint32_t tag;
+	uint32_t left;
+	uint32_t dropped[IO_MUX_DROPPED];	/* tags given up on */
+	unsigned ndropped;
+};
+
+struct io_mux_channel {
+	struct io_mux *mux;
+	uint32_t tag;
+	uint32_t epoch;
+	bool server;
+	bool sending;
+};
+
+void io_mux_init(struct io_mux *, const struct io *);
+void io_mux_destroy(struct io_mux *);
+void io_mux_reset(struct io_mux *, const struct io *);
+
+void io_mux_client_init(struct io *, struct io_mux_channel *,
+			struct io_mux *);
+void io_mux_server_init(struct io *, struct io_mux_channel *,
+			struct io_mux *);
+
+bool io_mux_stale(const struct io_mux_channel *);
+void io_mux_abandon(struct io_mux_channel *);
+
+void io_mux_hdr_pack(void *, uint32_t, uint32_t);
+void io_mux_hdr_unpack(const void *, uint32_t *, uint32_t *);
+
+#endif
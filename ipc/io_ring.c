@@ -0,0 +1,499 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "io_ring.h"
+
+#ifdef __linux__
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define CACHE_LINE 64
+#define HDR_SIZE 4096
+#define SPIN_NS 20000
+#define SLEEP_NS 50000000
+
+/*
+ * Positions run freely and are taken modulo the size.  Each side keeps
+ * its own positions in struct io_ring too and never trusts the shared
+ * copies of those.
+ */
+struct ring {
+	/* Moved by the consumer */
+	uint32_t head;
+	uint32_t head_wait;
+	uint8_t pad1[CACHE_LINE - 2 * sizeof(uint32_t)];
+
+	/* Moved by the producer */
+	uint32_t tail;
+	uint32_t tail_wait;
+	uint8_t pad2[CACHE_LINE - 2 * sizeof(uint32_t)];
+
+	uint32_t closed;
+};
+
+static uint8_t *ring_data(struct ring *g)
+{
+	return (uint8_t *)g + HDR_SIZE;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static void futex_wait(uint32_t *p, uint32_t val)
+{
+	const struct timespec ts = {0, SLEEP_NS};
+	syscall(SYS_futex, p, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futex_wake(uint32_t *p)
+{
+	syscall(SYS_futex, p, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static bool closed(const struct io_ring *r)
+{
+	return __atomic_load_n(&r->in->closed, __ATOMIC_ACQUIRE) ||
+		__atomic_load_n(&r->out->closed, __ATOMIC_ACQUIRE);
+}
+
+/* The peer never sends anything after the rendezvous */
+static bool peer_gone(const struct io_ring *r)
+{
+	struct pollfd p = {.fd = r->sock, .events = POLLIN};
+	return poll(&p, 1, 0) > 0;
+}
+
+/* Spinning only helps when the peer runs on another CPU meanwhile */
+static uint64_t spin_ns(void)
+{
+	static int cpus;
+
+	if (cpus == 0)
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus > 1) ? SPIN_NS : 0;
+}
+
+/* Wait for *pos to move away from seen, false if the ring is closed */
+static bool wait_move(struct io_ring *r, uint32_t *pos, uint32_t *waiting,
+		uint32_t seen)
+{
+	uint64_t start = now_ns();
+	uint64_t spin = spin_ns();
+
+	do {
+		if (__atomic_load_n(pos, __ATOMIC_ACQUIRE) != seen)
+			return true;
+		if (closed(r))
+			return false;
+
+		for (int i = 0; i < 64; ++i)
+			cpu_relax();
+	} while (now_ns() - start < spin);
+
+	bool moved;
+
+	for (;;) {
+		__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(pos, __ATOMIC_SEQ_CST) != seen) {
+			moved = true;
+			break;
+		}
+
+		if (closed(r) || peer_gone(r)) {
+			moved = false;
+			break;
+		}
+
+		futex_wait(pos, seen);
+	}
+
+	__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+	return moved;
+}
+
+static void publish(uint32_t *pos, uint32_t *waiting, uint32_t val)
+{
+	__atomic_store_n(pos, val, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+		futex_wake(pos);
+}
+
+/* Bytes to read, 0 if the ring is closed, -1 if it is broken */
+static ssize_t readable(struct io_ring *r)
+{
+	struct ring *g = r->in;
+	uint32_t tail = __atomic_load_n(&g->tail, __ATOMIC_ACQUIRE);
+
+	if (tail == r->head) {
+		if (!wait_move(r, &g->tail, &g->tail_wait, r->head))
+			return 0;
+
+		tail = __atomic_load_n(&g->tail, __ATOMIC_ACQUIRE);
+	}
+
+	uint32_t used = tail - r->head;
+	if (used > r->size) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	return used;
+}
+
+/* Room to write, 0 if the ring is closed, -1 if it is broken */
+static ssize_t writable(struct io_ring *r)
+{
+	struct ring *g = r->out;
+	uint32_t head = __atomic_load_n(&g->head, __ATOMIC_ACQUIRE);
+
+	if (r->tail - head == r->size) {
+		if (!wait_move(r, &g->head, &g->head_wait, head))
+			return 0;
+
+		head = __atomic_load_n(&g->head, __ATOMIC_ACQUIRE);
+	}
+
+	uint32_t used = r->tail - head;
+	if (used > r->size) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	return r->size - used;
+}
+
+static ssize_t io_ring_readv(struct io *io, const struct iovec *iov, int cnt)
+{
+	struct io_ring *r = io->handle.ptr;
+	ssize_t avail = readable(r);
+	if (avail <= 0)
+		return avail;
+
+	uint8_t *data = ring_data(r->in);
+	size_t done = 0;
+
+	for (int i = 0; i < cnt && (size_t)avail > done; ++i) {
+		size_t n = iov[i].iov_len;
+		if (n > avail - done)
+			n = avail - done;
+
+		uint32_t off = (r->head + done) & (r->size - 1);
+		size_t first = (n < r->size - off) ? n : r->size - off;
+
+		memcpy(iov[i].iov_base, data + off, first);
+		memcpy((uint8_t *)iov[i].iov_base + first, data, n - first);
+		done += n;
+	}
+
+	r->head += done;
+	publish(&r->in->head, &r->in->head_wait, r->head);
+	return done;
+}
+
+static ssize_t io_ring_read(struct io *io, void *p, size_t len)
+{
+	return io_ring_readv(io, &(struct iovec){p, len}, 1);
+}
+
+static ssize_t io_ring_writev(struct io *io, const struct iovec *iov,
+			int cnt)
+{
+	struct io_ring *r = io->handle.ptr;
+	ssize_t room = writable(r);
+	if (room == 0)
+		errno = EPIPE;
+	if (room <= 0)
+		return -1;
+
+	uint8_t *data = ring_data(r->out);
+	size_t done = 0;
+
+	for (int i = 0; i < cnt && (size_t)room > done; ++i) {
+		size_t n = iov[i].iov_len;
+		if (n > room - done)
+			n = room - done;
+
+		uint32_t off = (r->tail + done) & (r->size - 1);
+		size_t first = (n < r->size - off) ? n : r->size - off;
+
+		memcpy(data + off, iov[i].iov_base, first);
+		memcpy(data, (const uint8_t *)iov[i].iov_base + first,
+			n - first);
+		done += n;
+	}
+
+	r->tail += done;
+	publish(&r->out->tail, &r->out->tail_wait, r->tail);
+	return done;
+}
+
+static ssize_t io_ring_write(struct io *io, const void *p, size_t len)
+{
+	return io_ring_writev(io, &(struct iovec){(void *)p, len}, 1);
+}
+
+/* File data is read right into the ring, short files are padded */
+static ssize_t io_ring_sendfile(struct io *io, int fd, off_t offset,
+				size_t len)
+{
+	struct io_ring *r = io->handle.ptr;
+	uint8_t *data = ring_data(r->out);
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t room = writable(r);
+		if (room == 0)
+			errno = EPIPE;
+		if (room <= 0)
+			return -1;
+
+		uint32_t off = r->tail & (r->size - 1);
+		size_t n = len - done;
+		if (n > (size_t)room)
+			n = room;
+		if (n > r->size - off)
+			n = r->size - off;
+
+		ssize_t got = pread(fd, data + off, n, offset + done);
+		if (got <= 0)
+			break;
+
+		r->tail += got;
+		publish(&r->out->tail, &r->out->tail_wait, r->tail);
+		done += got;
+	}
+
+	return io_write_zeros(io, len - done) ? (ssize_t)done : -1;
+}
+
+static size_t map_size(uint32_t size)
+{
+	return 2 * ((size_t)HDR_SIZE + size);
+}
+
+static bool size_valid(uint32_t size)
+{
+	return size >= IO_RING_MIN && size <= IO_RING_MAX &&
+		(size & (size - 1)) == 0;
+}
+
+/* The client sends on the first ring and receives on the second one */
+static bool ring_map(struct io_ring *r, int fd, uint32_t size, bool server)
+{
+	void *map = mmap(NULL, map_size(size), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return false;
+
+	struct ring *first = map;
+	struct ring *second = (struct ring *)((uint8_t *)map + HDR_SIZE + size);
+
+	r->in = server ? first : second;
+	r->out = server ? second : first;
+	r->map = map;
+	r->map_size = map_size(size);
+	r->size = size;
+	r->head = 0;
+	r->tail = 0;
+	return true;
+}
+
+static bool send_fd(int sock, int fd, uint32_t size)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct iovec v = {&size, sizeof(size)};
+	struct msghdr msg = {
+		.msg_iov = &v,
+		.msg_iovlen = 1,
+		.msg_control = ctl.buf,
+		.msg_controllen = sizeof(ctl.buf),
+	};
+
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(c), &fd, sizeof(int));
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(size);
+}
+
+static int recv_fd(int sock, uint32_t *size)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct iovec v = {size, sizeof(*size)};
+	struct msghdr msg = {
+		.msg_iov = &v,
+		.msg_iovlen = 1,
+		.msg_control = ctl.buf,
+		.msg_controllen = sizeof(ctl.buf),
+	};
+
+	ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	int fd = -1;
+
+	if (c != NULL && c->cmsg_level == SOL_SOCKET &&
+		c->cmsg_type == SCM_RIGHTS &&
+		c->cmsg_len == CMSG_LEN(sizeof(int)))
+		memcpy(&fd, CMSG_DATA(c), sizeof(int));
+
+	if (n != sizeof(*size) && fd != -1) {
+		close(fd);
+		fd = -1;
+	}
+
+	return fd;
+}
+
+/*
+ * The mapping is sealed, so the server cannot be brought down by the
+ * client shrinking it.
+ */
+bool io_ring_connect(struct io_ring *r, int sock, uint32_t size)
+{
+	if (!size_valid(size)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	int fd = memfd_create("io_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1)
+		return false;
+
+	bool ok = ftruncate(fd, map_size(size)) == 0 &&
+		fcntl(fd, F_ADD_SEALS,
+			F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0 &&
+		ring_map(r, fd, size, false);
+
+	if (ok && !send_fd(sock, fd, size)) {
+		munmap(r->map, r->map_size);
+		ok = false;
+	}
+
+	close(fd);
+	r->sock = sock;
+	return ok;
+}
+
+bool io_ring_accept(struct io_ring *r, int sock)
+{
+	uint32_t size;
+	int fd = recv_fd(sock, &size);
+	if (fd == -1)
+		return false;
+
+	struct stat st;
+	bool ok = size_valid(size) && fstat(fd, &st) == 0 &&
+		(size_t)st.st_size == map_size(size) &&
+		(fcntl(fd, F_GET_SEALS) & F_SEAL_SHRINK) &&
+		ring_map(r, fd, size, true);
+
+	close(fd);
+	r->sock = sock;
+	if (!ok)
+		errno = EPROTO;
+	return ok;
+}
+
+void io_ring_init(struct io *io, struct io_ring *r)
+{
+	io->handle.ptr = r;
+	io->read = io_ring_read;
+	io->write = io_ring_write;
+	io->readv = io_ring_readv;
+	io->writev = io_ring_writev;
+	io->flush = NULL;
+	io->sendfile = io_ring_sendfile;
+}
+
+/* Both sides, and threads of this one waiting in the ring, give up */
+void io_ring_shutdown(struct io_ring *r)
+{
+	struct ring *g[2] = {r->in, r->out};
+
+	for (int i = 0; i < 2; ++i) {
+		__atomic_store_n(&g[i]->closed, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&g[i]->head);
+		futex_wake(&g[i]->tail);
+	}
+
+	shutdown(r->sock, SHUT_RDWR);
+}
+
+void io_ring_destroy(struct io_ring *r)
+{
+	io_ring_shutdown(r);
+	munmap(r->map, r->map_size);
+	close(r->sock);
+}
+
+#else
+
+bool io_ring_connect(struct io_ring *r, int sock, uint32_t size)
+{
+	(void)r;
+	(void)sock;
+	(void)size;
+
+	errno = ENOSYS;
+	return false;
+}
+
+bool io_ring_accept(struct io_ring *r, int sock)
+{
+	(void)r;
+	(void)sock;
+
+	errno = ENOSYS;
+	return false;
+}
+
+void io_ring_init(struct io *io, struct io_ring *r)
+{
+	(void)io;
+	(void)r;
+}
+
+void io_ring_shutdown(struct io_ring *r)
+{
+	(void)r;
+}
+
+void io_ring_destroy(struct io_ring *r)
+{
+	close(r->sock);
+}
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ *               Shared memory transport
+ *
+ * Two single-producer single-consumer byte rings in one memfd mapping,
+ * one for each direction.  The client creates the mapping and passes
+ * it to the server over a Unix socket, which then stays open so that
+ * either side can tell when the other one has gone.
+ *
+ * A side that has to wait for data or for space spins for a while and
+ * then sleeps on a futex; the other side wakes it only if it sleeps.
+ * Only one thread may read and one may write at a time, as io_mux does.
+ *
+ * Linux only, io_ring_connect() and io_ring_accept() fail elsewhere.
+ */
+
+#ifndef __IO_RING_H__
+#define __IO_RING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "io.h"
+
+/* Bytes in each direction, a power of two */
+#define IO_RING_SIZE (1 << 20)
+#define IO_RING_MIN (64 << 10)
+#define IO_RING_MAX (64 << 20)
+
+struct ring;
+
+struct io_ring {
+	struct ring *in;
+	struct ring *out;
+	void *map;
+	size_t map_size;
+	uint32_t size;
+	uint32_t head;
+	uint32_t tail;
+	int sock;
+};
+
+bool io_ring_connect(struct io_ring *, int, uint32_t);
+bool io_ring_accept(struct io_ring *, int);
+void io_ring_init(struct io *, struct io_ring *);
+void io_ring_shutdown(struct io_ring *);
+void io_ring_destroy(struct io_ring *);
+
+#endif
@@ -1,16 +1,81 @@
 #define _XOPEN_SOURCE 600
 
 #include <arpa/inet.h>
+#include <linux/tcp.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 #include "ipc.h"
 
-void ipc_init(struct ipc *ipc)
+#define ZIP_MIN 512
+#define ZIP_BACKOFF_MAX 256
+#define LINK_CHECK_NS 100000000
+#define TAIL_MARK 0x80000000
+
+bool ipc_init(struct ipc *ipc)
 {
 	mpool_init(&ipc->mp);
+	ipc->rb.data = NULL;
 	ipc->rb.pos = 0;
 	ipc->rb.size = 0;
+	ipc->rb.done = 0;
+	ipc->wb.data = NULL;
 	ipc->wb.pos = 0;
+	ipc->wb.done = 0;
+	ipc->file.fd = -1;
+	ipc->dest.p = NULL;
+	ipc->zip = NULL;
+	ipc->wire = IPC_WIRE_FIXED;
+	ipc->tails = false;
+	ipc->defer = false;
+	ipc->stats = NULL;
+	return ipc_resize(ipc, IPC_BUFFER_SIZE);
+}
+
+/* Input not read yet and output not sent yet are kept, if they fit */
+bool ipc_resize(struct ipc *ipc, size_t size)
+{
+	struct read_buffer *rb = &ipc->rb;
+	struct write_buffer *wb = &ipc->wb;
+	size_t unread = rb->size - rb->pos;
+
+	if (size < unread || size < wb->pos)
+		return false;
+
+	uint8_t *data = malloc(2 * size);
+	if (data == NULL)
+		return false;
+
+	if (unread > 0)
+		memcpy(data, rb->data + rb->pos, unread);
+	if (wb->pos > 0)
+		memcpy(data + size, wb->data, wb->pos);
+
+	free(rb->data);
+	rb->data = data;
+	rb->cap = size;
+	rb->done += rb->pos;
+	rb->size = unread;
+	rb->pos = 0;
+	wb->data = data + size;
+	wb->cap = size;
+	return true;
+}
+
+void ipc_destroy(struct ipc *ipc)
+{
+	free(ipc->rb.data);
+	ipc->rb.data = ipc->wb.data = NULL;
+	mpool_destroy(&ipc->mp);
+}
+
+void ipc_zip_init(struct ipc_zip *zip)
+{
+	memset(zip, 0, sizeof(*zip));
+	zip->sock = -1;
 }
 
 bool ipc_read(struct ipc *ipc, void *p, size_t size)
@@ -18,12 +83,43 @@ bool ipc_read(struct ipc *ipc, void *p, size_t size)
 	struct read_buffer *rb = &ipc->rb;
 
 	while (size > 0) {
+		/*
+		 * Large reads go straight to the destination, whatever
+		 * comes after it goes to the buffer
+		 */
+		if (rb->pos >= rb->size && size >= rb->cap) {
+			struct iovec v[2] = {
+				{p, size},
+				{rb->data, rb->cap},
+			};
+
+			rb->done += rb->pos;
+			rb->pos = rb->size = 0;
+
+			ssize_t done = io_readv(&ipc->io, v, 2);
+			if (done <= 0)
+				return false;
+
+			if ((size_t)done > size) {
+				rb->size = done - size;
+				rb->pos = 0;
+				done = size;
+			}
+
+			rb->done += done;
+
+			p = (char *)p + done;
+			size -= done;
+			continue;
+		}
+
 		if (rb->pos >= rb->size) {
 			ssize_t done = ipc->io.read(&ipc->io, rb->data,
-						IPC_BUFFER_SIZE);
+						rb->cap);
 			if (done <= 0)
 				return false;
 
+			rb->done += rb->size;
 			rb->size = done;
 			rb->pos = 0;
 		}
@@ -41,22 +137,36 @@ bool ipc_read(struct ipc *ipc, void *p, size_t size)
 	return true;
 }
 
+static bool write_out(struct ipc *ipc)
+{
+	struct write_buffer *wb = &ipc->wb;
+
+	if (wb->pos > 0) {
+		if (ipc->io.write(&ipc->io, wb->data, wb->pos) <
+			(ssize_t)wb->pos)
+			return false;
+
+		wb->done += wb->pos;
+		wb->pos = 0;
+	}
+
+	return true;
+}
+
 bool ipc_write(struct ipc *ipc, const void *p, size_t size)
 {
 	struct write_buffer *wb = &ipc->wb;
 
+	if (size >= wb->cap)
+		return ipc_writev(ipc, &(struct iovec){(void *)p, size}, 1);
+
 	while (size > 0) {
-		if (wb->pos >= IPC_BUFFER_SIZE) {
-			ssize_t sent = ipc->io.write(&ipc->io, wb->data,
-						     IPC_BUFFER_SIZE);
-			if (sent < IPC_BUFFER_SIZE)
-				return false;
-			wb->pos = 0;
-		}
+		if (wb->pos >= wb->cap && !write_out(ipc))
+			return false;
 
 		size_t chunk = size;
-		if (wb->pos + size > IPC_BUFFER_SIZE)
-			chunk = IPC_BUFFER_SIZE - wb->pos;
+		if (wb->pos + size > wb->cap)
+			chunk = wb->cap - wb->pos;
 
 		memcpy(wb->data + wb->pos, p, chunk);
 		p = (char *)p + chunk;
@@ -67,39 +177,214 @@ bool ipc_write(struct ipc *ipc, const void *p, size_t size)
 	return true;
 }
 
-bool ipc_flush(struct ipc *ipc)
+/* Large writes are not copied, they go out along with the buffer */
+bool ipc_writev(struct ipc *ipc, const struct iovec *iov, int cnt)
 {
 	struct write_buffer *wb = &ipc->wb;
+	size_t size = 0;
+
+	for (int i = 0; i < cnt; ++i)
+		size += iov[i].iov_len;
+
+	if (size < wb->cap) {
+		for (int i = 0; i < cnt; ++i) {
+			if (!ipc_write(ipc, iov[i].iov_base, iov[i].iov_len))
+				return false;
+		}
 
-	if (wb->pos == 0)
 		return true;
+	}
+
+	struct iovec v[cnt + 1];
 
-	if (ipc->io.write(&ipc->io, wb->data, wb->pos) < (ssize_t)wb->pos)
+	v[0].iov_base = wb->data;
+	v[0].iov_len = wb->pos;
+	memcpy(v + 1, iov, sizeof(*iov) * cnt);
+
+	if (!io_writev_full(&ipc->io, v, cnt + 1))
 		return false;
 
+	wb->done += wb->pos + size;
 	wb->pos = 0;
 	return true;
 }
 
+bool ipc_flush(struct ipc *ipc)
+{
+	return write_out(ipc) &&
+		(ipc->io.flush == NULL || ipc->io.flush(&ipc->io) == 0);
+}
+
+/*
+ * Send a file range as a part of the message, without copying it when
+ * the io can do sendfile().  The length is already known to the peer,
+ * so a file that has got shorter is padded with zeros, got is what the
+ * file had.
+ */
+bool ipc_write_file(struct ipc *ipc, int fd, int64_t offset, uint32_t len,
+		uint32_t *got)
+{
+	struct write_buffer *wb = &ipc->wb;
+	uint32_t done = 0;
+
+	if (ipc->io.sendfile != NULL) {
+		if (!write_out(ipc))
+			return false;
+
+		ssize_t sent = ipc->io.sendfile(&ipc->io, fd, offset, len);
+		if (sent == -1)
+			return false;
+
+		wb->done += len;
+		*got = sent;
+		return true;
+	}
+
+	while (done < len) {
+		if (wb->pos >= wb->cap && !write_out(ipc))
+			return false;
+
+		size_t chunk = len - done;
+		if (chunk > wb->cap - wb->pos)
+			chunk = wb->cap - wb->pos;
+
+		ssize_t n = pread(fd, wb->data + wb->pos, chunk, offset + done);
+		if (n <= 0)
+			break;
+
+		wb->pos += n;
+		done += n;
+	}
+
+	*got = done;
+
+	static const uint8_t zeros[4096];
+
+	while (done < len) {
+		uint32_t chunk = len - done;
+		if (chunk > sizeof(zeros))
+			chunk = sizeof(zeros);
+
+		if (!ipc_write(ipc, zeros, chunk))
+			return false;
+
+		done += chunk;
+	}
+
+	return true;
+}
+
+static bool little_endian(void)
+{
+	const uint16_t x = 1;
+	return *(const uint8_t *)&x;
+}
+
+uint32_t ipc_features(void)
+{
+	uint32_t features = IPC_FEATURE_ZIP | IPC_FEATURE_VARINT |
+		IPC_FEATURE_STATS | IPC_FEATURE_TAIL;
+
+	if (little_endian())
+		features |= IPC_FEATURE_NATIVE;
+	return features;
+}
+
+enum ipc_wire ipc_wire_of(uint32_t features)
+{
+	if (features & IPC_FEATURE_VARINT)
+		return IPC_WIRE_VARINT;
+	if ((features & IPC_FEATURE_NATIVE) && little_endian())
+		return IPC_WIRE_NATIVE;
+	return IPC_WIRE_FIXED;
+}
+
+/* LEB128: 7 bits a byte, least significant first */
+static bool read_varint(struct ipc *ipc, uint64_t *p)
+{
+	struct read_buffer *rb = &ipc->rb;
+	uint64_t x = 0;
+
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		uint8_t b;
+
+		if (rb->pos < rb->size)
+			b = rb->data[rb->pos++];
+		else if (!ipc_read(ipc, &b, 1))
+			return false;
+
+		x |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*p = x;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool write_varint(struct ipc *ipc, uint64_t x)
+{
+	uint8_t buf[10];
+	size_t n = 0;
+
+	do {
+		buf[n] = x & 0x7f;
+		x >>= 7;
+		if (x != 0)
+			buf[n] |= 0x80;
+		n++;
+	} while (x != 0);
+
+	return ipc_write(ipc, buf, n);
+}
+
 bool ipc_read_uint32_t(struct ipc *ipc, uint32_t *p)
 {
 	uint32_t x;
 
+	if (ipc->wire == IPC_WIRE_VARINT) {
+		uint64_t v;
+
+		if (!read_varint(ipc, &v) || v > UINT32_MAX)
+			return false;
+		*p = v;
+		return true;
+	}
+
 	if (!ipc_read(ipc, &x, sizeof(x)))
 		return false;
 
-	*p = ntohl(x);
+	*p = (ipc->wire == IPC_WIRE_NATIVE) ? x : ntohl(x);
 	return true;
 }
 
 bool ipc_write_uint32_t(struct ipc *ipc, const uint32_t *p)
 {
+	if (ipc->wire == IPC_WIRE_VARINT)
+		return write_varint(ipc, *p);
+	if (ipc->wire == IPC_WIRE_NATIVE)
+		return ipc_write(ipc, p, sizeof(*p));
+
 	uint32_t x = htonl(*p);
 	return ipc_write(ipc, &x, sizeof(x));
 }
 
 bool ipc_read_int32_t(struct ipc *ipc, int32_t *p)
 {
+	if (ipc->wire == IPC_WIRE_VARINT) {
+		uint64_t v;
+
+		if (!read_varint(ipc, &v))
+			return false;
+
+		int64_t x = ipc_unzigzag(v);
+		if (x < INT32_MIN || x > INT32_MAX)
+			return false;
+		*p = x;
+		return true;
+	}
+
 	uint32_t x;
 	if (!ipc_read_uint32_t(ipc, &x))
 		return false;
@@ -110,6 +395,9 @@ bool ipc_read_int32_t(struct ipc *ipc, int32_t *p)
 
 bool ipc_write_int32_t(struct ipc *ipc, const int32_t *p)
 {
+	if (ipc->wire == IPC_WIRE_VARINT)
+		return write_varint(ipc, ipc_zigzag(*p));
+
 	uint32_t x = *p;
 	return ipc_write_uint32_t(ipc, &x);
 }
@@ -118,6 +406,11 @@ bool ipc_read_uint64_t(struct ipc *ipc, uint64_t *p)
 {
 	uint32_t h, l;
 
+	if (ipc->wire == IPC_WIRE_VARINT)
+		return read_varint(ipc, p);
+	if (ipc->wire == IPC_WIRE_NATIVE)
+		return ipc_read(ipc, p, sizeof(*p));
+
 	if (!ipc_read_uint32_t(ipc, &h) || !ipc_read_uint32_t(ipc, &l))
 		return false;
 
@@ -127,6 +420,11 @@ bool ipc_read_uint64_t(struct ipc *ipc, uint64_t *p)
 
 bool ipc_write_uint64_t(struct ipc *ipc, const uint64_t *p)
 {
+	if (ipc->wire == IPC_WIRE_VARINT)
+		return write_varint(ipc, *p);
+	if (ipc->wire == IPC_WIRE_NATIVE)
+		return ipc_write(ipc, p, sizeof(*p));
+
 	uint32_t h = *p >> 32, l = *p;
 	return ipc_write_uint32_t(ipc, &h) && ipc_write_uint32_t(ipc, &l);
 }
@@ -135,6 +433,13 @@ bool ipc_read_int64_t(struct ipc *ipc, int64_t *p)
 {
 	uint64_t x;
 
+	if (ipc->wire == IPC_WIRE_VARINT) {
+		if (!read_varint(ipc, &x))
+			return false;
+		*p = ipc_unzigzag(x);
+		return true;
+	}
+
 	if (!ipc_read_uint64_t(ipc, &x))
 		return false;
 
@@ -144,30 +449,404 @@ bool ipc_read_int64_t(struct ipc *ipc, int64_t *p)
 
 bool ipc_write_int64_t(struct ipc *ipc, const int64_t *p)
 {
+	if (ipc->wire == IPC_WIRE_VARINT)
+		return write_varint(ipc, ipc_zigzag(*p));
+
 	uint64_t x = *p;
 	return ipc_write_uint64_t(ipc, &x);
 }
 
-bool ipc_read_datum(struct ipc *ipc, datum *p)
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The clock starts once the function is known, rx is from before that */
+void ipc_call_start(struct ipc *ipc, uint64_t rx)
+{
+	memset(&ipc->call, 0, sizeof(ipc->call));
+	ipc->call.in = rx;
+	ipc->call.out = ipc_tx(ipc);
+	ipc->call.t = now_ns();
+}
+
+static void call_phase(struct ipc_call *call, enum ipc_phase phase)
+{
+	uint64_t t = now_ns();
+
+	call->ns[phase] += t - call->t;
+	call->t = t;
+}
+
+static unsigned bucket(uint64_t ns)
+{
+	unsigned i = (ns == 0) ? 0 : 64 - __builtin_clzll(ns);
+
+	return (i < IPC_HIST_BUCKETS) ? i : IPC_HIST_BUCKETS - 1;
+}
+
+/* in and out are byte counts by now */
+static void call_record(const struct ipc_call *call, struct ipc_stats *stats,
+			int32_t result)
+{
+	stats->calls++;
+	stats->bytes_in += call->in;
+	stats->bytes_out += call->out;
+
+	if (result != 0)
+		stats->errors[(result > 0 && result < IPC_ERRNO_MAX) ?
+			result : 0]++;
+
+	for (int i = 0; i < IPC_PHASES; ++i)
+		stats->hist[i][bucket(call->ns[i])]++;
+}
+
+void ipc_call_decoded(struct ipc *ipc)
+{
+	call_phase(&ipc->call, IPC_PHASE_DECODE);
+	ipc->call.in = ipc_rx(ipc) - ipc->call.in;
+	ipc->call.out = ipc_tx(ipc);
+}
+
+void ipc_call_handled(struct ipc *ipc)
+{
+	call_phase(&ipc->call, IPC_PHASE_HANDLER);
+}
+
+/* A deferred call is being handled until it replies */
+void ipc_call_resumed(struct ipc *ipc)
+{
+	call_phase(&ipc->call, IPC_PHASE_HANDLER);
+	ipc->call.out = ipc_tx(ipc);
+}
+
+/* The reply is flushed */
+void ipc_call_end(struct ipc *ipc, struct ipc_stats *stats, int32_t result)
+{
+	call_phase(&ipc->call, IPC_PHASE_ENCODE);
+	ipc->call.out = ipc_tx(ipc) - ipc->call.out;
+	call_record(&ipc->call, stats, result);
+}
+
+/*
+ * A client call goes the other way: the request is encoded and sent, the
+ * result comes back after the round trip, as if handled, and the outputs
+ * are decoded.  Nothing is kept without ipc->stats.
+ */
+void ipc_call_sent(struct ipc *ipc)
+{
+	if (ipc->stats == NULL)
+		return;
+
+	call_phase(&ipc->call, IPC_PHASE_ENCODE);
+	ipc->call.out = ipc_tx(ipc) - ipc->call.out;
+}
+
+void ipc_call_answered(struct ipc *ipc)
+{
+	if (ipc->stats != NULL)
+		call_phase(&ipc->call, IPC_PHASE_HANDLER);
+}
+
+void ipc_call_received(struct ipc *ipc, uint32_t id, int32_t result)
+{
+	if (ipc->stats == NULL)
+		return;
+
+	call_phase(&ipc->call, IPC_PHASE_DECODE);
+	ipc->call.in = ipc_rx(ipc) - ipc->call.in;
+	call_record(&ipc->call, &ipc->stats[id], result);
+}
+
+/*
+ * On a compressing connection a datum that is not too small carries the
+ * compressed size after its length, 0 if the data is stored
+ */
+static bool zip_applies(const struct ipc *ipc, uint32_t n)
+{
+	return ipc->zip != NULL && ipc->zip->on && n >= ZIP_MIN;
+}
+
+static bool read_zipped(struct ipc *ipc, void *p, uint32_t n, uint32_t z)
+{
+	if (z >= n)
+		return false;
+
+	void *buf = mpool_alloc(&ipc->mp, z);
+	if (buf == NULL || !ipc_read(ipc, buf, z))
+		return false;
+
+	uint64_t start = now_ns();
+	bool ok = lz_decompress(buf, z, p, n);
+	ipc->zip->unzip_ns += now_ns() - start;
+
+	mpool_free(&ipc->mp, buf);
+	return ok;
+}
+
+/*
+ * What TCP delivered lately, the rate of the link as far as we use it.
+ * An application limited sample only tells that the link is no slower.
+ */
+static uint64_t link_rate(struct ipc_zip *zip)
+{
+	uint64_t now = now_ns();
+	if (now - zip->link_checked < LINK_CHECK_NS)
+		return zip->link_rate;
+
+	zip->link_checked = now;
+
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+	memset(&ti, 0, sizeof(ti));
+
+	if (getsockopt(zip->sock, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1 ||
+		len < offsetof(struct tcp_info, tcpi_delivery_rate) +
+			sizeof(ti.tcpi_delivery_rate))
+		return zip->link_rate;
+
+	if (!ti.tcpi_delivery_rate_app_limited ||
+			ti.tcpi_delivery_rate > zip->link_rate)
+		zip->link_rate = ti.tcpi_delivery_rate;
+
+	return zip->link_rate;
+}
+
+/* Compression pays if the link would take longer for the bytes saved */
+static bool zip_pays(struct ipc_zip *zip, uint32_t n, size_t z, uint64_t ns)
+{
+	if (z == 0 || zip->sock == -1)
+		return false;
+
+	uint64_t rate = link_rate(zip);
+	return rate == 0 || (double)(n - z) * 1e9 / rate > ns;
+}
+
+static void zip_adapt(struct ipc_zip *zip, uint32_t n, size_t z, uint64_t ns)
+{
+	if (zip_pays(zip, n, z, ns)) {
+		zip->backoff = 0;
+		return;
+	}
+
+	if (zip->backoff == 0)
+		zip->backoff = 1;
+	else if (zip->backoff < ZIP_BACKOFF_MAX)
+		zip->backoff <<= 1;
+
+	zip->skip = zip->backoff;
+}
+
+/*
+ * With IPC_FEATURE_TAIL a datum sent from a file has TAIL_MARK in its
+ * length and ends with the number of its bytes that are data, 4 bytes
+ * big endian.  If the file got shorter while being sent the rest is
+ * padded, and the peer takes the datum to end where the file did.
+ * Without it the padding is all the peer gets.
+ */
+static uint32_t tail_mark(const struct ipc *ipc, uint32_t n)
+{
+	return ipc->tails ? n | TAIL_MARK : n;
+}
+
+static bool write_tail(struct ipc *ipc, uint32_t got)
+{
+	uint32_t x = htonl(got);
+
+	return !ipc->tails || ipc_write(ipc, &x, sizeof(x));
+}
+
+static bool read_tail(struct ipc *ipc, datum *p)
+{
+	uint32_t x;
+
+	if (!ipc_read(ipc, &x, sizeof(x)) || ntohl(x) > p->n)
+		return false;
+
+	p->n = ntohl(x);
+	return true;
+}
+
+/* Put the datum from the file or the pieces in one buffer for the codec */
+static void *gather(struct ipc *ipc, const struct iovec *iov, int cnt,
+		int fd, uint32_t n, uint32_t *got)
+{
+	uint8_t *buf = mpool_alloc(&ipc->mp, n);
+	if (buf == NULL)
+		return NULL;
+
+	uint32_t done = 0;
+
+	if (iov == NULL) {
+		while (done < n) {
+			ssize_t res = pread(fd, buf + done, n - done,
+					ipc->file.offset + done);
+			if (res <= 0)
+				break;
+
+			done += res;
+		}
+
+		memset(buf + done, 0, n - done);
+		*got = done;
+	} else {
+		for (int i = 0; i < cnt; ++i) {
+			memcpy(buf + done, iov[i].iov_base, iov[i].iov_len);
+			done += iov[i].iov_len;
+		}
+
+		*got = n;
+	}
+
+	return buf;
+}
+
+/*
+ * The datum body on a compressing connection, from ipc->file and with
+ * the tail if no iov
+ */
+static bool write_zip(struct ipc *ipc, const struct iovec *iov, int cnt,
+		uint32_t n)
+{
+	struct ipc_zip *zip = ipc->zip;
+	int fd = -1;
+	uint32_t z = 0;
+	uint64_t start;
+	bool ok;
+
+	if (iov == NULL) {
+		fd = ipc->file.fd;
+		ipc->file.fd = -1;
+	}
+
+	if (zip->skip > 0) {
+		--zip->skip;
+		++zip->stored;
+
+		if (!ipc_write_uint32_t(ipc, &z))
+			return false;
+
+		uint32_t got;
+		return (iov != NULL) ? ipc_writev(ipc, iov, cnt) :
+			ipc_write_file(ipc, fd, ipc->file.offset, n, &got) &&
+			write_tail(ipc, got);
+	}
+
+	void *buf = NULL;
+	uint32_t got = n;
+	const void *src = (iov != NULL && cnt == 1) ? iov->iov_base :
+		(buf = gather(ipc, iov, cnt, fd, n, &got));
+
+	void *dst = mpool_alloc(&ipc->mp, n);
+	if (src == NULL || dst == NULL)
+		return false;
+
+	start = now_ns();
+	z = lz_compress(zip->table, src, n, dst, n - n / 16);
+
+	uint64_t ns = now_ns() - start;
+	zip->zip_ns += ns;
+
+	if (z > 0) {
+		zip->in += n;
+		zip->out += z;
+	} else
+		++zip->stored;
+
+	ok = ipc_write_uint32_t(ipc, &z) &&
+		ipc_write(ipc, (z > 0) ? dst : src, (z > 0) ? z : n) &&
+		(iov != NULL || write_tail(ipc, got));
+
+	zip_adapt(zip, n, z, ns);
+
+	mpool_free(&ipc->mp, dst);
+	mpool_free(&ipc->mp, buf);
+	return ok;
+}
+
+/* Receive into the caller's buffer if the datum fits, else into the pool */
+bool ipc_read_datum_into(struct ipc *ipc, datum *p, void *buf,
+			uint32_t size)
 {
 	if (!ipc_read_uint32_t(ipc, &p->n))
 		return false;
 
+	bool tail = ipc->tails && (p->n & TAIL_MARK);
+	if (tail)
+		p->n &= ~TAIL_MARK;
+
 	if (p->n == 0) {
 		p->p = NULL;
 		return true;
 	}
 
-	p->p = mpool_alloc(&ipc->mp, p->n);
+	uint32_t z = 0;
+	if (zip_applies(ipc, p->n) && !ipc_read_uint32_t(ipc, &z))
+		return false;
+
+	p->p = (p->n <= size) ? buf : mpool_alloc(&ipc->mp, p->n);
 	if (p->p == NULL)
 		return false;
 
-	return ipc_read(ipc, p->p, p->n);
+	bool ok = (z > 0) ? read_zipped(ipc, p->p, p->n, z) :
+		ipc_read(ipc, p->p, p->n);
+
+	return ok && (!tail || read_tail(ipc, p));
+}
+
+bool ipc_read_datum(struct ipc *ipc, datum *p)
+{
+	struct ipc_buf dest = ipc->dest;
+
+	ipc->dest.p = NULL;
+	return ipc_read_datum_into(ipc, p, dest.p, dest.p ? dest.size : 0);
+}
+
+/* Send the pieces as one datum */
+bool ipc_write_datumv(struct ipc *ipc, const struct iovec *iov, int cnt)
+{
+	size_t size = 0;
+
+	for (int i = 0; i < cnt; ++i)
+		size += iov[i].iov_len;
+
+	if (size > UINT32_MAX || (ipc->tails && size >= TAIL_MARK))
+		return false;
+
+	uint32_t n = size;
+	if (!ipc_write_uint32_t(ipc, &n))
+		return false;
+
+	if (zip_applies(ipc, n))
+		return write_zip(ipc, iov, cnt, n);
+
+	return ipc_writev(ipc, iov, cnt);
 }
 
 bool ipc_write_datum(struct ipc *ipc, const datum *p)
 {
-	return ipc_write_uint32_t(ipc, &p->n) && ipc_write(ipc, p->p, p->n);
+	bool from_file = p->p == NULL && p->n > 0 && ipc->file.fd != -1;
+	uint32_t n = from_file ? tail_mark(ipc, p->n) : p->n;
+
+	if ((ipc->tails && p->n >= TAIL_MARK) || !ipc_write_uint32_t(ipc, &n))
+		return false;
+
+	if (zip_applies(ipc, p->n))
+		return write_zip(ipc, from_file ? NULL :
+				&(struct iovec){p->p, p->n}, 1, p->n);
+
+	if (from_file) {
+		int fd = ipc->file.fd;
+		uint32_t got;
+
+		ipc->file.fd = -1;
+		return ipc_write_file(ipc, fd, ipc->file.offset, p->n, &got) &&
+			write_tail(ipc, got);
+	}
+
+	return ipc_write(ipc, p->p, p->n);
 }
 
 bool ipc_read_string(struct ipc *ipc, string *p)
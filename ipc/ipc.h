@@ -1,37 +1,188 @@
 #ifndef __IPC_H__
 #define __IPC_H__
 
+#include <arpa/inet.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include "mpool.h"
 #include "io.h"
+#include "lz.h"
 
+/*
+ * Version of the protocol spoken by this library, and the oldest one it
+ * still speaks.  2 has the nanoseconds of the times in x_stat.
+ */
+#define IPC_VERSION 2
+#define IPC_VERSION_MIN 2
+
+/* Buffer sizes, a connection may agree on other ones */
 #define IPC_BUFFER_SIZE (32 << 10)
+#define IPC_BUFFER_MIN (4 << 10)
+#define IPC_BUFFER_MAX (16 << 20)
+
+/* Datums up to this size are always accepted */
+#define IPC_IO_MIN (128 << 10)
+
+/* Datums of this size or more are worth sending from a file */
+#define IPC_FILE_MIN (4 << 10)
 
 struct read_buffer {
-	uint8_t data[IPC_BUFFER_SIZE];
+	uint8_t *data;
+	size_t cap;
 	size_t size;
 	size_t pos;
+	uint64_t done;		/* bytes read before data[0] */
 };
 
 struct write_buffer {
-	uint8_t data[IPC_BUFFER_SIZE];
+	uint8_t *data;
+	size_t cap;
 	size_t pos;
+	uint64_t done;		/* bytes written before data[0] */
+};
+
+/* Where the next datum without data is sent from */
+struct ipc_file {
+	int fd;
+	int64_t offset;
+};
+
+/*
+ * Where the next datum received is put instead of the pool, if it fits.
+ * The caller resets it after the call.
+ */
+struct ipc_buf {
+	void *p;
+	uint32_t size;
+};
+
+/* Features a connection may agree on */
+#define IPC_FEATURE_ZIP 0x1
+#define IPC_FEATURE_VARINT 0x2
+#define IPC_FEATURE_NATIVE 0x4
+#define IPC_FEATURE_STATS 0x8	/* the server has call statistics */
+#define IPC_FEATURE_TAIL 0x10	/* datums from a file may end short */
+
+/* How integers and lengths are encoded */
+enum ipc_wire {
+	IPC_WIRE_FIXED,		/* big endian */
+	IPC_WIRE_VARINT,	/* LEB128, signed ones zigzagged */
+	IPC_WIRE_NATIVE,	/* little endian, both hosts being such */
+};
+
+/*
+ * Datum compression of a connection.  Datums are compressed while the
+ * codec takes less time than the link would for the bytes saved, and
+ * are sent stored for a backoff period otherwise.  The link rate is the
+ * delivery rate the kernel measures on the TCP socket sock; without one
+ * the link is local and faster than any codec.
+ */
+struct ipc_zip {
+	bool on;
+	int sock;
+	uint32_t skip;
+	uint32_t backoff;
+	uint64_t link_rate;
+	uint64_t link_checked;
+
+	uint64_t in;
+	uint64_t out;
+	uint64_t stored;
+	uint64_t zip_ns;
+	uint64_t unzip_ns;
+
+	uint32_t table[LZ_TABLE_SIZE];
 };
 
+/*
+ * Call statistics of a function, kept by the server dispatcher and by a
+ * client with ipc->stats.  Latency bucket i counts the calls of
+ * [2^(i-1), 2^i) ns in the phase, the last one the longer ones too.
+ */
+#define IPC_HIST_BUCKETS 32
+#define IPC_ERRNO_MAX 128
+
+/* On a client decoding is of the reply and the handler the round trip */
+enum ipc_phase {
+	IPC_PHASE_DECODE,	/* reading the arguments */
+	IPC_PHASE_HANDLER,	/* the function, deferred work included */
+	IPC_PHASE_ENCODE,	/* writing and flushing the reply */
+	IPC_PHASES,
+};
+
+struct ipc_stats {
+	uint64_t calls;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t errors[IPC_ERRNO_MAX];	/* by errno, 0 for others */
+	uint64_t hist[IPC_PHASES][IPC_HIST_BUCKETS];
+};
+
+/* The call in progress, a deferred one keeps it along with its work */
+struct ipc_call {
+	uint64_t t;
+	uint64_t in;
+	uint64_t out;
+	uint64_t ns[IPC_PHASES];
+};
+
+/*
+ * A server function may return this while defer is set and reply later
+ * with ipc_reply_<name>(), once its work is done
+ */
+#define IPC_DEFERRED INT32_MIN
+
 struct ipc {
 	bool ok;
+	bool defer;
 	struct io io;
 	struct mpool mp;
 	struct read_buffer rb;
 	struct write_buffer wb;
+	struct ipc_file file;
+	struct ipc_buf dest;
+	struct ipc_zip *zip;
+	enum ipc_wire wire;
+	bool tails;		/* IPC_FEATURE_TAIL is agreed on */
+	struct ipc_call call;
+	struct ipc_stats *stats;	/* of a client, by function id */
 };
 
-void ipc_init(struct ipc *);
+bool ipc_init(struct ipc *);
+bool ipc_resize(struct ipc *, size_t);
+void ipc_destroy(struct ipc *);
+void ipc_zip_init(struct ipc_zip *);
+
+uint32_t ipc_features(void);
+enum ipc_wire ipc_wire_of(uint32_t);
 
 bool ipc_read(struct ipc *, void *, size_t);
 bool ipc_write(struct ipc *, const void *, size_t);
+bool ipc_writev(struct ipc *, const struct iovec *, int);
 bool ipc_flush(struct ipc *);
+bool ipc_write_file(struct ipc *, int, int64_t, uint32_t, uint32_t *);
+
+/* Bytes through the connection, for the statistics */
+static inline uint64_t ipc_rx(const struct ipc *ipc)
+{
+	return ipc->rb.done + ipc->rb.pos;
+}
+
+static inline uint64_t ipc_tx(const struct ipc *ipc)
+{
+	return ipc->wb.done + ipc->wb.pos;
+}
+
+void ipc_call_start(struct ipc *, uint64_t);
+void ipc_call_decoded(struct ipc *);
+void ipc_call_handled(struct ipc *);
+void ipc_call_resumed(struct ipc *);
+void ipc_call_end(struct ipc *, struct ipc_stats *, int32_t);
+void ipc_call_sent(struct ipc *);
+void ipc_call_answered(struct ipc *);
+void ipc_call_received(struct ipc *, uint32_t, int32_t);
 
 bool ipc_read_uint32_t(struct ipc *, uint32_t *);
 bool ipc_write_uint32_t(struct ipc *, const uint32_t *);
@@ -45,6 +196,186 @@ bool ipc_write_uint64_t(struct ipc *, const uint64_t *);
 bool ipc_read_int64_t(struct ipc *, int64_t *);
 bool ipc_write_int64_t(struct ipc *, const int64_t *);
 
+/* Signed integers are zigzagged so that small negatives stay short */
+static inline uint64_t ipc_zigzag(int64_t x)
+{
+	return ((uint64_t)x << 1) ^ (uint64_t)(x >> 63);
+}
+
+static inline int64_t ipc_unzigzag(uint64_t x)
+{
+	return (int64_t)(x >> 1) ^ -(int64_t)(x & 1);
+}
+
+/*
+ * Codecs of fixed-size types check the buffer once for the most their
+ * n32 32-bit and n64 64-bit integers may take, then go through the
+ * unchecked ipc_get_*() and ipc_put_*() below.
+ */
+static inline size_t ipc_max_size(const struct ipc *ipc, size_t n32,
+				size_t n64)
+{
+	if (ipc->wire == IPC_WIRE_VARINT)
+		return n32 * 5 + n64 * 10;
+	return n32 * 4 + n64 * 8;
+}
+
+static inline bool ipc_can_read(const struct ipc *ipc, size_t size)
+{
+	return ipc->rb.pos + size <= ipc->rb.size;
+}
+
+static inline bool ipc_can_write(const struct ipc *ipc, size_t size)
+{
+	return ipc->wb.pos + size <= ipc->wb.cap;
+}
+
+static inline bool ipc_get_varint(struct ipc *ipc, uint64_t *p, unsigned max)
+{
+	const uint8_t *s = ipc->rb.data + ipc->rb.pos;
+	uint64_t x = 0;
+
+	for (unsigned i = 0; i < max; i++) {
+		x |= (uint64_t)(s[i] & 0x7f) << (7 * i);
+		if (!(s[i] & 0x80)) {
+			ipc->rb.pos += i + 1;
+			*p = x;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static inline bool ipc_put_varint(struct ipc *ipc, uint64_t x)
+{
+	uint8_t *d = ipc->wb.data + ipc->wb.pos;
+
+	while (x >= 0x80) {
+		*d++ = (x & 0x7f) | 0x80;
+		x >>= 7;
+	}
+
+	*d++ = x;
+	ipc->wb.pos = d - ipc->wb.data;
+	return true;
+}
+
+static inline bool ipc_get_uint32_t(struct ipc *ipc, uint32_t *p)
+{
+	if (ipc->wire == IPC_WIRE_VARINT) {
+		uint64_t x;
+
+		if (!ipc_get_varint(ipc, &x, 5) || x > UINT32_MAX)
+			return false;
+		*p = x;
+		return true;
+	}
+
+	uint32_t x;
+	memcpy(&x, ipc->rb.data + ipc->rb.pos, sizeof(x));
+	ipc->rb.pos += sizeof(x);
+	*p = (ipc->wire == IPC_WIRE_NATIVE) ? x : ntohl(x);
+	return true;
+}
+
+static inline bool ipc_put_uint32_t(struct ipc *ipc, const uint32_t *p)
+{
+	if (ipc->wire == IPC_WIRE_VARINT)
+		return ipc_put_varint(ipc, *p);
+
+	uint32_t x = (ipc->wire == IPC_WIRE_NATIVE) ? *p : htonl(*p);
+	memcpy(ipc->wb.data + ipc->wb.pos, &x, sizeof(x));
+	ipc->wb.pos += sizeof(x);
+	return true;
+}
+
+static inline bool ipc_get_int32_t(struct ipc *ipc, int32_t *p)
+{
+	if (ipc->wire == IPC_WIRE_VARINT) {
+		uint64_t x;
+
+		if (!ipc_get_varint(ipc, &x, 5))
+			return false;
+
+		int64_t v = ipc_unzigzag(x);
+		if (v < INT32_MIN || v > INT32_MAX)
+			return false;
+		*p = v;
+		return true;
+	}
+
+	uint32_t x;
+	ipc_get_uint32_t(ipc, &x);
+	*p = x;
+	return true;
+}
+
+static inline bool ipc_put_int32_t(struct ipc *ipc, const int32_t *p)
+{
+	if (ipc->wire == IPC_WIRE_VARINT)
+		return ipc_put_varint(ipc, ipc_zigzag(*p));
+
+	uint32_t x = *p;
+	return ipc_put_uint32_t(ipc, &x);
+}
+
+static inline bool ipc_get_uint64_t(struct ipc *ipc, uint64_t *p)
+{
+	if (ipc->wire == IPC_WIRE_VARINT)
+		return ipc_get_varint(ipc, p, 10);
+
+	if (ipc->wire == IPC_WIRE_NATIVE) {
+		memcpy(p, ipc->rb.data + ipc->rb.pos, sizeof(*p));
+		ipc->rb.pos += sizeof(*p);
+		return true;
+	}
+
+	uint32_t h, l;
+	ipc_get_uint32_t(ipc, &h);
+	ipc_get_uint32_t(ipc, &l);
+	*p = ((uint64_t)h << 32) | l;
+	return true;
+}
+
+static inline bool ipc_put_uint64_t(struct ipc *ipc, const uint64_t *p)
+{
+	if (ipc->wire == IPC_WIRE_VARINT)
+		return ipc_put_varint(ipc, *p);
+
+	if (ipc->wire == IPC_WIRE_NATIVE) {
+		memcpy(ipc->wb.data + ipc->wb.pos, p, sizeof(*p));
+		ipc->wb.pos += sizeof(*p);
+		return true;
+	}
+
+	uint32_t h = *p >> 32, l = *p;
+	return ipc_put_uint32_t(ipc, &h) && ipc_put_uint32_t(ipc, &l);
+}
+
+static inline bool ipc_get_int64_t(struct ipc *ipc, int64_t *p)
+{
+	uint64_t x;
+
+	if (!ipc_get_uint64_t(ipc, &x))
+		return false;
+
+	if (ipc->wire == IPC_WIRE_VARINT)
+		*p = ipc_unzigzag(x);
+	else
+		*p = x;
+	return true;
+}
+
+static inline bool ipc_put_int64_t(struct ipc *ipc, const int64_t *p)
+{
+	uint64_t x = *p;
+
+	if (ipc->wire == IPC_WIRE_VARINT)
+		x = ipc_zigzag(*p);
+	return ipc_put_uint64_t(ipc, &x);
+}
+
 struct datum {
 	uint32_t n;
 	void *p;
@@ -53,7 +384,9 @@ struct datum {
 typedef struct datum datum;
 
 bool ipc_read_datum(struct ipc *, datum *);
+bool ipc_read_datum_into(struct ipc *, datum *, void *, uint32_t);
 bool ipc_write_datum(struct ipc *, const datum *);
+bool ipc_write_datumv(struct ipc *, const struct iovec *, int);
 
 union string {
 	char *s;
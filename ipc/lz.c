@@ -0,0 +1,186 @@
+#define _XOPEN_SOURCE 600
+
+#include <string.h>
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define LAST_LITERALS 5
+
+static uint32_t load32(const uint8_t *p)
+{
+	uint32_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+static uint64_t load64(const uint8_t *p)
+{
+	uint64_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+static uint32_t hash(uint32_t x)
+{
+	return (x * UINT32_C(2654435761)) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *put_len(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+
+	*op++ = len;
+	return op;
+}
+
+static uint8_t *put_seq(uint8_t *op, const uint8_t *oend,
+			const uint8_t *lit, size_t nlit,
+			size_t offset, size_t match)
+{
+	/* Token, lengths, literals and the offset */
+	size_t need = 1 + nlit / 255 + 1 + nlit + 2 + match / 255 + 1;
+	if (need > (size_t)(oend - op))
+		return NULL;
+
+	uint8_t *token = op++;
+	size_t ml = (match > 0) ? match - MIN_MATCH : 0;
+
+	*token = ((nlit < 15) ? nlit : 15) << 4 | ((ml < 15) ? ml : 15);
+
+	if (nlit >= 15)
+		op = put_len(op, nlit - 15);
+
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	if (match == 0)
+		return op;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	if (ml >= 15)
+		op = put_len(op, ml - 15);
+
+	return op;
+}
+
+size_t lz_compress(uint32_t *table, const void *src, size_t n,
+		void *dst, size_t cap)
+{
+	const uint8_t *in = src, *ip = in, *anchor = in, *end = in + n;
+	uint8_t *op = dst, *oend = op + cap;
+
+	memset(table, 0, sizeof(*table) * LZ_TABLE_SIZE);
+
+	if (n > MIN_MATCH + LAST_LITERALS) {
+		const uint8_t *limit = end - LAST_LITERALS;
+
+		while (ip + MIN_MATCH <= limit) {
+			uint32_t h = hash(load32(ip));
+			const uint8_t *ref = in + table[h];
+
+			table[h] = ip - in;
+
+			if (ref >= ip || ip - ref > MAX_OFFSET ||
+				load32(ref) != load32(ip)) {
+				/* Skip faster through data that does not match */
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			const uint8_t *m = ip + MIN_MATCH;
+			ref += MIN_MATCH;
+
+			while (m + 8 <= limit && load64(m) == load64(ref)) {
+				m += 8;
+				ref += 8;
+			}
+
+			while (m < limit && *m == *ref) {
+				++m;
+				++ref;
+			}
+
+			op = put_seq(op, oend, anchor, ip - anchor,
+				m - ref, m - ip);
+			if (op == NULL)
+				return 0;
+
+			ip = anchor = m;
+		}
+	}
+
+	op = put_seq(op, oend, anchor, end - anchor, 0, 0);
+	return (op != NULL) ? (size_t)(op - (uint8_t *)dst) : 0;
+}
+
+static bool get_len(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return false;
+
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return true;
+}
+
+bool lz_decompress(const void *src, size_t n, void *dst, size_t size)
+{
+	const uint8_t *ip = src, *iend = ip + n;
+	uint8_t *op = dst, *oend = op + size;
+
+	while (ip < iend) {
+		unsigned token = *ip++;
+		size_t nlit = token >> 4;
+
+		if (nlit == 15 && !get_len(&ip, iend, &nlit))
+			return false;
+
+		if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+			return false;
+
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+
+		/* The last sequence has only literals */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return false;
+
+		size_t offset = ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+
+		size_t match = token & 15;
+		if (match == 15 && !get_len(&ip, iend, &match))
+			return false;
+
+		match += MIN_MATCH;
+
+		if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst) ||
+			match > (size_t)(oend - op))
+			return false;
+
+		const uint8_t *ref = op - offset;
+
+		if (offset >= match) {
+			memcpy(op, ref, match);
+			op += match;
+		} else {
+			while (match-- > 0)
+				*op++ = *ref++;
+		}
+	}
+
+	return op == oend;
+}
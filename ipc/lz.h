@@ -0,0 +1,26 @@
+/*
+ *               LZ codec
+ *
+ * A byte-oriented LZ77 in the LZ4 block format: a token with the literal
+ * and match lengths, the literals, a 16-bit offset back.  The compressor
+ * takes a hash table of LZ_TABLE_SIZE entries as scratch space.
+ */
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_TABLE_SIZE (1 << LZ_HASH_BITS)
+
+/* Returns the compressed size, 0 if it does not fit in cap */
+size_t lz_compress(uint32_t *table, const void *src, size_t n,
+		void *dst, size_t cap);
+
+/* Fails unless the data decodes to exactly size bytes */
+bool lz_decompress(const void *src, size_t n, void *dst, size_t size);
+
+#endif
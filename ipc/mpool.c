@@ -1,45 +1,114 @@
 #define _XOPEN_SOURCE 600
 
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include "mpool.h"
 
-static int cmp(const void *x, const void *y)
+union align {
+	long double d;
+	long long l;
+	void *p;
+	void (*f)(void);
+};
+
+#define ALIGN(n) (((n) + sizeof(union align) - 1) / sizeof(union align) \
+		* sizeof(union align))
+
+struct mpool_chunk {
+	struct mpool_chunk *next;
+	size_t size;
+	size_t used;
+	union align data[];
+};
+
+struct header {
+	struct mpool_chunk *chunk;
+	size_t size;
+};
+
+#define HDR_SIZE ALIGN(sizeof(struct header))
+
+static struct header *header(void *p)
+{
+	return (struct header *)((char *)p - HDR_SIZE);
+}
+
+static bool is_last(const struct header *h)
 {
-	return (x < y) ? -1 : (x > y) ? 1 : 0;
+	const struct mpool_chunk *c = h->chunk;
+
+	return (const char *)h + HDR_SIZE + ALIGN(h->size) ==
+		(const char *)c->data + c->used;
 }
 
 void mpool_init(struct mpool *mp)
 {
-	avl_init(&mp->mem, 0, cmp);
+	mp->chunks = NULL;
+	mp->spare = NULL;
+	mp->kept = 0;
+	mp->keep = 0;
 }
 
 void mpool_cleanup(struct mpool *mp)
 {
-	avl_traverse(&mp->mem, free);
-	mp->mem.root = NULL;
+	while (mp->chunks != NULL) {
+		struct mpool_chunk *c = mp->chunks;
+		mp->chunks = c->next;
+
+		if (mp->kept + c->size <= mp->keep) {
+			c->next = mp->spare;
+			mp->spare = c;
+			mp->kept += c->size;
+		} else
+			free(c);
+	}
 }
 
-void *mpool_realloc(struct mpool *mp, void *p, size_t size)
+void mpool_keep(struct mpool *mp, size_t size)
 {
-	if (size == 0) {
-		mpool_free(mp, p);
-		return NULL;
+	mp->keep = size;
+
+	while (mp->kept > mp->keep) {
+		struct mpool_chunk *c = mp->spare;
+
+		mp->spare = c->next;
+		mp->kept -= c->size;
+		free(c);
 	}
+}
 
-	if (p == NULL)
-		return mpool_alloc(mp, size);
+void mpool_destroy(struct mpool *mp)
+{
+	mpool_cleanup(mp);
+	mpool_keep(mp, 0);
+}
+
+static struct mpool_chunk *chunk_get(struct mpool *mp, size_t size)
+{
+	struct mpool_chunk *c;
 
-	struct avl_node *q = p;
-	q--;
-	avl_remove(&mp->mem, q);
+	for (struct mpool_chunk **p = &mp->spare; *p != NULL; p = &c->next) {
+		c = *p;
 
-	struct avl_node *r = realloc(q, sizeof(struct avl_node) + size);
-	if (r != NULL) {
-		avl_insert(&mp->mem, r);
-		r++;
+		if (c->size >= size) {
+			*p = c->next;
+			mp->kept -= c->size;
+			c->used = 0;
+			return c;
+		}
 	}
 
-	return r;
+	if (size < MPOOL_CHUNK_SIZE)
+		size = MPOOL_CHUNK_SIZE;
+
+	c = malloc(sizeof(*c) + size);
+	if (c != NULL) {
+		c->size = size;
+		c->used = 0;
+	}
+
+	return c;
 }
 
 void *mpool_alloc(struct mpool *mp, size_t size)
@@ -47,23 +116,71 @@ void *mpool_alloc(struct mpool *mp, size_t size)
 	if (size == 0)
 		return NULL;
 
-	struct avl_node *p = malloc(sizeof(struct avl_node) + size);
-	if (p != NULL) {
-		avl_insert(&mp->mem, p);
-		p++;
+	size_t need = HDR_SIZE + ALIGN(size);
+	struct mpool_chunk *c = mp->chunks;
+
+	if (c == NULL || c->size - c->used < need) {
+		c = chunk_get(mp, need);
+		if (c == NULL)
+			return NULL;
+
+		/* A big block does not retire the chunk being filled */
+		if (mp->chunks != NULL && need > MPOOL_CHUNK_SIZE / 2) {
+			c->next = mp->chunks->next;
+			mp->chunks->next = c;
+		} else {
+			c->next = mp->chunks;
+			mp->chunks = c;
+		}
+	}
+
+	struct header *h = (struct header *)((char *)c->data + c->used);
+	h->chunk = c;
+	h->size = size;
+	c->used += need;
+
+	return (char *)h + HDR_SIZE;
+}
+
+void *mpool_realloc(struct mpool *mp, void *p, size_t size)
+{
+	if (size == 0) {
+		mpool_free(mp, p);
+		return NULL;
+	}
+
+	if (p == NULL)
+		return mpool_alloc(mp, size);
+
+	struct header *h = header(p);
+	struct mpool_chunk *c = h->chunk;
+
+	/* The last block grows or shrinks in place */
+	if (is_last(h) && ALIGN(size) <= ALIGN(h->size) + c->size - c->used) {
+		c->used = (char *)p - (char *)c->data + ALIGN(size);
+		h->size = size;
+		return p;
 	}
 
-	return p;
+	if (size <= h->size)
+		return p;
+
+	void *q = mpool_alloc(mp, size);
+	if (q != NULL)
+		memcpy(q, p, h->size);
+
+	return q;
 }
 
 void mpool_free(struct mpool *mp, void *p)
 {
+	(void)mp;
+
 	if (p == NULL)
 		return;
 
-	struct avl_node *q = p;
-	q--;
+	struct header *h = header(p);
 
-	avl_remove(&mp->mem, q);
-	free(q);
+	if (is_last(h))
+		h->chunk->used -= HDR_SIZE + ALIGN(h->size);
 }
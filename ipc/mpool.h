@@ -1,15 +1,34 @@
+/*
+ *               Memory pool
+ *
+ * Allocations are bumped out of chunks and are released all at once by
+ * mpool_cleanup().  A pool may retain up to mpool_keep() bytes of chunks
+ * for the next round instead of giving them back to malloc; such a pool
+ * is released with mpool_destroy().  mpool_free() and mpool_realloc()
+ * reuse the space of the last allocation only.
+ */
+
 #ifndef __MPOOL_H__
 #define __MPOOL_H__
 
 #include <sys/types.h>
-#include "avl.h"
+
+#define MPOOL_CHUNK_SIZE (64 << 10)
+#define MPOOL_KEEP (256 << 10)
+
+struct mpool_chunk;
 
 struct mpool {
-	struct avl mem;
+	struct mpool_chunk *chunks;
+	struct mpool_chunk *spare;
+	size_t kept;
+	size_t keep;
 };
 
 void mpool_init(struct mpool *);
 void mpool_cleanup(struct mpool *);
+void mpool_keep(struct mpool *, size_t);
+void mpool_destroy(struct mpool *);
 void *mpool_alloc(struct mpool *, size_t);
 void *mpool_realloc(struct mpool *, void *, size_t);
 void mpool_free(struct mpool *, void *);
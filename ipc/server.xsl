@@ -1,43 +1,178 @@
 <?xml version="1.0"?>
 <xsl:stylesheet version="1.0" xmlns:xsl="http://www.w3.org/1999/XSL/Transform">
+  <xsl:include href="wire.xsl"/>
   <xsl:output method="text"/>
   <xsl:template match="/">
     #include &quot;<xsl:value-of select="//@name"/>.h&quot;
+    struct ipc_stats ipc_stats_<xsl:value-of select="//@name"/>[
+    <xsl:call-template name="funcs"/>];
+    <xsl:apply-templates select="//func" mode="reply"/>
     bool ipc_process_<xsl:value-of select="//@name"/>(struct ipc *ipc)
     {
     uint32_t id;
+    int32_t result = 0;
+    uint64_t rx = ipc_rx(ipc);
     if (!ipc_read_uint32_t(ipc, &amp;id))
     return false;
+    ipc_call_start(ipc, rx);
     switch(id){
     <xsl:apply-templates/>
     default:
     return false;
     }
     mpool_cleanup(&amp;ipc-&gt;mp);
-    return ipc-&gt;ok &amp;&amp; ipc_flush(ipc);
+    if (!ipc-&gt;ok || !ipc_flush(ipc))
+    return false;
+    if (result != IPC_DEFERRED)
+    ipc_call_end(ipc, &amp;ipc_stats_<xsl:value-of select="//@name"/>[id],
+    result);
+    return true;
     }
 </xsl:template>
+  <!--
+    Arguments and replies made of fixed-size types only are read and
+    written with one check of the buffer when it has room for them.
+  -->
   <xsl:template match="func">
+    <xsl:variable name="in-size">
+      <xsl:for-each select="in">
+        <xsl:call-template name="wire-size">
+          <xsl:with-param name="type" select="@type"/>
+        </xsl:call-template>
+      </xsl:for-each>
+    </xsl:variable>
+    <xsl:variable name="out-size">
+      <xsl:for-each select="out">
+        <xsl:call-template name="wire-size">
+          <xsl:with-param name="type" select="@type"/>
+        </xsl:call-template>
+      </xsl:for-each>
+    </xsl:variable>
     case <xsl:value-of select="@id"/>: {
     <xsl:for-each select="*">
       <xsl:value-of select="@type"/><xsl:text> </xsl:text>
       <xsl:value-of select="@name"/>;
     </xsl:for-each>
-    int32_t result;
     ipc-&gt;ok = (
+    <xsl:if test="in and not(contains($in-size, 'x'))">
+      (ipc_can_read(ipc, <xsl:call-template name="max-size">
+        <xsl:with-param name="size" select="$in-size"/>
+      </xsl:call-template>) ? (
+      <xsl:for-each select="in">
+        ipc_get_<xsl:value-of select="@type"/>
+        (ipc, &amp;<xsl:value-of select="@name"/>) &amp;&amp;
+      </xsl:for-each> true) :
+    </xsl:if>
+    (
     <xsl:for-each select="in">
       ipc_read_<xsl:value-of select="@type"/>
       (ipc, &amp;<xsl:value-of select="@name"/>) &amp;&amp;
-    </xsl:for-each>
-    ((result = <xsl:value-of select="@name"/>(ipc
-    <xsl:apply-templates/>)), ipc_write_int32_t(ipc, &amp;result)));
+    </xsl:for-each> true)
+    <xsl:if test="in and not(contains($in-size, 'x'))">)</xsl:if>);
+    ipc_call_decoded(ipc);
+    if (ipc-&gt;ok) {
+    result = <xsl:value-of select="@name"/>(ipc
+    <xsl:apply-templates/>);
+    ipc_call_handled(ipc);
+    ipc-&gt;ok = result == IPC_DEFERRED ||
+    ipc_write_int32_t(ipc, &amp;result);
+    }
     if (ipc-&gt;ok &amp;&amp; result == 0) {
-    ipc-&gt;ok = ipc-&gt;ok
+    ipc-&gt;ok =
+    <xsl:if test="out and not(contains($out-size, 'x'))">
+      ipc_can_write(ipc, <xsl:call-template name="max-size">
+        <xsl:with-param name="size" select="$out-size"/>
+      </xsl:call-template>) ? (
+      <xsl:for-each select="out">
+        ipc_put_<xsl:value-of select="@type"/>
+        (ipc, &amp;<xsl:value-of select="@name"/>) &amp;&amp;
+      </xsl:for-each> true) :
+    </xsl:if>
+    (
+    <xsl:for-each select="out">
+      ipc_write_<xsl:value-of select="@type"/>
+      (ipc, &amp;<xsl:value-of select="@name"/>) &amp;&amp;
+    </xsl:for-each> true);
+    }
+    }
+    break;
+  </xsl:template>
+  <!--
+    A deferred call replies on its own, after the request has gone and
+    with the outputs kept by the function.  ipc-&gt;call is to be what it
+    was when the function returned, for the statistics.
+  -->
+  <xsl:template match="func" mode="reply">
+    bool ipc_reply_<xsl:value-of select="@name"/>
+    (struct ipc *ipc, int32_t result
     <xsl:for-each select="out">
-      &amp;&amp; ipc_write_<xsl:value-of select="@type"/>
-      (ipc, &amp;<xsl:value-of select="@name"/>)
-    </xsl:for-each>;
+      , const <xsl:value-of select="@type"/>
+      *<xsl:value-of select="@name"/>
+    </xsl:for-each>)
+    {
+    ipc_call_resumed(ipc);
+    ipc-&gt;ok = ipc_write_int32_t(ipc, &amp;result) &amp;&amp;
+    ((result != 0) || (
+    <xsl:for-each select="out">
+      ipc_write_<xsl:value-of select="@type"/>
+      (ipc, <xsl:value-of select="@name"/>) &amp;&amp;
+    </xsl:for-each> true));
+    mpool_cleanup(&amp;ipc-&gt;mp);
+    if (!ipc-&gt;ok || !ipc_flush(ipc))
+    return false;
+    ipc_call_end(ipc, &amp;ipc_stats_<xsl:value-of select="//@name"/>[
+    <xsl:value-of select="@id"/>], result);
+    return true;
     }
+  </xsl:template>
+  <!--
+    A compound runs its steps in order and stops at the first error.  Each
+    step replies right after it has run.  A bound argument takes an output
+    of an earlier step, like the key of a file opened by the first one.
+    The replies of the steps count as handling, the flush as encoding.
+  -->
+  <xsl:template match="compound">
+    case <xsl:value-of select="@id"/>: {
+    <xsl:for-each select="step">
+      <xsl:variable name="i" select="position()"/>
+      <xsl:for-each select="//func[@name = current()/@func]/*">
+        <xsl:value-of select="@type"/>
+        s<xsl:value-of select="$i"/>_<xsl:value-of select="@name"/>;
+      </xsl:for-each>
+    </xsl:for-each>
+    bool defer = ipc-&gt;defer;
+    ipc-&gt;defer = false;
+    ipc-&gt;ok = (
+    <xsl:for-each select="step">
+      <xsl:variable name="i" select="position()"/>
+      <xsl:variable name="step" select="."/>
+      <xsl:for-each select="//func[@name = $step/@func]/in[not(@name = $step/bind/@name)]">
+        ipc_read_<xsl:value-of select="@type"/>
+        (ipc, &amp;s<xsl:value-of select="$i"/>_<xsl:value-of select="@name"/>) &amp;&amp;
+      </xsl:for-each>
+    </xsl:for-each> true);
+    ipc_call_decoded(ipc);
+    <xsl:for-each select="step">
+      <xsl:variable name="i" select="position()"/>
+      if (ipc-&gt;ok &amp;&amp; result == 0) {
+      <xsl:for-each select="bind">
+        s<xsl:value-of select="$i"/>_<xsl:value-of select="@name"/> =
+        s<xsl:value-of select="@step"/>_<xsl:value-of select="@out"/>;
+      </xsl:for-each>
+      result = <xsl:value-of select="@func"/>(ipc
+      <xsl:for-each select="//func[@name = current()/@func]/*">
+        , &amp;s<xsl:value-of select="$i"/>_<xsl:value-of select="@name"/>
+      </xsl:for-each>);
+      ipc-&gt;ok = ipc_write_int32_t(ipc, &amp;result)
+      &amp;&amp; ((result != 0) || (
+      <xsl:for-each select="//func[@name = current()/@func]/out">
+        ipc_write_<xsl:value-of select="@type"/>
+        (ipc, &amp;s<xsl:value-of select="$i"/>_<xsl:value-of select="@name"/>) &amp;&amp;
+      </xsl:for-each> true));
+      }
+    </xsl:for-each>
+    ipc_call_handled(ipc);
+    ipc-&gt;defer = defer;
     }
     break;
   </xsl:template>
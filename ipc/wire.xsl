@@ -0,0 +1,42 @@
+<?xml version="1.0"?>
+<xsl:stylesheet version="1.0" xmlns:xsl="http://www.w3.org/1999/XSL/Transform">
+  <!--
+    Wire size of a type, one letter per integer in it: a for 32 bits, b
+    for 64 bits and x for anything of variable size.
+  -->
+  <xsl:template name="wire-size">
+    <xsl:param name="type"/>
+    <xsl:choose>
+      <xsl:when test="$type = 'uint32_t' or $type = 'int32_t'">a</xsl:when>
+      <xsl:when test="$type = 'uint64_t' or $type = 'int64_t'">b</xsl:when>
+      <xsl:when test="//alias[@name = $type]">
+        <xsl:call-template name="wire-size">
+          <xsl:with-param name="type" select="//alias[@name = $type]/@type"/>
+        </xsl:call-template>
+      </xsl:when>
+      <xsl:when test="//type[@name = $type]">
+        <xsl:for-each select="//type[@name = $type]/field">
+          <xsl:call-template name="wire-size">
+            <xsl:with-param name="type" select="@type"/>
+          </xsl:call-template>
+        </xsl:for-each>
+      </xsl:when>
+      <xsl:otherwise>x</xsl:otherwise>
+    </xsl:choose>
+  </xsl:template>
+  <!-- Most bytes a fixed-size wire size takes in the current encoding -->
+  <xsl:template name="max-size">
+    <xsl:param name="size"/>
+    ipc_max_size(ipc, <xsl:value-of select="string-length(translate($size, 'b', ''))"/>,
+    <xsl:value-of select="string-length(translate($size, 'a', ''))"/>)
+  </xsl:template>
+  <!-- Number of ids of functions and compounds, the highest one and 1 -->
+  <xsl:template name="funcs">
+    <xsl:for-each select="//func/@id | //compound/@id">
+      <xsl:sort data-type="number" order="descending"/>
+      <xsl:if test="position() = 1">
+        <xsl:value-of select=". + 1"/>
+      </xsl:if>
+    </xsl:for-each>
+  </xsl:template>
+</xsl:stylesheet>
@@ -3,13 +3,19 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <io_file.h>
+#include <io_mux.h>
+#include <io_ring.h>
 
 #include "rfsc.h"
 
@@ -17,17 +23,276 @@ struct state {
 	int help_mode;
 	char *host;
 	char *port;
+	unsigned cache_size;
+	unsigned readahead;
+	unsigned write_buffer;
+	unsigned attr_ttl;
+	unsigned neg_ttl;
+	unsigned compress;
+	char *wire;
+	unsigned buffer_size;
+	char *ring;
 };
 
 static struct state S = {
 	.help_mode = 0,
 	.host = NULL,
 	.port = NULL,
+	.cache_size = 64,
+	.readahead = 1024,
+	.write_buffer = 1024,
+	.attr_ttl = 1,
+	.neg_ttl = 1,
+	.compress = 1,
+	.wire = NULL,
+	.buffer_size = IPC_BUFFER_SIZE >> 10,
+	.ring = NULL,
+};
+
+struct thread {
+	struct ipc ipc;
+	struct io_mux_channel ch;
+	struct ipc_zip zip;
+	struct ipc_stats stats[RFS_FUNCS];
+	struct thread *prev, *next;
 };
 
 static int sock = -1;
+static struct io_ring *ring;
+static struct io_mux mux;
+static pthread_key_t thread_key;
+static pthread_mutex_t recover_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t reconnects;
+static uint32_t wire_offer;
+
+/* What the last r_hello() agreed on */
+static x_hello agreed = {
+	.version = IPC_VERSION,
+	.features = 0,
+	.buffer_size = IPC_BUFFER_SIZE,
+	.max_io = IPC_IO_MIN,
+};
+
+/* Threads are listed for the compression and call counters */
+static struct thread *threads;
+static struct zip_stats zip_gone;
+static struct ipc_stats stats_gone[RFS_FUNCS];
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void zip_add(struct zip_stats *s, const struct ipc_zip *zip)
+{
+	s->in += zip->in;
+	s->out += zip->out;
+	s->stored += zip->stored;
+	s->zip_ns += zip->zip_ns;
+	s->unzip_ns += zip->unzip_ns;
+}
+
+static void stats_add(struct ipc_stats *s, const struct ipc_stats *x)
+{
+	for (size_t id = 0; id < RFS_FUNCS; ++id, ++s, ++x) {
+		s->calls += x->calls;
+		s->bytes_in += x->bytes_in;
+		s->bytes_out += x->bytes_out;
+
+		for (int i = 0; i < IPC_ERRNO_MAX; ++i)
+			s->errors[i] += x->errors[i];
+
+		for (int i = 0; i < IPC_PHASES; ++i) {
+			for (int j = 0; j < IPC_HIST_BUCKETS; ++j)
+				s->hist[i][j] += x->hist[i][j];
+		}
+	}
+}
+
+static bool thread_init(struct thread *t, struct io_mux *mux)
+{
+	if (!ipc_init(&t->ipc)) {
+		ipc_destroy(&t->ipc);
+		return false;
+	}
+
+	mpool_keep(&t->ipc.mp, MPOOL_KEEP);
+	t->ipc.ok = true;
+	io_mux_client_init(&t->ipc.io, &t->ch, mux);
+
+	ipc_zip_init(&t->zip);
+	t->ipc.zip = &t->zip;
+
+	memset(t->stats, 0, sizeof(t->stats));
+	t->ipc.stats = t->stats;
+
+	pthread_mutex_lock(&threads_lock);
+	t->prev = NULL;
+	t->next = threads;
+	if (threads != NULL)
+		threads->prev = t;
+	threads = t;
+	pthread_mutex_unlock(&threads_lock);
+	return true;
+}
+
+static void thread_free(void *p)
+{
+	struct thread *t = p;
+
+	pthread_mutex_lock(&threads_lock);
+	if (t->prev != NULL)
+		t->prev->next = t->next;
+	else
+		threads = t->next;
+	if (t->next != NULL)
+		t->next->prev = t->prev;
+	zip_add(&zip_gone, &t->zip);
+	stats_add(stats_gone, t->stats);
+	pthread_mutex_unlock(&threads_lock);
+
+	ipc_destroy(&t->ipc);
+	free(t);
+}
+
+/*
+ * Drop what is left from a failed call.  On a connection still up the
+ * rest of the reply is left to the mux to drop, so it holds up nobody.
+ */
+static bool thread_restart(struct thread *t)
+{
+	if (!io_mux_stale(&t->ch))
+		io_mux_abandon(&t->ch);
+
+	ipc_destroy(&t->ipc);
+	if (!ipc_init(&t->ipc))
+		return false;
+
+	mpool_keep(&t->ipc.mp, MPOOL_KEEP);
+	t->ipc.ok = true;
+	t->ipc.zip = &t->zip;
+	t->ipc.stats = t->stats;
+	return true;
+}
+
+void rfs_zip_stats(struct zip_stats *s)
+{
+	pthread_mutex_lock(&threads_lock);
+
+	*s = zip_gone;
+	for (const struct thread *t = threads; t != NULL; t = t->next)
+		zip_add(s, &t->zip);
+
+	pthread_mutex_unlock(&threads_lock);
+}
+
+/* s has room for RFS_FUNCS */
+void rfs_call_stats(struct ipc_stats *s)
+{
+	pthread_mutex_lock(&threads_lock);
+
+	memcpy(s, stats_gone, sizeof(stats_gone));
+	for (const struct thread *t = threads; t != NULL; t = t->next)
+		stats_add(s, t->stats);
+
+	pthread_mutex_unlock(&threads_lock);
+}
+
+struct ipc *rfs_ipc(void)
+{
+	struct thread *t = pthread_getspecific(thread_key);
+
+	if (t == NULL) {
+		t = malloc(sizeof(*t));
+		if (t == NULL)
+			return NULL;
+
+		if (!thread_init(t, &mux)) {
+			free(t);
+			return NULL;
+		}
+
+		if (pthread_setspecific(thread_key, t) != 0) {
+			thread_free(t);
+			return NULL;
+		}
+	} else if (!t->ipc.ok && !thread_restart(t)) {
+		return NULL;
+	}
+
+	/* As agreed on with the server the last time */
+	t->zip.on = agreed.features & IPC_FEATURE_ZIP;
+	t->zip.sock = sock;
+	t->ipc.wire = ipc_wire_of(agreed.features);
+	t->ipc.tails = agreed.features & IPC_FEATURE_TAIL;
+	if (t->ipc.rb.cap != agreed.buffer_size)
+		ipc_resize(&t->ipc, agreed.buffer_size);
+	return &t->ipc;
+}
+
+uint32_t rfs_max_io(void)
+{
+	return agreed.max_io;
+}
+
+uint32_t rfs_features(void)
+{
+	return agreed.features;
+}
+
+/*
+ * Whether the server speaks a version we do and kept to what was offered,
+ * sizes may only shrink
+ */
+static bool hello_valid(const x_hello *offer, const x_hello *h)
+{
+	return h->version >= IPC_VERSION_MIN &&
+		h->version <= offer->version &&
+		(h->features & ~offer->features) == 0 &&
+		h->buffer_size >= IPC_BUFFER_MIN &&
+		h->buffer_size <= offer->buffer_size &&
+		h->max_io >= IPC_IO_MIN && h->max_io <= offer->max_io;
+}
 
-static bool rfs_connect(uint64_t last_key)
+static bool rfs_handshake(const struct io *io, uint64_t last_key,
+			x_hello *h)
+{
+	struct thread *t = malloc(sizeof(*t));
+	if (t == NULL)
+		return false;
+
+	struct io_mux hs;
+	io_mux_init(&hs, io);
+	if (!thread_init(t, &hs)) {
+		io_mux_destroy(&hs);
+		free(t);
+		return false;
+	}
+
+	/* Reads and write-back extents as large as configured */
+	uint32_t max_io = (S.readahead > S.write_buffer) ?
+		S.readahead : S.write_buffer;
+
+	const x_hello offer = {
+		.version = IPC_VERSION,
+		.features = wire_offer | IPC_FEATURE_STATS | IPC_FEATURE_TAIL |
+			(S.compress ? IPC_FEATURE_ZIP : 0),
+		.buffer_size = S.buffer_size << 10,
+		.max_io = (max_io > IPC_IO_MIN >> 10) ?
+			max_io << 10 : IPC_IO_MIN,
+	};
+
+	bool ok = r_hello(&t->ipc, &offer, h) == 0 && hello_valid(&offer, h);
+
+	/* The server goes by the agreement from the next call on */
+	if (ok) {
+		t->zip.on = h->features & IPC_FEATURE_ZIP;
+		t->ipc.wire = ipc_wire_of(h->features);
+		ok = r_set_key(&t->ipc, &last_key) == 0;
+	}
+
+	io_mux_destroy(&hs);
+	thread_free(t);
+	return ok;
+}
+
+static int connect_tcp(void)
 {
 	const struct addrinfo hints = {
 		.ai_family = AF_UNSPEC,
@@ -36,59 +301,158 @@ static bool rfs_connect(uint64_t last_key)
 
 	struct addrinfo *list, *p;
 	if (getaddrinfo(S.host, S.port, &hints, &list) != 0)
-		return false;
+		return -1;
 
+	int fd = -1;
 	for (p = list; p != NULL; p = p->ai_next) {
-		sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-		if (sock == -1)
+		fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (fd == -1)
 			continue;
 
 		int keepalive = 1;
-		if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE,
+		if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE,
 				&keepalive, sizeof(keepalive)) == -1)
 			goto fail;
 
 		int tcp_nodelay = 1;
-		if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
 				&tcp_nodelay, sizeof(tcp_nodelay)) == -1)
 			goto fail;
 
-		if (connect(sock, p->ai_addr, p->ai_addrlen) == 0)
+		if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
 			break;
 
 	fail:
-		close(sock);
-		sock = -1;
+		close(fd);
+		fd = -1;
 	}
 
 	freeaddrinfo(list);
+	return fd;
+}
 
-	if (sock == -1)
-		return false;
+/* A server on the same host is reached through a shared memory ring */
+static struct io_ring *connect_ring(void)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(S.ring) >= sizeof(addr.sun_path))
+		return NULL;
 
-	ipc_init(&ipc);
-	io_file_init(&ipc.io, sock);
+	strcpy(addr.sun_path, S.ring);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return NULL;
+
+	struct io_ring *r = malloc(sizeof(*r));
+
+	if (r == NULL ||
+		connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		free(r);
+		close(fd);
+		return NULL;
+	}
+
+	if (!io_ring_connect(r, fd, IO_RING_SIZE)) {
+		free(r);
+		close(fd);
+		return NULL;
+	}
+
+	return r;
+}
+
+/* reset drops what was of the old session before any call can go out */
+static bool rfs_connect(uint64_t last_key, void (*reset)(void))
+{
+	struct io_ring *r = NULL;
+	struct io io;
+	int fd = -1;
+
+	if (S.ring != NULL) {
+		r = connect_ring();
+		if (r == NULL)
+			return false;
+
+		io_ring_init(&io, r);
+	} else {
+		fd = connect_tcp();
+		if (fd == -1)
+			return false;
+
+		io_file_init(&io, fd);
+	}
+
+	x_hello h;
+	if (!rfs_handshake(&io, last_key, &h)) {
+		if (r != NULL) {
+			io_ring_destroy(r);
+			free(r);
+		} else {
+			close(fd);
+		}
 
-	if (r_set_key(&ipc, &last_key) != 0) {
-		close(sock);
 		return false;
 	}
 
+	agreed = h;
+
+	if (ring != NULL)
+		io_ring_shutdown(ring);
+	else if (sock != -1)
+		shutdown(sock, SHUT_RDWR);
+
+	/* Calls still on the old connection fail now rather than wait */
+	if (reset != NULL)
+		reset();
+
+	io_mux_reset(&mux, &io);
+	rfs_destroy();
+	sock = fd;
+	ring = r;
+
 	return true;
 }
 
 void rfs_destroy(void)
 {
+	if (ring != NULL) {
+		io_ring_destroy(ring);
+		free(ring);
+		ring = NULL;
+	}
+
 	if (sock != -1) {
 		close(sock);
 		sock = -1;
 	}
 }
 
-bool rfs_recover(uint64_t last_key)
+bool rfs_recover(struct ipc *ipc, uint64_t last_key, void (*reset)(void))
 {
-	rfs_destroy();
-	return rfs_connect(last_key);
+	struct thread *t = (struct thread *)ipc;
+
+	/* Only the first caller that lost the connection reconnects */
+	pthread_mutex_lock(&recover_lock);
+	bool done = !io_mux_stale(&t->ch) && rfs_connect(last_key, reset);
+	if (done)
+		++reconnects;
+	pthread_mutex_unlock(&recover_lock);
+
+	/* Without a new connection the old one goes on without the call */
+	if (!done)
+		thread_restart(t);
+
+	return done;
+}
+
+uint64_t rfs_reconnects(void)
+{
+	pthread_mutex_lock(&recover_lock);
+	uint64_t n = reconnects;
+	pthread_mutex_unlock(&recover_lock);
+
+	return n;
 }
 
 static struct fuse_opt fs_opts[] = {
@@ -96,15 +460,50 @@ static struct fuse_opt fs_opts[] = {
 	{"--help", offsetof(struct state, help_mode), 1},
 	{"host=%s", offsetof(struct state, host), 0},
 	{"port=%s", offsetof(struct state, port), 0},
+	{"cache_size=%u", offsetof(struct state, cache_size), 0},
+	{"readahead=%u", offsetof(struct state, readahead), 0},
+	{"write_buffer=%u", offsetof(struct state, write_buffer), 0},
+	{"attr_ttl=%u", offsetof(struct state, attr_ttl), 0},
+	{"neg_ttl=%u", offsetof(struct state, neg_ttl), 0},
+	{"compress=%u", offsetof(struct state, compress), 0},
+	{"wire=%s", offsetof(struct state, wire), 0},
+	{"buffer_size=%u", offsetof(struct state, buffer_size), 0},
+	{"ring=%s", offsetof(struct state, ring), 0},
 	FUSE_OPT_END
 };
 
+static bool parse_wire(const char *s)
+{
+	if (s == NULL || strcmp(s, "varint") == 0)
+		wire_offer = IPC_FEATURE_VARINT;
+	else if (strcmp(s, "native") == 0)
+		/* Only offered by a little endian host */
+		wire_offer = IPC_FEATURE_NATIVE & ipc_features();
+	else if (strcmp(s, "fixed") == 0)
+		wire_offer = 0;
+	else
+		return false;
+	return true;
+}
+
 static const char help_tmpl[] =
 	"Usage: %s mountpoint [options]\n"
 	"\n"
 	"FS options:\n"
 	"    -o host=HOST           server host\n"
 	"    -o port=PORT           server port\n"
+	"    -o cache_size=N        read cache size in MiB (default: 64)\n"
+	"    -o readahead=N         max read-ahead in KiB (default: 1024)\n"
+	"    -o write_buffer=N      write-back buffer in KiB (default: 1024)\n"
+	"    -o attr_ttl=N          attribute cache TTL in seconds (default: 1)\n"
+	"    -o neg_ttl=N           missing paths TTL in seconds (default: 1)\n"
+	"    -o compress=N          compress data if it pays off (default: 1)\n"
+	"    -o wire=ENCODING       integers as fixed, varint or native\n"
+	"                           (default: varint)\n"
+	"    -o buffer_size=N       IPC buffers in KiB, from 4 to 16384\n"
+	"                           (default: 32)\n"
+	"    -o ring=PATH           talk to a server on this host through\n"
+	"                           shared memory, rendezvous at PATH\n"
 	"\n";
 
 int main(int argc, char **argv)
@@ -114,16 +513,39 @@ int main(int argc, char **argv)
 	if (fuse_opt_parse(&args, &S, fs_opts, NULL) == -1)
 		return 1;
 
+	if (!S.help_mode && !parse_wire(S.wire)) {
+		fprintf(stderr, "%s: unknown wire encoding %s\n", args.argv[0],
+			S.wire);
+		return 2;
+	}
+
+	if (!S.help_mode && (S.buffer_size < IPC_BUFFER_MIN >> 10 ||
+			S.buffer_size > IPC_BUFFER_MAX >> 10)) {
+		fprintf(stderr, "%s: buffer size must be from %d to %d KiB\n",
+			args.argv[0], IPC_BUFFER_MIN >> 10,
+			IPC_BUFFER_MAX >> 10);
+		return 2;
+	}
+
 	if (S.help_mode) {
 		fprintf(stderr, help_tmpl, args.argv[0]);
 
 		if (fuse_opt_add_arg(&args, "-ho") == -1)
 			return 3;
 	} else {
-		if (fuse_opt_add_arg(&args, "-s") == -1)
+		if (pthread_key_create(&thread_key, thread_free) != 0)
 			return 4;
 
-		if (!rfs_connect(0))
+		bcache_init((size_t)S.cache_size << 20,
+			(size_t)S.readahead << 10);
+		wback_init((size_t)S.write_buffer << 10);
+		acache_init(S.attr_ttl, S.neg_ttl);
+
+		struct io none;
+		io_file_init(&none, -1);
+		io_mux_init(&mux, &none);
+
+		if (!rfs_connect(0, NULL))
 			return 5;
 	}
 
@@ -5,8 +5,70 @@
 
 #include "rfs.h"
 
-struct ipc ipc;
-const struct fuse_operations fs_ops;
+extern const struct fuse_operations fs_ops;
 
-bool rfs_recover(uint64_t last_key);
+/* Start a new session once a call has found the connection lost */
+void fs_recover(struct ipc *ipc);
+
+struct zip_stats {
+	uint64_t in;
+	uint64_t out;
+	uint64_t stored;
+	uint64_t zip_ns;
+	uint64_t unzip_ns;
+};
+
+/* Functions of the protocol, by id */
+#define RFS_FUNCS (sizeof(ipc_stats_rfs) / sizeof(*ipc_stats_rfs))
+
+struct ipc *rfs_ipc(void);
+bool rfs_recover(struct ipc *ipc, uint64_t last_key, void (*reset)(void));
+uint32_t rfs_max_io(void);
+uint32_t rfs_features(void);
+void rfs_zip_stats(struct zip_stats *s);
+void rfs_call_stats(struct ipc_stats *s);
+uint64_t rfs_reconnects(void);
 void rfs_destroy(void);
+
+void acache_init(unsigned ttl, unsigned missing_ttl);
+bool acache_get(const char *path, x_stat *st);
+bool acache_missing(const char *path);
+void acache_put(const char *path, const x_stat *st);
+void acache_put_missing(const char *path);
+void acache_forget(const char *path);
+void acache_changed(const char *path);
+void acache_forget_tree(const char *path);
+void acache_clear(void);
+void acache_stats(uint64_t *hits, uint64_t *misses, uint64_t *missing);
+char *path_moved(const char *path, const char *from, const char *to);
+
+void bcache_init(size_t size, size_t readahead);
+void bcache_start(void);
+void bcache_stop(void);
+int32_t bcache_read(struct ipc *ipc, uint64_t key, void *buf, uint32_t size,
+		x_off offset, uint32_t *done);
+void bcache_attr(uint64_t key, const x_stat *st);
+void bcache_open(uint64_t key, const char *path);
+void bcache_rename(const char *from, const char *to);
+void bcache_invalidate(uint64_t key, const char *path, x_off offset,
+		uint64_t size);
+void bcache_forget(uint64_t key);
+void bcache_clear(void);
+void bcache_stats(uint64_t *hits, uint64_t *misses);
+
+void wback_init(size_t size);
+void wback_start(void);
+void wback_stop(void);
+int32_t wback_write(struct ipc *ipc, uint64_t key, const char *path,
+		const void *buf, uint32_t size, x_off offset, uint32_t *done);
+int32_t wback_sync(struct ipc *ipc, uint64_t key, const char *path);
+bool wback_pending(const char *path);
+void wback_rename(const char *from, const char *to);
+int32_t wback_flush(struct ipc *ipc, uint64_t key);
+int32_t wback_release(struct ipc *ipc, uint64_t key);
+void wback_clear(void);
+
+/* A read-only file at the mount root, answered without the server */
+#define STATS_PATH "/.rfs-stats"
+
+char *stats_text(bool server, size_t *len);
@@ -0,0 +1,308 @@
+#define _XOPEN_SOURCE 600
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <avl.h>
+
+#include "rfsc.h"
+
+/*
+ * Attribute cache.  Results of getattr are kept by path for the TTL,
+ * paths that getattr or access have found missing for a TTL of their
+ * own, as tools probe lots of them.  Operations that change a file drop
+ * its entry, operations that change the namespace also drop the entry
+ * of the parent directory.
+ */
+
+#define ATTR_MAX 65536
+
+struct entry {
+	struct avl_node avl;
+	struct entry *prev, *next;
+	const char *path;
+	uint64_t expires;
+	bool missing;
+	x_stat st;
+};
+
+static struct {
+	uint64_t ttl;
+	uint64_t missing_ttl;
+	bool on;
+	size_t count;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t missing;
+
+	pthread_mutex_t lock;
+	struct avl entries;
+	struct entry *head, *tail;
+} ac = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int entry_cmp(const struct entry *x, const struct entry *y)
+{
+	return strcmp(x->path, y->path);
+}
+
+/* Milliseconds */
+static uint64_t now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void lru_unlink(struct entry *e)
+{
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		ac.head = e->next;
+
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		ac.tail = e->prev;
+}
+
+static void lru_push(struct entry *e)
+{
+	e->prev = NULL;
+	e->next = ac.head;
+
+	if (ac.head != NULL)
+		ac.head->prev = e;
+	else
+		ac.tail = e;
+
+	ac.head = e;
+}
+
+static void entry_drop(struct entry *e)
+{
+	avl_remove(&ac.entries, e);
+	lru_unlink(e);
+	--ac.count;
+	free(e);
+}
+
+static struct entry *entry_get(const char *path)
+{
+	return avl_search(&ac.entries, &(struct entry){.path = path});
+}
+
+static struct entry *entry_get_fresh(const char *path)
+{
+	struct entry *e = entry_get(path);
+
+	if (e != NULL && e->expires <= now()) {
+		entry_drop(e);
+		e = NULL;
+	}
+	return e;
+}
+
+/* Called locked, NULL if out of memory */
+static struct entry *entry_set(const char *path, uint64_t ttl)
+{
+	struct entry *e = entry_get(path);
+
+	if (e != NULL)
+		lru_unlink(e);
+	else {
+		size_t len = strlen(path) + 1;
+
+		e = malloc(sizeof(*e) + len);
+		if (e == NULL)
+			return NULL;
+
+		e->path = memcpy(e + 1, path, len);
+		avl_insert(&ac.entries, e);
+		++ac.count;
+	}
+
+	e->expires = now() + ttl;
+	lru_push(e);
+
+	while (ac.count > ATTR_MAX)
+		entry_drop(ac.tail);
+
+	return e;
+}
+
+void acache_init(unsigned ttl, unsigned missing_ttl)
+{
+	ac.ttl = (uint64_t)ttl * 1000;
+	ac.missing_ttl = (uint64_t)missing_ttl * 1000;
+	ac.on = ttl != 0 || missing_ttl != 0;
+	avl_init(&ac.entries, offsetof(struct entry, avl),
+		(avl_cmp_t)entry_cmp);
+}
+
+bool acache_get(const char *path, x_stat *st)
+{
+	if (ac.ttl == 0)
+		return false;
+
+	pthread_mutex_lock(&ac.lock);
+
+	/* Those known to be missing are counted by acache_missing() */
+	struct entry *e = entry_get_fresh(path);
+	bool hit = e != NULL && !e->missing;
+
+	if (hit) {
+		*st = e->st;
+		++ac.hits;
+	} else if (e == NULL)
+		++ac.misses;
+
+	pthread_mutex_unlock(&ac.lock);
+	return hit;
+}
+
+bool acache_missing(const char *path)
+{
+	if (ac.missing_ttl == 0)
+		return false;
+
+	pthread_mutex_lock(&ac.lock);
+
+	struct entry *e = entry_get_fresh(path);
+	bool missing = e != NULL && e->missing;
+
+	if (missing)
+		++ac.missing;
+
+	pthread_mutex_unlock(&ac.lock);
+	return missing;
+}
+
+void acache_put(const char *path, const x_stat *st)
+{
+	if (ac.ttl == 0)
+		return;
+
+	pthread_mutex_lock(&ac.lock);
+
+	struct entry *e = entry_set(path, ac.ttl);
+	if (e != NULL) {
+		e->missing = false;
+		e->st = *st;
+	}
+
+	pthread_mutex_unlock(&ac.lock);
+}
+
+void acache_put_missing(const char *path)
+{
+	if (ac.missing_ttl == 0)
+		return;
+
+	pthread_mutex_lock(&ac.lock);
+
+	struct entry *e = entry_set(path, ac.missing_ttl);
+	if (e != NULL)
+		e->missing = true;
+
+	pthread_mutex_unlock(&ac.lock);
+}
+
+void acache_forget(const char *path)
+{
+	if (!ac.on)
+		return;
+
+	pthread_mutex_lock(&ac.lock);
+
+	struct entry *e = entry_get(path);
+	if (e != NULL)
+		entry_drop(e);
+
+	pthread_mutex_unlock(&ac.lock);
+}
+
+/* The entry was created or removed: the parent has changed too */
+void acache_changed(const char *path)
+{
+	if (!ac.on)
+		return;
+
+	acache_forget(path);
+
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL)
+		return;
+
+	size_t len = (slash == path) ? 1 : (size_t)(slash - path);
+	char parent[len + 1];
+
+	memcpy(parent, path, len);
+	parent[len] = '\0';
+	acache_forget(parent);
+}
+
+/* Forget the path and everything under it */
+void acache_forget_tree(const char *path)
+{
+	if (!ac.on)
+		return;
+
+	acache_changed(path);
+
+	size_t len = strlen(path);
+
+	pthread_mutex_lock(&ac.lock);
+
+	for (struct entry *e = ac.head, *next; e != NULL; e = next) {
+		next = e->next;
+
+		if (strncmp(e->path, path, len) == 0 && e->path[len] == '/')
+			entry_drop(e);
+	}
+
+	pthread_mutex_unlock(&ac.lock);
+}
+
+void acache_clear(void)
+{
+	pthread_mutex_lock(&ac.lock);
+
+	while (ac.head != NULL)
+		entry_drop(ac.head);
+
+	pthread_mutex_unlock(&ac.lock);
+}
+
+void acache_stats(uint64_t *hits, uint64_t *misses, uint64_t *missing)
+{
+	pthread_mutex_lock(&ac.lock);
+	*hits = ac.hits;
+	*misses = ac.misses;
+	*missing = ac.missing;
+	pthread_mutex_unlock(&ac.lock);
+}
+
+/* The path renamed along with from, NULL if it is not under it */
+char *path_moved(const char *path, const char *from, const char *to)
+{
+	size_t len = strlen(from);
+
+	if (strncmp(path, from, len) != 0 ||
+		(path[len] != '\0' && path[len] != '/'))
+		return NULL;
+
+	char *moved = malloc(strlen(to) + strlen(path + len) + 1);
+
+	if (moved != NULL) {
+		strcpy(moved, to);
+		strcat(moved, path + len);
+	}
+
+	return moved;
+}
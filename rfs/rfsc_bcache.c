@@ -0,0 +1,758 @@
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <avl.h>
+
+#include "rfsc.h"
+
+/*
+ * Block cache for file reads.  Blocks are keyed by the server handle and
+ * the block index.  A block that is being fetched stays in the cache as
+ * a pending placeholder, so concurrent readers wait for it instead of
+ * asking the server again.  Sequential reads grow a read-ahead window
+ * which is fetched by a few background threads.
+ *
+ * Every file has an epoch which is bumped whenever its blocks are
+ * dropped; a fetch started in an older epoch does not fill the cache.
+ *
+ * A reply is received right into a chunk shared by the blocks it covers.
+ *
+ * Files opened by the client know their path, so that a write through
+ * one handle drops what was cached through the others.
+ */
+
+#define BLOCK_SIZE (64 << 10)
+#define RA_CHUNK 4
+#define RA_THREADS 4
+#define REVALIDATE 1
+
+struct chunk {
+	unsigned refs;
+	uint8_t data[];
+};
+
+struct block {
+	struct avl_node avl;
+	struct block *prev, *next;
+	uint64_t key;
+	uint64_t index;
+	bool pending;
+	uint32_t len;
+	uint8_t *data;
+	struct chunk *chunk;
+};
+
+struct file {
+	struct avl_node avl;
+	struct file *fprev, *fnext;
+	uint64_t key;
+	char *path;
+	uint32_t epoch;
+	x_off next;
+	size_t window;
+	time_t checked;
+	bool known;
+	x_time mtime;
+	x_time ctime;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	x_off size;
+	uint64_t eof;
+};
+
+struct job {
+	struct job *next;
+	uint64_t key;
+	uint64_t index;
+	uint32_t count;
+	uint32_t epoch;
+};
+
+static struct {
+	size_t size;
+	size_t readahead;
+	size_t used;
+	uint64_t hits;
+	uint64_t misses;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t work;
+
+	struct avl blocks;
+	struct avl files;
+	struct file *first;
+	struct block *head, *tail;
+
+	struct job *jobs, **jobs_tail;
+	bool stop;
+	int nthreads;
+	pthread_t threads[RA_THREADS];
+} bc = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+};
+
+static int block_cmp(const struct block *x, const struct block *y)
+{
+	if (x->key != y->key)
+		return (x->key < y->key) ? -1 : 1;
+	else if (x->index != y->index)
+		return (x->index < y->index) ? -1 : 1;
+	else
+		return 0;
+}
+
+static int file_cmp(const struct file *x, const struct file *y)
+{
+	if (x->key < y->key)
+		return -1;
+	else if (x->key == y->key)
+		return 0;
+	else
+		return 1;
+}
+
+static struct block *block_get(uint64_t key, uint64_t index)
+{
+	return avl_search(&bc.blocks,
+			&(struct block){.key = key, .index = index});
+}
+
+static struct file *file_get(uint64_t key)
+{
+	return avl_search(&bc.files, &(struct file){.key = key});
+}
+
+static void lru_unlink(struct block *b)
+{
+	if (b->prev != NULL)
+		b->prev->next = b->next;
+	else
+		bc.head = b->next;
+
+	if (b->next != NULL)
+		b->next->prev = b->prev;
+	else
+		bc.tail = b->prev;
+}
+
+static void lru_push(struct block *b)
+{
+	b->prev = NULL;
+	b->next = bc.head;
+
+	if (bc.head != NULL)
+		bc.head->prev = b;
+	else
+		bc.tail = b;
+
+	bc.head = b;
+}
+
+static void block_drop(struct block *b)
+{
+	avl_remove(&bc.blocks, b);
+	lru_unlink(b);
+
+	if (!b->pending)
+		bc.used -= BLOCK_SIZE;
+
+	if (b->chunk != NULL && --b->chunk->refs == 0)
+		free(b->chunk);
+
+	free(b);
+}
+
+static bool block_add_pending(uint64_t key, uint64_t index)
+{
+	struct block *b = malloc(sizeof(*b));
+	if (b == NULL)
+		return false;
+
+	b->key = key;
+	b->index = index;
+	b->pending = true;
+	b->len = 0;
+	b->data = NULL;
+	b->chunk = NULL;
+
+	avl_insert(&bc.blocks, b);
+	lru_push(b);
+	return true;
+}
+
+static void evict(void)
+{
+	struct block *b = bc.tail;
+
+	while (bc.used > bc.size && b != NULL) {
+		struct block *prev = b->prev;
+
+		if (!b->pending)
+			block_drop(b);
+
+		b = prev;
+	}
+}
+
+static void drop_blocks(uint64_t key, bool pending)
+{
+	for (struct block *b = bc.head, *next; b != NULL; b = next) {
+		next = b->next;
+
+		if (b->key == key && (pending || !b->pending))
+			block_drop(b);
+	}
+
+	pthread_cond_broadcast(&bc.cond);
+}
+
+static void file_reset(struct file *f)
+{
+	f->epoch++;
+	f->eof = UINT64_MAX;
+	drop_blocks(f->key, true);
+}
+
+static struct file *file_add(uint64_t key)
+{
+	struct file *f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return NULL;
+
+	f->key = key;
+	f->eof = UINT64_MAX;
+	avl_insert(&bc.files, f);
+
+	f->fnext = bc.first;
+	if (bc.first != NULL)
+		bc.first->fprev = f;
+	bc.first = f;
+
+	return f;
+}
+
+static void file_free(struct file *f)
+{
+	avl_remove(&bc.files, f);
+
+	if (f->fprev != NULL)
+		f->fprev->fnext = f->fnext;
+	else
+		bc.first = f->fnext;
+
+	if (f->fnext != NULL)
+		f->fnext->fprev = f->fprev;
+
+	free(f->path);
+	free(f);
+}
+
+/* Put the result of r_read() into the pending blocks */
+static void fill(uint64_t key, uint64_t index, uint32_t count,
+		uint32_t epoch, const datum *data, struct chunk *c)
+{
+	struct file *f = file_get(key);
+	bool valid = f != NULL && f->epoch == epoch;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		struct block *b = block_get(key, index + i);
+		if (b == NULL || !b->pending)
+			continue;
+
+		size_t pos = (size_t)i * BLOCK_SIZE;
+		size_t len = (data == NULL || data->n <= pos) ? 0 :
+			(data->n - pos < BLOCK_SIZE) ? data->n - pos : BLOCK_SIZE;
+
+		if (!valid || (len == 0 && i > 0)) {
+			block_drop(b);
+			continue;
+		}
+
+		if (len < BLOCK_SIZE && f->eof > index + i)
+			f->eof = index + i;
+
+		if (len > 0) {
+			b->data = c->data + pos;
+			b->chunk = c;
+			c->refs++;
+		}
+
+		b->len = len;
+		b->pending = false;
+		bc.used += BLOCK_SIZE;
+	}
+
+	evict();
+	pthread_cond_broadcast(&bc.cond);
+}
+
+/* Blocks one r_read() may ask for, as agreed on with the server */
+static uint32_t max_blocks(void)
+{
+	uint32_t n = rfs_max_io() / BLOCK_SIZE;
+	return (n > 0) ? n : 1;
+}
+
+static int32_t fetch(struct ipc *ipc, uint64_t key, uint64_t index,
+		uint32_t count, uint32_t epoch)
+{
+	uint32_t size = count * BLOCK_SIZE;
+	x_off offset = index * BLOCK_SIZE;
+	datum data;
+	int32_t res = ENOMEM;
+
+	struct chunk *c = malloc(sizeof(*c) + size);
+	if (c != NULL) {
+		c->refs = 1;
+		ipc->dest = (struct ipc_buf){c->data, size};
+		res = r_read(ipc, &key, &size, &offset, &data);
+		ipc->dest.p = NULL;
+
+		if (res == 0 && data.n > 0 && data.p != c->data)
+			res = EIO;
+	}
+
+	pthread_mutex_lock(&bc.lock);
+	fill(key, index, count, epoch, (res == 0) ? &data : NULL, c);
+
+	/* Blocks filled now may have been evicted already */
+	if (c != NULL && --c->refs == 0)
+		free(c);
+
+	pthread_mutex_unlock(&bc.lock);
+
+	mpool_cleanup(&ipc->mp);
+	return res;
+}
+
+static void readahead(struct file *f, x_off offset, uint32_t done)
+{
+	if (offset == f->next && done > 0) {
+		size_t w = f->window ? f->window << 1 : 2 * BLOCK_SIZE;
+		f->window = (w < bc.readahead) ? w : bc.readahead;
+	} else
+		f->window = 0;
+
+	f->next = offset + done;
+	if (f->window == 0)
+		return;
+
+	uint64_t first = (f->next + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint64_t end = (f->next + f->window + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	if (f->known && end > (uint64_t)(f->size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+		end = (f->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (end > f->eof)
+		end = f->eof;
+
+	for (uint64_t i = first; i < end;) {
+		if (block_get(f->key, i) != NULL) {
+			++i;
+			continue;
+		}
+
+		struct job *j = malloc(sizeof(*j));
+		if (j == NULL)
+			return;
+
+		j->next = NULL;
+		j->key = f->key;
+		j->index = i;
+		j->count = 0;
+		j->epoch = f->epoch;
+
+		while (i < end && j->count < RA_CHUNK &&
+			j->count < max_blocks() &&
+			block_get(f->key, i) == NULL &&
+			block_add_pending(f->key, i)) {
+			++j->count;
+			++i;
+		}
+
+		if (j->count == 0) {
+			free(j);
+			return;
+		}
+
+		*bc.jobs_tail = j;
+		bc.jobs_tail = &j->next;
+		pthread_cond_signal(&bc.work);
+	}
+}
+
+static void *readahead_thread(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&bc.lock);
+
+	for (;;) {
+		while (bc.jobs == NULL && !bc.stop)
+			pthread_cond_wait(&bc.work, &bc.lock);
+
+		if (bc.stop)
+			break;
+
+		struct job *j = bc.jobs;
+		bc.jobs = j->next;
+		if (bc.jobs == NULL)
+			bc.jobs_tail = &bc.jobs;
+
+		pthread_mutex_unlock(&bc.lock);
+
+		struct ipc *ipc = rfs_ipc();
+		if (ipc != NULL)
+			fetch(ipc, j->key, j->index, j->count, j->epoch);
+
+		/* Like the FUSE calls, this one recovers a lost connection */
+		if (ipc != NULL && !ipc->ok)
+			fs_recover(ipc);
+
+		pthread_mutex_lock(&bc.lock);
+
+		if (ipc == NULL)
+			fill(j->key, j->index, j->count, j->epoch, NULL, NULL);
+
+		free(j);
+	}
+
+	pthread_mutex_unlock(&bc.lock);
+	return NULL;
+}
+
+void bcache_init(size_t size, size_t readahead)
+{
+	bc.size = size;
+	bc.readahead = (size > 0) ? readahead : 0;
+
+	avl_init(&bc.blocks, offsetof(struct block, avl),
+		(avl_cmp_t)block_cmp);
+	avl_init(&bc.files, offsetof(struct file, avl), (avl_cmp_t)file_cmp);
+
+	bc.jobs = NULL;
+	bc.jobs_tail = &bc.jobs;
+}
+
+void bcache_start(void)
+{
+	if (bc.readahead == 0)
+		return;
+
+	bc.stop = false;
+
+	for (bc.nthreads = 0; bc.nthreads < RA_THREADS; ++bc.nthreads) {
+		if (pthread_create(&bc.threads[bc.nthreads], NULL,
+					readahead_thread, NULL) != 0)
+			break;
+	}
+}
+
+void bcache_stop(void)
+{
+	pthread_mutex_lock(&bc.lock);
+	bc.stop = true;
+	pthread_cond_broadcast(&bc.work);
+	pthread_mutex_unlock(&bc.lock);
+
+	while (bc.nthreads > 0)
+		pthread_join(bc.threads[--bc.nthreads], NULL);
+
+	for (struct job *j = bc.jobs, *next; j != NULL; j = next) {
+		next = j->next;
+		free(j);
+	}
+
+	bc.jobs = NULL;
+	bc.jobs_tail = &bc.jobs;
+
+	bcache_clear();
+}
+
+/*
+ * Writes within a second of each other leave the seconds as they were,
+ * and a change of the times back is still one of ctime
+ */
+static bool file_changed(const struct file *f, const x_stat *st)
+{
+	return f->mtime != st->mtime || f->mtime_nsec != st->mtime_nsec ||
+		f->ctime != st->ctime || f->ctime_nsec != st->ctime_nsec ||
+		f->size != st->size;
+}
+
+/* Drop the blocks if the file has changed on the server */
+void bcache_attr(uint64_t key, const x_stat *st)
+{
+	if (bc.size == 0)
+		return;
+
+	pthread_mutex_lock(&bc.lock);
+
+	struct file *f = file_get(key);
+	if (f == NULL)
+		f = file_add(key);
+
+	if (f != NULL) {
+		if (f->known && file_changed(f, st))
+			file_reset(f);
+
+		f->known = true;
+		f->mtime = st->mtime;
+		f->ctime = st->ctime;
+		f->mtime_nsec = st->mtime_nsec;
+		f->ctime_nsec = st->ctime_nsec;
+		f->size = st->size;
+		f->checked = time(NULL);
+	}
+
+	pthread_mutex_unlock(&bc.lock);
+}
+
+static int32_t revalidate(struct ipc *ipc, uint64_t key)
+{
+	pthread_mutex_lock(&bc.lock);
+
+	struct file *f = file_get(key);
+	if (f == NULL)
+		f = file_add(key);
+
+	bool due = f != NULL && time(NULL) - f->checked >= REVALIDATE;
+	pthread_mutex_unlock(&bc.lock);
+
+	if (f == NULL)
+		return ENOMEM;
+
+	if (!due)
+		return 0;
+
+	x_stat st;
+	int32_t res = r_fgetattr(ipc, &key, &st);
+	if (res == 0)
+		bcache_attr(key, &st);
+
+	return res;
+}
+
+static int32_t read_direct(struct ipc *ipc, uint64_t key, void *buf,
+			uint32_t size, x_off offset, uint32_t *done)
+{
+	datum data;
+
+	ipc->dest = (struct ipc_buf){buf, size};
+	int32_t res = r_read(ipc, &key, &size, &offset, &data);
+	ipc->dest.p = NULL;
+
+	if (res != 0)
+		return res;
+
+	if (data.n > 0 && data.p != buf)
+		memcpy(buf, data.p, data.n);
+
+	mpool_cleanup(&ipc->mp);
+
+	*done = data.n;
+	return 0;
+}
+
+int32_t bcache_read(struct ipc *ipc, uint64_t key, void *buf, uint32_t size,
+		x_off offset, uint32_t *done)
+{
+	if (bc.size == 0)
+		return read_direct(ipc, key, buf, size, offset, done);
+
+	int32_t res = revalidate(ipc, key);
+	if (res != 0)
+		return res;
+
+	*done = 0;
+	pthread_mutex_lock(&bc.lock);
+
+	while (*done < size) {
+		struct file *f = file_get(key);
+		if (f == NULL)
+			break;
+
+		x_off pos = offset + *done;
+		uint64_t index = pos / BLOCK_SIZE;
+		struct block *b = block_get(key, index);
+
+		if (b != NULL && b->pending) {
+			pthread_cond_wait(&bc.cond, &bc.lock);
+			continue;
+		}
+
+		if (b != NULL) {
+			size_t in = pos - index * BLOCK_SIZE;
+			if (in >= b->len)
+				break;
+
+			size_t n = b->len - in;
+			if (n > size - *done)
+				n = size - *done;
+
+			memcpy((uint8_t *)buf + *done, b->data + in, n);
+			*done += n;
+			++bc.hits;
+
+			lru_unlink(b);
+			lru_push(b);
+
+			if (b->len < BLOCK_SIZE && in + n == b->len)
+				break;
+
+			continue;
+		}
+
+		uint64_t last = (offset + size - 1) / BLOCK_SIZE;
+		uint32_t count = 0;
+
+		while (index + count <= last && count < max_blocks() &&
+			block_get(key, index + count) == NULL &&
+			block_add_pending(key, index + count))
+			++count;
+
+		if (count == 0) {
+			res = ENOMEM;
+			break;
+		}
+
+		bc.misses += count;
+
+		uint32_t epoch = f->epoch;
+
+		pthread_mutex_unlock(&bc.lock);
+		res = fetch(ipc, key, index, count, epoch);
+		pthread_mutex_lock(&bc.lock);
+
+		if (res != 0)
+			break;
+	}
+
+	struct file *f = file_get(key);
+	if (res == 0 && f != NULL)
+		readahead(f, offset, *done);
+
+	pthread_mutex_unlock(&bc.lock);
+	return res;
+}
+
+static void invalidate(struct file *f, x_off offset, uint64_t size)
+{
+	uint64_t first = offset / BLOCK_SIZE;
+	uint64_t last = (size == UINT64_MAX) ? UINT64_MAX :
+		(offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	f->epoch++;
+	f->eof = UINT64_MAX;
+	f->known = false;
+
+	for (struct block *b = bc.head, *next; b != NULL; b = next) {
+		next = b->next;
+
+		/* A short block may be no longer the last one */
+		if (b->key == f->key && ((b->index >= first &&
+					b->index < last) ||
+				(!b->pending && b->len < BLOCK_SIZE)))
+			block_drop(b);
+	}
+}
+
+/* The file is open under the path through the handle */
+void bcache_open(uint64_t key, const char *path)
+{
+	if (bc.size == 0)
+		return;
+
+	pthread_mutex_lock(&bc.lock);
+
+	struct file *f = file_get(key);
+	if (f == NULL)
+		f = file_add(key);
+
+	if (f != NULL) {
+		free(f->path);
+		f->path = strdup(path);
+	}
+
+	pthread_mutex_unlock(&bc.lock);
+}
+
+void bcache_rename(const char *from, const char *to)
+{
+	pthread_mutex_lock(&bc.lock);
+
+	for (struct file *f = bc.first; f != NULL; f = f->fnext) {
+		char *path = (f->path != NULL) ?
+			path_moved(f->path, from, to) : NULL;
+
+		if (path != NULL) {
+			free(f->path);
+			f->path = path;
+		}
+	}
+
+	pthread_mutex_unlock(&bc.lock);
+}
+
+/*
+ * Forget cached data in the range written through the handle, and
+ * through the other handles of the file if the path is known.  Key 0
+ * is no handle.
+ */
+void bcache_invalidate(uint64_t key, const char *path, x_off offset,
+		uint64_t size)
+{
+	pthread_mutex_lock(&bc.lock);
+
+	for (struct file *f = bc.first; f != NULL; f = f->fnext) {
+		if (f->key == key || (path != NULL && f->path != NULL &&
+				strcmp(f->path, path) == 0))
+			invalidate(f, offset, size);
+	}
+
+	pthread_cond_broadcast(&bc.cond);
+	pthread_mutex_unlock(&bc.lock);
+}
+
+void bcache_forget(uint64_t key)
+{
+	pthread_mutex_lock(&bc.lock);
+
+	struct file *f = file_get(key);
+	if (f != NULL) {
+		drop_blocks(key, true);
+		file_free(f);
+	}
+
+	pthread_mutex_unlock(&bc.lock);
+}
+
+void bcache_clear(void)
+{
+	pthread_mutex_lock(&bc.lock);
+
+	while (bc.head != NULL)
+		block_drop(bc.head);
+
+	while (bc.first != NULL)
+		file_free(bc.first);
+
+	pthread_cond_broadcast(&bc.cond);
+	pthread_mutex_unlock(&bc.lock);
+}
+
+/* Blocks read from the cache, read-ahead ones included, and fetched */
+void bcache_stats(uint64_t *hits, uint64_t *misses)
+{
+	pthread_mutex_lock(&bc.lock);
+	*hits = bc.hits;
+	*misses = bc.misses;
+	pthread_mutex_unlock(&bc.lock);
+}
@@ -1,59 +1,143 @@
-#define _XOPEN_SOURCE 600
+#define _XOPEN_SOURCE 700
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <avl.h>
+#include <handle.h>
 
 #include "rfsc.h"
 
+#define DIR_BATCH 128
+#define SMALL_FILE (64 << 10)
+
 static uint64_t generation;
 static uint64_t last_key;
 
+/* A small file read whole at open, its server handle is closed already */
+struct small_file {
+	x_stat st;
+	uint32_t len;
+	uint8_t data[];
+};
+
+/* FUSE file handles map to the server keys */
 struct fd_node {
-	struct avl_node avl;
 	uint64_t key;
 	uint64_t generation;
+	struct small_file *small;
 };
 
-static struct avl fds;
+static struct handle_table fds;
+static pthread_mutex_t fds_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static int fd_node_cmp(const struct fd_node *x, const struct fd_node *y)
+/* Only callers that take the small file can use such a handle */
+static int fd_get(uint64_t fh, uint64_t *key, struct small_file **small)
 {
-	if (x->key < y->key)
-		return -1;
-	else if (x->key == y->key)
-		return 0;
-	else
-		return 1;
+	pthread_mutex_lock(&fds_lock);
+
+	struct fd_node *p = handle_get(&fds, fh);
+	int res = (p == NULL) ? EBADF : (p->generation < generation) ? EIO : 0;
+
+	if (p != NULL) {
+		*key = p->key;
+
+		if (small != NULL)
+			*small = p->small;
+		else if (p->small != NULL)
+			res = EBADF;
+	}
+
+	pthread_mutex_unlock(&fds_lock);
+	return res;
 }
 
-#define CHECK_GENERATION(fi) do {					\
-		struct fd_node *p;					\
-		p = avl_search(&fds, &(struct fd_node){.key = (fi)->fh}); \
-									\
-		if (p == NULL)						\
-			return -EBADF;					\
-									\
-		if (p->generation < generation)				\
-			return -EIO;					\
+static bool fd_add(uint64_t key, struct small_file *small, uint64_t *fh)
+{
+	pthread_mutex_lock(&fds_lock);
+
+	struct fd_node *p = handle_alloc(&fds, fh);
+
+	if (p != NULL) {
+		p->key = key;
+		p->generation = generation;
+		p->small = small;
+
+		/* The server starts the next session past the newest key */
+		if (key > last_key)
+			last_key = key;
+	}
+
+	pthread_mutex_unlock(&fds_lock);
+	return p != NULL;
+}
+
+static int fd_remove(uint64_t fh, uint64_t *key, struct small_file **small)
+{
+	pthread_mutex_lock(&fds_lock);
+
+	struct fd_node *p = handle_get(&fds, fh);
+	int res = (p == NULL) ? EBADF : (p->generation < generation) ? EIO : 0;
+
+	if (p != NULL) {
+		*key = p->key;
+		*small = p->small;
+		handle_free(&fds, fh);
+	}
+
+	pthread_mutex_unlock(&fds_lock);
+	return res;
+}
+
+/* Handles of the new session may reuse the old keys */
+static void reset(void)
+{
+	pthread_mutex_lock(&fds_lock);
+	++generation;
+	pthread_mutex_unlock(&fds_lock);
+
+	bcache_clear();
+	wback_clear();
+}
+
+void fs_recover(struct ipc *ipc)
+{
+	pthread_mutex_lock(&fds_lock);
+	uint64_t key = last_key;
+	pthread_mutex_unlock(&fds_lock);
+
+	rfs_recover(ipc, key, reset);
+}
+
+#define GET_IPC(ipc) do {					\
+		if (((ipc) = rfs_ipc()) == NULL)		\
+			return -ENOMEM;				\
+	} while (false)
+
+#define GET_FILE(fi, key, small) do {				\
+		int err = fd_get((fi)->fh, &(key), (small));	\
+								\
+		if (err != 0)					\
+			return -err;				\
 	} while (false)
 
+#define GET_KEY(fi, key) GET_FILE(fi, key, NULL)
+
 #define CALL(expr) do {						\
 		int32_t res = (expr);				\
 								\
 		if (res == 0)					\
 			break;					\
 								\
-		if (ipc.ok)					\
+		if (ipc->ok)					\
 			return -res;				\
 								\
-		if (rfs_recover(last_key))			\
-			++generation;				\
-								\
+		fs_recover(ipc);				\
 		return -EIO;					\
 	} while (false)
 
@@ -65,96 +149,192 @@ static void x_stat2stat(struct stat *dst, const x_stat *src)
 	dst->st_gid = src->gid;
 	dst->st_rdev = src->rdev;
 	dst->st_size = src->size;
-	dst->st_atime = src->atime;
-	dst->st_mtime = src->mtime;
-	dst->st_ctime = src->ctime;
+	dst->st_atim = (struct timespec){src->atime, src->atime_nsec};
+	dst->st_mtim = (struct timespec){src->mtime, src->mtime_nsec};
+	dst->st_ctim = (struct timespec){src->ctime, src->ctime_nsec};
+}
+
+/* Owned by whoever mounted, sized as it would be read now */
+static void stats_stat(x_stat *st, uint32_t len)
+{
+	time_t now = time(NULL);
+
+	memset(st, 0, sizeof(*st));
+	st->mode = S_IFREG | 0444;
+	st->nlink = 1;
+	st->uid = getuid();
+	st->gid = getgid();
+	st->size = len;
+	st->atime = st->mtime = st->ctime = now;
 }
 
 static int fs_getattr(const char *path, struct stat *buf)
 {
+	if (strcmp(path, STATS_PATH) == 0) {
+		size_t len;
+		char *text = stats_text(false, &len);
+		if (text == NULL)
+			return -ENOMEM;
+
+		free(text);
+
+		x_stat st;
+		stats_stat(&st, len);
+		x_stat2stat(buf, &st);
+		return 0;
+	}
+
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
 	x_stat st;
-	CALL(r_getattr(&ipc, &(string){.cs = path}, &st));
+	if (!acache_get(path, &st)) {
+		if (acache_missing(path))
+			return -ENOENT;
+
+		CALL(wback_sync(ipc, 0, path));
+
+		int32_t err = r_getattr(ipc, &(string){.cs = path}, &st);
+		if (err == ENOENT && ipc->ok)
+			acache_put_missing(path);
+
+		CALL(err);
+		acache_put(path, &st);
+	}
+
 	x_stat2stat(buf, &st);
 	return 0;
 }
 
 static int fs_readlink(const char *path, char *buf, size_t len)
 {
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
 	uint32_t len32 = len;
 	string s;
-	CALL(r_readlink(&ipc, &(string){.cs = path}, &len32, &s));
+	CALL(r_readlink(ipc, &(string){.cs = path}, &len32, &s));
 
 	strncpy(buf, s.s, len);
-	mpool_cleanup(&ipc.mp);
+	mpool_cleanup(&ipc->mp);
 	return 0;
 }
 
 static int fs_mknod(const char *path, mode_t mode, dev_t dev)
 {
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
 	x_mode x_mode = mode;
 	x_dev x_dev = dev;
-	CALL(r_mknod(&ipc, &(string){.cs = path}, &x_mode, &x_dev));
+	CALL(r_mknod(ipc, &(string){.cs = path}, &x_mode, &x_dev));
+	acache_changed(path);
 	return 0;
 }
 
 static int fs_mkdir(const char *path, mode_t mode)
 {
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
 	x_mode x_mode = mode;
-	CALL(r_mkdir(&ipc, &(string){.cs = path}, &x_mode));
+	CALL(r_mkdir(ipc, &(string){.cs = path}, &x_mode));
+	acache_changed(path);
 	return 0;
 }
 
 static int fs_unlink(const char *path)
 {
-	CALL(r_unlink(&ipc, &(string){.cs = path}));
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
+	CALL(r_unlink(ipc, &(string){.cs = path}));
+	acache_changed(path);
 	return 0;
 }
 
 static int fs_rmdir(const char *path)
 {
-	CALL(r_rmdir(&ipc, &(string){.cs = path}));
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
+	CALL(r_rmdir(ipc, &(string){.cs = path}));
+	acache_forget_tree(path);
 	return 0;
 }
 
 static int fs_symlink(const char *oldpath, const char *newpath)
 {
-	CALL(r_symlink(&ipc, &(string){.cs = oldpath},
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
+	CALL(r_symlink(ipc, &(string){.cs = oldpath},
 			&(string){.cs = newpath}));
+
+	/* Names under it may now be found through it, as after a rename */
+	acache_forget_tree(newpath);
 	return 0;
 }
 
 static int fs_rename(const char *oldpath, const char *newpath)
 {
-	CALL(r_rename(&ipc, &(string){.cs = oldpath},
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
+	CALL(r_rename(ipc, &(string){.cs = oldpath},
 			&(string){.cs = newpath}));
+	wback_rename(oldpath, newpath);
+	bcache_rename(oldpath, newpath);
+	acache_forget_tree(oldpath);
+	acache_forget_tree(newpath);
 	return 0;
 }
 
 static int fs_link(const char *oldpath, const char *newpath)
 {
-	CALL(r_link(&ipc, &(string){.cs = oldpath}, &(string){.cs = newpath}));
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
+	CALL(r_link(ipc, &(string){.cs = oldpath}, &(string){.cs = newpath}));
+	acache_forget(oldpath);
+	acache_changed(newpath);
 	return 0;
 }
 
 static int fs_chmod(const char *path, mode_t mode)
 {
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
 	x_mode x_mode = mode;
-	CALL(r_chmod(&ipc, &(string){.cs = path}, &x_mode));
+	CALL(r_chmod(ipc, &(string){.cs = path}, &x_mode));
+	acache_forget(path);
 	return 0;
 }
 
 static int fs_chown(const char *path, uid_t owner, gid_t group)
 {
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
 	x_uid x_owner = owner;
 	x_gid x_group = group;
-	CALL(r_chown(&ipc, &(string){.cs = path}, &x_owner, &x_group));
+	CALL(r_chown(ipc, &(string){.cs = path}, &x_owner, &x_group));
+	acache_forget(path);
 	return 0;
 }
 
 static int fs_truncate(const char *path, off_t length)
 {
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
+	/* Data still buffered would be written past the new end after it */
 	x_off x_length = length;
-	CALL(r_truncate(&ipc, &(string){.cs = path}, &x_length));
+	CALL(wback_sync(ipc, 0, path));
+	CALL(r_truncate(ipc, &(string){.cs = path}, &x_length));
+	bcache_invalidate(0, path, 0, UINT64_MAX);
+	acache_forget(path);
 	return 0;
 }
 
@@ -163,16 +343,28 @@ static int fs_read(const char *path, char *buf, size_t size,
 {
 	(void)path;
 
-	CHECK_GENERATION(fi);
+	struct ipc *ipc;
+	GET_IPC(ipc);
 
-	uint32_t size32 = size;
-	x_off x_offset = offset;
-	datum data;
-	CALL(r_read(&ipc, &fi->fh, &size32, &x_offset, &data));
+	uint64_t key;
+	struct small_file *small;
+	GET_FILE(fi, key, &small);
+
+	if (small != NULL) {
+		if (offset >= small->len)
+			return 0;
+
+		if (size > (size_t)(small->len - offset))
+			size = small->len - offset;
 
-	memcpy(buf, data.p, data.n);
-	mpool_cleanup(&ipc.mp);
-	return data.n;
+		memcpy(buf, small->data + offset, size);
+		return size;
+	}
+
+	uint32_t done;
+	CALL(wback_sync(ipc, key, path));
+	CALL(bcache_read(ipc, key, buf, size, offset, &done));
+	return done;
 }
 
 static int fs_write(const char *path, const char *buf, size_t size,
@@ -180,20 +372,25 @@ static int fs_write(const char *path, const char *buf, size_t size,
 {
 	(void)path;
 
-	CHECK_GENERATION(fi);
+	struct ipc *ipc;
+	GET_IPC(ipc);
 
-	x_off x_offset = offset;
-	uint32_t done;
-	CALL(r_write(&ipc, &fi->fh, &x_offset,
-			&(datum){size, (void *)buf}, &done));
+	uint64_t key;
+	GET_KEY(fi, key);
 
+	uint32_t done;
+	acache_forget(path);
+	CALL(wback_write(ipc, key, path, buf, size, offset, &done));
 	return done;
 }
 
 static int fs_statfs(const char *path, struct statvfs *buf)
 {
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
 	x_statfs st;
-	CALL(r_statfs(&ipc, &(string){.cs = path}, &st));
+	CALL(r_statfs(ipc, &(string){.cs = path}, &st));
 
 	buf->f_bsize = st.bsize;
 	buf->f_blocks = st.blocks;
@@ -208,17 +405,53 @@ static int fs_statfs(const char *path, struct statvfs *buf)
 
 static int fs_release(const char *path, struct fuse_file_info *fi)
 {
-	(void)path;
+	struct ipc *ipc;
+	GET_IPC(ipc);
 
-	struct fd_node *p;
-	p = avl_remove(&fds, &(struct fd_node){.key = fi->fh});
+	uint64_t key;
+	struct small_file *small;
+	int err = fd_remove(fi->fh, &key, &small);
 
-	if (p == NULL)
+	if (err == EBADF)
 		return -EBADF;
 
-	if (p->generation == generation)
-		CALL(r_release(&ipc, &fi->fh));
+	if (small != NULL) {
+		free(small);
+		return 0;
+	}
+
+	bcache_forget(key);
+
+	if (err == 0) {
+		/* Errors since the last fs_flush, if the kernel cares */
+		int32_t res = wback_release(ipc, key);
+		if (!ipc->ok) {
+			fs_recover(ipc);
+			return -EIO;
+		}
+
+		acache_forget(path);
+		CALL(r_release(ipc, &key));
+		return -res;
+	}
+
+	return 0;
+}
+
+static int fs_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
+	uint64_t key;
+	struct small_file *small;
+	GET_FILE(fi, key, &small);
+
+	if (small != NULL)
+		return 0;
 
+	CALL(wback_flush(ipc, key));
+	acache_forget(path);
 	return 0;
 }
 
@@ -226,49 +459,104 @@ static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 {
 	(void)path;
 
-	CHECK_GENERATION(fi);
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
+	uint64_t key;
+	struct small_file *small;
+	GET_FILE(fi, key, &small);
+
+	if (small != NULL)
+		return 0;
+
+	CALL(wback_flush(ipc, key));
 
 	if (datasync)
-		CALL(r_fdatasync(&ipc, &fi->fh));
+		CALL(r_fdatasync(ipc, &key));
 	else
-		CALL(r_fsync(&ipc, &fi->fh));
+		CALL(r_fsync(ipc, &key));
 
 	return 0;
 }
 
 static int fs_opendir(const char *path, struct fuse_file_info *fi)
 {
-	CALL(r_opendir(&ipc, &(string){.cs = path}, &fi->fh));
+	struct ipc *ipc;
+	GET_IPC(ipc);
 
-	struct fd_node *p = malloc(sizeof(*p));
+	uint64_t key;
+	CALL(r_opendir(ipc, &(string){.cs = path}, &key));
 
-	if (p == NULL) {
-		CALL(r_releasedir(&ipc, &fi->fh));
+	if (!fd_add(key, NULL, &fi->fh)) {
+		CALL(r_releasedir(ipc, &key));
 		return -ENOMEM;
 	}
 
-	last_key = p->key = fi->fh;
-	p->generation = generation;
-	avl_insert(&fds, p);
-
 	return 0;
 }
 
 static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t fill,
 		off_t offset, struct fuse_file_info *fi)
 {
-	(void)path;
-	(void)offset;
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
+	uint64_t key;
+	GET_KEY(fi, key);
+
+	size_t len = strlen(path);
+	if (len == 1)
+		len = 0;
+
+	x_off cookie = offset;
+	uint32_t count = DIR_BATCH;
+
+	for (;;) {
+		list_x_dirent entries;
+		CALL(r_readdirplus(ipc, &key, &cookie, &count, &entries));
+
+		for (const x_dirent *p = entries.p;
+				p < entries.p + entries.n; ++p) {
+			cookie = p->cookie;
+
+			if (p->st.mode == 0) {
+				if (fill(buf, p->name.s, NULL, cookie))
+					goto full;
+				continue;
+			}
+
+			struct stat st;
+			memset(&st, 0, sizeof(st));
+			x_stat2stat(&st, &p->st);
+
+			if (fill(buf, p->name.s, &st, cookie))
+				goto full;
 
-	CHECK_GENERATION(fi);
+			if (strcmp(p->name.s, ".") == 0 ||
+					strcmp(p->name.s, "..") == 0)
+				continue;
 
-	list_string names;
-	CALL(r_readdir(&ipc, &fi->fh, &names));
+			char child[len + strlen(p->name.s) + 2];
+			memcpy(child, path, len);
+			child[len] = '/';
+			strcpy(child + len + 1, p->name.s);
 
-	for (const string *p = names.p; p < names.p + names.n; ++p)
-		fill(buf, p->s, NULL, 0);
+			/* The size is not known until the data is sent */
+			if (!wback_pending(child))
+				acache_put(child, &p->st);
+		}
+
+		mpool_cleanup(&ipc->mp);
+
+		if (entries.n < count)
+			break;
+	}
 
-	mpool_cleanup(&ipc.mp);
+	return 0;
+
+full:
+	/* The rest is asked again from the offset of the last entry */
+	mpool_cleanup(&ipc->mp);
 	return 0;
 }
 
@@ -276,14 +564,18 @@ static int fs_releasedir(const char *path, struct fuse_file_info *fi)
 {
 	(void)path;
 
-	struct fd_node *p;
-	p = avl_remove(&fds, &(struct fd_node){.key = fi->fh});
+	struct ipc *ipc;
+	GET_IPC(ipc);
 
-	if (p == NULL)
+	uint64_t key;
+	struct small_file *small;
+	int err = fd_remove(fi->fh, &key, &small);
+
+	if (err == EBADF)
 		return -EBADF;
 
-	if (p->generation == generation)
-		CALL(r_releasedir(&ipc, &fi->fh));
+	if (err == 0)
+		CALL(r_releasedir(ipc, &key));
 
 	return 0;
 }
@@ -292,7 +584,9 @@ static void *fs_init(struct fuse_conn_info *conn)
 {
 	(void)conn;
 
-	avl_init(&fds, offsetof(struct fd_node, avl), (avl_cmp_t)fd_node_cmp);
+	handle_init(&fds, sizeof(struct fd_node));
+	bcache_start();
+	wback_start();
 	return NULL;
 }
 
@@ -300,45 +594,67 @@ static void fs_destroy(void *null)
 {
 	(void)null;
 
-	avl_traverse(&fds, free);
+	wback_stop();
+	bcache_stop();
+	handle_destroy(&fds);
 	rfs_destroy();
 }
 
 static int fs_access(const char *path, int mode)
 {
-	CALL(r_access(&ipc, &(string){.cs = path}, &mode));
+	if (strcmp(path, STATS_PATH) == 0)
+		return (mode & (W_OK | X_OK)) ? -EACCES : 0;
+
+	if (acache_missing(path))
+		return -ENOENT;
+
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
+	int32_t err = r_access(ipc, &(string){.cs = path}, &mode);
+	if (err == ENOENT && ipc->ok)
+		acache_put_missing(path);
+
+	CALL(err);
 	return 0;
 }
 
 static int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
 	x_mode x_mode = mode;
 	int32_t x_flags = fi->flags;
-	CALL(r_open(&ipc, &(string){.cs = path}, &x_flags, &x_mode, &fi->fh));
+	uint64_t key;
+	CALL(r_open(ipc, &(string){.cs = path}, &x_flags, &x_mode, &key));
 
-	struct fd_node *p = malloc(sizeof(*p));
+	if (x_flags & (O_CREAT | O_TRUNC))
+		acache_changed(path);
 
-	if (p == NULL) {
-		CALL(r_release(&ipc, &fi->fh));
+	if (!fd_add(key, NULL, &fi->fh)) {
+		CALL(r_release(ipc, &key));
 		return -ENOMEM;
 	}
 
-	last_key = p->key = fi->fh;
-	p->generation = generation;
-	avl_insert(&fds, p);
-
+	bcache_open(key, path);
 	return 0;
 }
 
 static int fs_ftruncate(const char *path, off_t length,
 			struct fuse_file_info *fi)
 {
-	(void)path;
+	struct ipc *ipc;
+	GET_IPC(ipc);
 
-	CHECK_GENERATION(fi);
+	uint64_t key;
+	GET_KEY(fi, key);
 
 	x_off x_length = length;
-	CALL(r_ftruncate(&ipc, &fi->fh, &x_length));
+	CALL(wback_sync(ipc, key, path));
+	bcache_invalidate(key, path, 0, UINT64_MAX);
+	CALL(r_ftruncate(ipc, &key, &x_length));
+	acache_forget(path);
 
 	return 0;
 }
@@ -346,12 +662,23 @@ static int fs_ftruncate(const char *path, off_t length,
 static int fs_fgetattr(const char *path, struct stat *buf,
 		       struct fuse_file_info *fi)
 {
-	(void)path;
+	struct ipc *ipc;
+	GET_IPC(ipc);
 
-	CHECK_GENERATION(fi);
+	uint64_t key;
+	struct small_file *small;
+	GET_FILE(fi, key, &small);
+
+	if (small != NULL) {
+		x_stat2stat(buf, &small->st);
+		return 0;
+	}
 
 	x_stat st;
-	CALL(r_fgetattr(&ipc, &fi->fh, &st));
+	CALL(wback_sync(ipc, key, path));
+	CALL(r_fgetattr(ipc, &key, &st));
+	bcache_attr(key, &st);
+	acache_put(path, &st);
 
 	x_stat2stat(buf, &st);
 	return 0;
@@ -359,14 +686,122 @@ static int fs_fgetattr(const char *path, struct stat *buf,
 
 static int fs_utimens(const char *path, const struct timespec tv[2])
 {
-	CALL(r_utimens(&ipc, &(string){.cs = path},
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
+	CALL(wback_sync(ipc, 0, path));
+	CALL(r_utimens(ipc, &(string){.cs = path},
 			&(x_timespec) {tv[0].tv_sec, tv[0].tv_nsec},
 			&(x_timespec) {tv[1].tv_sec, tv[1].tv_nsec}));
+	acache_forget(path);
+	return 0;
+}
+
+/*
+ * Read a small file whole in one round trip, the handle is served from
+ * memory then.  Returns 1 if the file has turned out to be larger.
+ */
+static int open_small(struct ipc *ipc, const char *path,
+		struct fuse_file_info *fi)
+{
+	int32_t x_flags = fi->flags;
+	x_mode x_mode = 0;
+	uint32_t size = SMALL_FILE;
+	x_off offset = 0;
+	uint64_t key;
+	x_stat st;
+	datum data;
+	uint32_t steps;
+
+	CALL(wback_sync(ipc, 0, path));
+
+	int32_t res = r_read_file(ipc, &(string){.cs = path}, &x_flags,
+				&x_mode, &size, &offset, &key, &st, &data,
+				&steps);
+
+	/* The handle is left open if a step after r_open has failed */
+	if (res != 0 && ipc->ok && steps > 0 && steps < 3)
+		CALL(r_release(ipc, &key));
+
+	CALL(res);
+
+	if (data.n != st.size) {
+		mpool_cleanup(&ipc->mp);
+		return 1;
+	}
+
+	struct small_file *small = malloc(sizeof(*small) + data.n);
+
+	if (small == NULL) {
+		mpool_cleanup(&ipc->mp);
+		return -ENOMEM;
+	}
+
+	small->st = st;
+	small->len = data.n;
+	memcpy(small->data, data.p, data.n);
+	mpool_cleanup(&ipc->mp);
+
+	if (!fd_add(key, small, &fi->fh)) {
+		free(small);
+		return -ENOMEM;
+	}
+
+	acache_put(path, &st);
+	return 0;
+}
+
+/*
+ * A snapshot of the statistics, served like a small file.  Reads go past
+ * the size that stat() has seen, the text may have grown since.
+ */
+static int open_stats(struct fuse_file_info *fi)
+{
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	size_t len;
+	char *text = stats_text(true, &len);
+	if (text == NULL)
+		return -ENOMEM;
+
+	struct small_file *small = malloc(sizeof(*small) + len);
+
+	if (small != NULL) {
+		stats_stat(&small->st, len);
+		small->len = len;
+		memcpy(small->data, text, len);
+	}
+
+	free(text);
+
+	if (small == NULL || !fd_add(0, small, &fi->fh)) {
+		free(small);
+		return -ENOMEM;
+	}
+
+	fi->direct_io = 1;
 	return 0;
 }
 
 static int fs_open(const char *path, struct fuse_file_info *fi)
 {
+	if (strcmp(path, STATS_PATH) == 0)
+		return open_stats(fi);
+
+	struct ipc *ipc;
+	GET_IPC(ipc);
+
+	x_stat st;
+	if ((fi->flags & (O_ACCMODE | O_TRUNC)) == O_RDONLY &&
+		acache_get(path, &st) &&
+		S_ISREG(st.mode) && st.size < SMALL_FILE) {
+		int res = open_small(ipc, path, fi);
+
+		if (res <= 0)
+			return res;
+	}
+
 	return fs_create(path, 0, fi);
 }
 
@@ -387,6 +822,7 @@ const struct fuse_operations fs_ops = {
 	.read = fs_read,
 	.write = fs_write,
 	.statfs = fs_statfs,
+	.flush = fs_flush,
 	.release = fs_release,
 	.fsync = fs_fsync,
 	.opendir = fs_opendir,
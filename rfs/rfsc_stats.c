@@ -0,0 +1,214 @@
+#define _XOPEN_SOURCE 600
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rfsc.h"
+
+#define TEXT_SIZE 4096
+
+/*
+ * The statistics file: calls to the server by function with their round
+ * trip percentiles, then reconnects, caches and compression, and last
+ * the calls as the server has counted them with the time it took for
+ * them, if it keeps count.  It is made anew for every open.
+ */
+
+struct text {
+	char *data;
+	size_t len;
+	size_t size;
+	bool ok;
+};
+
+static void put(struct text *t, const char *fmt, ...)
+{
+	va_list ap;
+
+	for (;;) {
+		size_t room = t->size - t->len;
+
+		va_start(ap, fmt);
+		int n = vsnprintf(t->data + t->len, room, fmt, ap);
+		va_end(ap);
+
+		if (n < 0) {
+			t->ok = false;
+			return;
+		}
+
+		if ((size_t)n < room) {
+			t->len += n;
+			return;
+		}
+
+		size_t size = 2 * t->size + n;
+		char *data = realloc(t->data, size);
+		if (data == NULL) {
+			t->ok = false;
+			return;
+		}
+
+		t->data = data;
+		t->size = size;
+	}
+}
+
+/*
+ * Microseconds below which a share p of the calls fall, the calls in a
+ * bucket taken as spread evenly over it
+ */
+static double percentile(const uint64_t *hist, uint64_t calls, double p)
+{
+	double rank = p * calls;
+	uint64_t seen = 0;
+
+	for (int i = 0; i < IPC_HIST_BUCKETS; ++i) {
+		if (hist[i] == 0 || seen + hist[i] < rank) {
+			seen += hist[i];
+			continue;
+		}
+
+		double lo = (i > 0) ? (double)((uint64_t)1 << (i - 1)) : 0;
+		double hi = (double)((uint64_t)1 << i);
+
+		return (lo + (hi - lo) * (rank - seen) / hist[i]) / 1000;
+	}
+
+	return 0;
+}
+
+static double rate(uint64_t hits, uint64_t misses)
+{
+	return (hits + misses > 0) ? 100.0 * hits / (hits + misses) : 0;
+}
+
+static void put_calls(struct text *t, const struct ipc_stats *stats)
+{
+	put(t, "%-16s %10s %8s %12s %12s %10s %10s %10s\n", "call", "count",
+		"errors", "bytes_out", "bytes_in", "p50_us", "p90_us",
+		"p99_us");
+
+	for (uint32_t id = 0; id < RFS_FUNCS; ++id) {
+		const struct ipc_stats *s = &stats[id];
+		const uint64_t *rtt = s->hist[IPC_PHASE_HANDLER];
+		uint64_t errors = 0;
+
+		if (s->calls == 0)
+			continue;
+
+		for (int i = 0; i < IPC_ERRNO_MAX; ++i)
+			errors += s->errors[i];
+
+		put(t, "%-16s %10" PRIu64 " %8" PRIu64 " %12" PRIu64 " %12"
+			PRIu64 " %10.1f %10.1f %10.1f\n", ipc_func_rfs(id),
+			s->calls, errors, s->bytes_out, s->bytes_in,
+			percentile(rtt, s->calls, 0.5),
+			percentile(rtt, s->calls, 0.9),
+			percentile(rtt, s->calls, 0.99));
+	}
+}
+
+static void hist_copy(uint64_t *hist, const list_uint64_t *l)
+{
+	for (uint32_t i = 0; i < l->n && i < IPC_HIST_BUCKETS; ++i)
+		hist[i] = l->p[i];
+}
+
+/* Those of the server process serving the connection, by function id */
+static bool server_stats(struct ipc_stats *stats)
+{
+	struct ipc *ipc = rfs_ipc();
+	list_x_func_stats list;
+
+	if (ipc == NULL)
+		return false;
+
+	if (r_stats(ipc, &list) != 0) {
+		if (!ipc->ok)
+			fs_recover(ipc);
+
+		mpool_cleanup(&ipc->mp);
+		return false;
+	}
+
+	memset(stats, 0, sizeof(*stats) * RFS_FUNCS);
+
+	for (uint32_t i = 0; i < list.n; ++i) {
+		const x_func_stats *f = &list.p[i];
+		if (f->id >= RFS_FUNCS)
+			continue;
+
+		struct ipc_stats *s = &stats[f->id];
+		s->calls = f->calls;
+		s->bytes_in = f->bytes_in;
+		s->bytes_out = f->bytes_out;
+
+		for (uint32_t j = 0; j < f->errors.n; ++j) {
+			const x_errors *e = &f->errors.p[j];
+			if (e->err >= 0 && e->err < IPC_ERRNO_MAX)
+				s->errors[e->err] += e->calls;
+		}
+
+		hist_copy(s->hist[IPC_PHASE_DECODE], &f->decode);
+		hist_copy(s->hist[IPC_PHASE_HANDLER], &f->handler);
+		hist_copy(s->hist[IPC_PHASE_ENCODE], &f->encode);
+	}
+
+	mpool_cleanup(&ipc->mp);
+	return true;
+}
+
+/* The caller frees the text, the server is only asked if server is set */
+char *stats_text(bool server, size_t *len)
+{
+	struct text t = {malloc(TEXT_SIZE), 0, TEXT_SIZE, true};
+	struct ipc_stats *stats = malloc(sizeof(*stats) * RFS_FUNCS);
+
+	if (t.data == NULL || stats == NULL) {
+		free(t.data);
+		free(stats);
+		return NULL;
+	}
+
+	rfs_call_stats(stats);
+	put_calls(&t, stats);
+
+	put(&t, "\nreconnects %" PRIu64 "\n", rfs_reconnects());
+
+	uint64_t hits, misses, missing;
+	acache_stats(&hits, &misses, &missing);
+	put(&t, "attribute cache: %" PRIu64 " hits, %" PRIu64 " misses, "
+		"%.1f%% hit rate\n", hits, misses, rate(hits, misses));
+	put(&t, "missing paths: %" PRIu64 " answered from the cache\n",
+		missing);
+
+	bcache_stats(&hits, &misses);
+	put(&t, "block cache: %" PRIu64 " hits, %" PRIu64 " misses, "
+		"%.1f%% hit rate\n", hits, misses, rate(hits, misses));
+
+	struct zip_stats zs;
+	rfs_zip_stats(&zs);
+	put(&t, "compression: %" PRIu64 " bytes to %" PRIu64 ", %" PRIu64
+		" stored, %" PRIu64 " ms compressing, %" PRIu64
+		" ms decompressing\n", zs.in, zs.out, zs.stored,
+		zs.zip_ns / 1000000, zs.unzip_ns / 1000000);
+
+	if (server && (rfs_features() & IPC_FEATURE_STATS) &&
+		server_stats(stats)) {
+		put(&t, "\nserver, time in the handler:\n");
+		put_calls(&t, stats);
+	}
+
+	free(stats);
+
+	if (!t.ok) {
+		free(t.data);
+		return NULL;
+	}
+
+	*len = t.len;
+	return t.data;
+}
@@ -0,0 +1,469 @@
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <avl.h>
+
+#include "rfsc.h"
+
+/*
+ * Write-back buffer.  Writes through a handle are collected into a single
+ * dirty extent which grows while the writes are adjacent or overlapping.
+ * The extent is sent with one r_write() when it gets full, when a write
+ * does not fit into it, when it is older than WB_DELAY seconds, and
+ * before the operations that must see the data on the server.
+ *
+ * Errors of the buffered writes are kept in the handle and reported by
+ * the next fsync or flush.  A handle is busy while a thread works with
+ * its extent; the other threads wait for it.
+ *
+ * Handles know the path of their file, so that calls by path and reads
+ * through other handles of the file see the buffered data.
+ */
+
+#define WB_DELAY 1
+
+struct wfile {
+	struct avl_node avl;
+	struct wfile *prev, *next;
+	uint64_t key;
+	char *path;
+	bool busy;
+	int32_t error;
+	time_t dirtied;
+	x_off offset;
+	uint32_t len;
+	uint8_t *data;
+};
+
+static struct {
+	size_t size;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t tick;
+
+	struct avl files;
+	struct wfile *head;
+
+	bool stop;
+	bool running;
+	pthread_t thread;
+} wb = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.tick = PTHREAD_COND_INITIALIZER,
+};
+
+static int wfile_cmp(const struct wfile *x, const struct wfile *y)
+{
+	if (x->key < y->key)
+		return -1;
+	else if (x->key == y->key)
+		return 0;
+	else
+		return 1;
+}
+
+static struct wfile *wfile_add(uint64_t key, const char *path)
+{
+	struct wfile *f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return NULL;
+
+	f->path = strdup(path);
+	if (f->path == NULL) {
+		free(f);
+		return NULL;
+	}
+
+	f->key = key;
+	f->next = wb.head;
+
+	if (wb.head != NULL)
+		wb.head->prev = f;
+
+	wb.head = f;
+	avl_insert(&wb.files, f);
+	return f;
+}
+
+static void wfile_free(struct wfile *f)
+{
+	avl_remove(&wb.files, f);
+
+	if (f->prev != NULL)
+		f->prev->next = f->next;
+	else
+		wb.head = f->next;
+
+	if (f->next != NULL)
+		f->next->prev = f->prev;
+
+	free(f->path);
+	free(f->data);
+	free(f);
+}
+
+/* Wait until the handle is not busy and take it */
+static struct wfile *wfile_lock(uint64_t key, const char *path)
+{
+	struct wfile *f;
+
+	while ((f = avl_search(&wb.files, &(struct wfile){.key = key}))
+			!= NULL && f->busy)
+		pthread_cond_wait(&wb.cond, &wb.lock);
+
+	if (f == NULL && path != NULL)
+		f = wfile_add(key, path);
+
+	if (f != NULL)
+		f->busy = true;
+
+	return f;
+}
+
+static void wfile_unlock(struct wfile *f)
+{
+	f->busy = false;
+	pthread_cond_broadcast(&wb.cond);
+}
+
+/* Blocks cached through any handle of the file are stale now */
+static int32_t write_direct(struct ipc *ipc, uint64_t key, const char *path,
+			const void *buf, uint32_t size, x_off offset,
+			uint32_t *done)
+{
+	int32_t res = r_write(ipc, &key, &offset,
+			&(datum){size, (void *)buf}, done);
+
+	bcache_invalidate(key, path, offset, size);
+	return res;
+}
+
+/* Send the extent of a busy handle */
+static int32_t wfile_send(struct ipc *ipc, struct wfile *f)
+{
+	int32_t res = 0;
+
+	for (uint32_t pos = 0, done; pos < f->len; pos += done) {
+		uint32_t size = f->len - pos;
+		if (size > rfs_max_io())
+			size = rfs_max_io();
+
+		res = write_direct(ipc, f->key, f->path, f->data + pos,
+				size, f->offset + pos, &done);
+
+		if (res == 0 && done == 0)
+			res = EIO;
+
+		if (res != 0)
+			break;
+	}
+
+	f->len = 0;
+
+	/*
+	 * The error is kept for the sync point.  A lost connection is also
+	 * returned, the caller recovers and the handle is not valid anymore.
+	 */
+	if (res != 0 && f->error == 0)
+		f->error = ipc->ok ? res : EIO;
+
+	return ipc->ok ? 0 : res;
+}
+
+static bool wfile_fits(const struct wfile *f, x_off offset, uint32_t size)
+{
+	if (f->len == 0)
+		return true;
+
+	if (offset > f->offset + f->len || offset + size < f->offset)
+		return false;
+
+	x_off start = (offset < f->offset) ? offset : f->offset;
+	x_off end = (offset + size > f->offset + f->len) ?
+		offset + size : f->offset + f->len;
+
+	return (uint64_t)(end - start) <= wb.size;
+}
+
+static void wfile_merge(struct wfile *f, const void *buf, uint32_t size,
+			x_off offset)
+{
+	if (f->len == 0) {
+		f->offset = offset;
+		f->dirtied = time(NULL);
+	} else if (offset < f->offset) {
+		memmove(f->data + (f->offset - offset), f->data, f->len);
+		f->len += f->offset - offset;
+		f->offset = offset;
+	}
+
+	memcpy(f->data + (offset - f->offset), buf, size);
+
+	if (offset + size > f->offset + f->len)
+		f->len = offset + size - f->offset;
+}
+
+int32_t wback_write(struct ipc *ipc, uint64_t key, const char *path,
+		const void *buf, uint32_t size, x_off offset, uint32_t *done)
+{
+	if (wb.size == 0)
+		return write_direct(ipc, key, path, buf, size, offset, done);
+
+	pthread_mutex_lock(&wb.lock);
+	struct wfile *f = wfile_lock(key, path);
+	pthread_mutex_unlock(&wb.lock);
+
+	if (f == NULL)
+		return write_direct(ipc, key, path, buf, size, offset, done);
+
+	int32_t res = 0;
+
+	if (!wfile_fits(f, offset, size))
+		res = wfile_send(ipc, f);
+
+	if (res == 0 && f->data == NULL)
+		f->data = malloc(wb.size);
+
+	if (res == 0) {
+		if (size > wb.size || f->data == NULL) {
+			res = write_direct(ipc, key, f->path, buf, size,
+					offset, done);
+		} else {
+			wfile_merge(f, buf, size, offset);
+			*done = size;
+
+			if (f->len == wb.size)
+				res = wfile_send(ipc, f);
+		}
+	}
+
+	pthread_mutex_lock(&wb.lock);
+	wfile_unlock(f);
+	pthread_mutex_unlock(&wb.lock);
+
+	return res;
+}
+
+static int32_t flush(struct ipc *ipc, uint64_t key, bool report)
+{
+	pthread_mutex_lock(&wb.lock);
+	struct wfile *f = wfile_lock(key, NULL);
+	pthread_mutex_unlock(&wb.lock);
+
+	if (f == NULL)
+		return 0;
+
+	int32_t res = wfile_send(ipc, f);
+
+	if (res == 0 && report) {
+		res = f->error;
+		f->error = 0;
+	}
+
+	pthread_mutex_lock(&wb.lock);
+	wfile_unlock(f);
+	pthread_mutex_unlock(&wb.lock);
+
+	return res;
+}
+
+/*
+ * Put the data buffered by the handle and by any other handle of the file
+ * to the server before it is read back or the file is changed by path.
+ * Calls by path have no handle, key 0 is never one.
+ */
+int32_t wback_sync(struct ipc *ipc, uint64_t key, const char *path)
+{
+	int32_t res = 0;
+
+	if (wb.size == 0)
+		return 0;
+
+	pthread_mutex_lock(&wb.lock);
+
+	while (res == 0) {
+		struct wfile *f = wb.head;
+
+		while (f != NULL && ((f->key != key && (path == NULL ||
+				strcmp(f->path, path) != 0)) ||
+				(!f->busy && f->len == 0)))
+			f = f->next;
+
+		if (f == NULL)
+			break;
+
+		if (f->busy) {
+			pthread_cond_wait(&wb.cond, &wb.lock);
+			continue;
+		}
+
+		f->busy = true;
+		pthread_mutex_unlock(&wb.lock);
+
+		res = wfile_send(ipc, f);
+
+		pthread_mutex_lock(&wb.lock);
+		wfile_unlock(f);
+	}
+
+	pthread_mutex_unlock(&wb.lock);
+	return res;
+}
+
+/* Whether some handle of the file has data the server has not seen */
+bool wback_pending(const char *path)
+{
+	bool pending = false;
+
+	if (wb.size == 0)
+		return false;
+
+	pthread_mutex_lock(&wb.lock);
+
+	for (struct wfile *f = wb.head; f != NULL && !pending; f = f->next)
+		pending = strcmp(f->path, path) == 0 &&
+			(f->busy || f->len != 0);
+
+	pthread_mutex_unlock(&wb.lock);
+	return pending;
+}
+
+/* The files under the old name are under the new one now */
+void wback_rename(const char *from, const char *to)
+{
+	pthread_mutex_lock(&wb.lock);
+
+	for (struct wfile *f = wb.head; f != NULL; f = f->next) {
+		char *path = path_moved(f->path, from, to);
+
+		if (path != NULL) {
+			free(f->path);
+			f->path = path;
+		}
+	}
+
+	pthread_mutex_unlock(&wb.lock);
+}
+
+/* Sync point: also report the errors of the earlier writes */
+int32_t wback_flush(struct ipc *ipc, uint64_t key)
+{
+	return flush(ipc, key, true);
+}
+
+/* The last sync point of the handle, errors not reported yet included */
+int32_t wback_release(struct ipc *ipc, uint64_t key)
+{
+	pthread_mutex_lock(&wb.lock);
+	struct wfile *f = wfile_lock(key, NULL);
+	pthread_mutex_unlock(&wb.lock);
+
+	if (f == NULL)
+		return 0;
+
+	int32_t res = wfile_send(ipc, f);
+	if (res == 0)
+		res = f->error;
+
+	pthread_mutex_lock(&wb.lock);
+	wfile_free(f);
+	pthread_cond_broadcast(&wb.cond);
+	pthread_mutex_unlock(&wb.lock);
+
+	return res;
+}
+
+static void *flush_thread(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&wb.lock);
+
+	while (!wb.stop) {
+		struct timespec ts = {.tv_sec = time(NULL) + WB_DELAY};
+		pthread_cond_timedwait(&wb.tick, &wb.lock, &ts);
+
+		time_t now = time(NULL);
+
+		for (struct wfile *f = wb.head; f != NULL && !wb.stop;
+				f = f->next) {
+			if (f->busy || f->len == 0 ||
+					now - f->dirtied < WB_DELAY)
+				continue;
+
+			f->busy = true;
+			pthread_mutex_unlock(&wb.lock);
+
+			/* The handle stays in the list while it is busy */
+			struct ipc *ipc = rfs_ipc();
+			int32_t res = (ipc != NULL) ? wfile_send(ipc, f) : 0;
+
+			pthread_mutex_lock(&wb.lock);
+			wfile_unlock(f);
+
+			/* Recovery drops the handles, the next tick goes on */
+			if (res != 0) {
+				pthread_mutex_unlock(&wb.lock);
+				fs_recover(ipc);
+				pthread_mutex_lock(&wb.lock);
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&wb.lock);
+	return NULL;
+}
+
+void wback_init(size_t size)
+{
+	wb.size = size;
+	avl_init(&wb.files, offsetof(struct wfile, avl), (avl_cmp_t)wfile_cmp);
+}
+
+void wback_start(void)
+{
+	if (wb.size == 0)
+		return;
+
+	wb.stop = false;
+	wb.running = pthread_create(&wb.thread, NULL, flush_thread, NULL) == 0;
+}
+
+void wback_stop(void)
+{
+	pthread_mutex_lock(&wb.lock);
+	wb.stop = true;
+	pthread_cond_signal(&wb.tick);
+	pthread_mutex_unlock(&wb.lock);
+
+	if (wb.running) {
+		pthread_join(wb.thread, NULL);
+		wb.running = false;
+	}
+
+	wback_clear();
+}
+
+/* Drop all buffered data, the handles are not valid anymore */
+void wback_clear(void)
+{
+	pthread_mutex_lock(&wb.lock);
+
+	while (wb.head != NULL) {
+		if (wb.head->busy)
+			pthread_cond_wait(&wb.cond, &wb.lock);
+		else
+			wfile_free(wb.head);
+	}
+
+	pthread_cond_broadcast(&wb.cond);
+	pthread_mutex_unlock(&wb.lock);
+}
@@ -1,19 +1,28 @@
 #define _XOPEN_SOURCE 600
 
+#include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <syslog.h>
 #include <unistd.h>
 
 #include <io_file.h>
+#include <io_mux.h>
+#include <io_ring.h>
 #include "rfsd.h"
 
 #ifndef NI_MAXHOST
@@ -24,11 +33,19 @@
 #define NI_MAXSERV 32
 #endif
 
+#define MAX_WORKERS 256
+#define MAX_QUEUE_DEPTH 4096
+#define EPOLL_EVENTS 64
+#define CONN_CHUNK (16 << 10)
+#define CONN_KEEP (64 << 10)
+#define CONN_MAX_IN (16 << 20)
+#define CONN_MAX_OPS 32
+
 static struct ipc ipc;
 static sig_atomic_t should_stop;
 static sigjmp_buf exit_env;
 
-static int session(int sock, const struct sockaddr *addr, socklen_t addr_len)
+static void log_peer(const struct sockaddr *addr, socklen_t addr_len)
 {
 	char node[NI_MAXHOST];
 	char service[NI_MAXSERV];
@@ -40,26 +57,652 @@ static int session(int sock, const struct sockaddr *addr, socklen_t addr_len)
 	else
 		syslog(LOG_INFO, "New connection from unknown address "
 			"(getnameinfo: %s)", gai_strerror(gnierr));
+}
+
+static void log_zip(const struct ipc_zip *zip)
+{
+	if (!zip->on)
+		return;
+
+	syslog(LOG_INFO, "Compressed %" PRIu64 " bytes to %" PRIu64
+		", %" PRIu64 " datums stored, %" PRIu64 " ms compressing, %"
+		PRIu64 " ms decompressing", zip->in, zip->out, zip->stored,
+		zip->zip_ns / 1000000, zip->unzip_ns / 1000000);
+}
+
+/* A local session runs over a ring the client passes over the socket */
+static int session(int sock, const struct sockaddr *addr, socklen_t addr_len,
+		bool local)
+{
+	struct rfs_session rs;
+	struct io sock_io;
+	struct io_ring ring;
+	struct io_mux mux;
+	struct io_mux_channel ch;
+
+	if (local) {
+		syslog(LOG_INFO, "New local connection");
+
+		if (!io_ring_accept(&ring, sock)) {
+			syslog(LOG_ERR, "Failed to attach the ring: %s",
+				strerror(errno));
+			close(sock);
+			return 1;
+		}
+
+		io_ring_init(&sock_io, &ring);
+	} else {
+		log_peer(addr, addr_len);
+		io_file_init(&sock_io, sock);
+	}
+
+	if (!ipc_init(&ipc)) {
+		syslog(LOG_ERR, "Failed to allocate IPC buffers");
+		if (local)
+			io_ring_destroy(&ring);
+		else
+			close(sock);
+		return 1;
+	}
 
-	ipc_init(&ipc);
-	io_file_init(&ipc.io, sock);
+	io_mux_init(&mux, &sock_io);
+
+	mpool_keep(&ipc.mp, MPOOL_KEEP);
+	io_mux_server_init(&ipc.io, &ch, &mux);
 
 	syslog(LOG_DEBUG, "Starting RFS session");
-	rfs_init();
+	rfs_init(&rs);
+	rs.zip.sock = local ? -1 : sock;
+	ipc.zip = &rs.zip;
 
-	while (ipc_process_rfs(&ipc) && !should_stop)
-		;
+	/* What r_hello agreed on applies from the next call */
+	do {
+		ipc.wire = rs.wire;
+		ipc.tails = rs.tails;
+		if (ipc.rb.cap != rs.buffer_size)
+			ipc_resize(&ipc, rs.buffer_size);
+	} while (ipc_process_rfs(&ipc) && !should_stop);
 
 	syslog(LOG_DEBUG, "Closing RFS session");
-	rfs_destroy();
+	log_zip(&rs.zip);
+	rfs_destroy(&rs);
+	io_mux_destroy(&mux);
+	ipc_destroy(&ipc);
 
-	if (close(sock) == -1)
+	if (local)
+		io_ring_destroy(&ring);
+	else if (close(sock) == -1)
 		syslog(LOG_WARNING, "Closing client socket: %s",
 			strerror(errno));
 
 	return 0;
 }
 
+/*
+ * Event-driven sessions.  A worker multiplexes all its connections with
+ * epoll and shares one struct ipc between them.  Incoming frames are
+ * collected in a per-connection buffer and a request is decoded only
+ * once all of it has arrived: decoding runs against the buffer and is
+ * simply retried later if the buffer runs dry.  Replies are framed into
+ * a per-connection output buffer and sent without blocking.
+ *
+ * File I/O goes through io_uring when the kernel has it: such calls
+ * reply once their I/O completes, while later requests are served.  A
+ * connection outlives its socket until all of those are done.
+ */
+
+struct conn_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+};
+
+/* File range to send when the output reaches the given position */
+struct conn_file {
+	struct conn_file *next;
+	size_t at;
+	int fd;
+	off_t offset;
+	size_t len;
+	size_t missing;
+	bool tail;
+};
+
+struct conn {
+	struct conn *prev, *next;
+	struct rfs_session rs;
+	int fd;
+	uint32_t events;
+
+	struct conn_buf in;
+	size_t pos;
+	uint32_t tag;
+	uint32_t left;
+
+	struct conn_buf out;
+	size_t out_pos;
+	struct conn_file *files, **files_tail;
+
+	size_t rpos;
+	uint32_t rtag;
+	uint32_t rleft;
+	bool dry;
+
+	unsigned pending;
+};
+
+static struct conn *conns;
+static int conn_ep = -1;
+
+static bool conn_buf_reserve(struct conn_buf *b, size_t size, size_t max)
+{
+	if (b->size - b->len >= size)
+		return true;
+
+	size_t n = (b->size == 0) ? CONN_CHUNK : b->size;
+	while (n - b->len < size)
+		n <<= 1;
+
+	if (n > max)
+		return false;
+
+	uint8_t *p = realloc(b->data, n);
+	if (p == NULL)
+		return false;
+
+	b->data = p;
+	b->size = n;
+	return true;
+}
+
+static void conn_buf_shrink(struct conn_buf *b)
+{
+	if (b->len == 0 && b->size > CONN_KEEP) {
+		free(b->data);
+		b->data = NULL;
+		b->size = 0;
+	}
+}
+
+static ssize_t conn_read(struct io *io, void *p, size_t len)
+{
+	struct conn *c = io->handle.ptr;
+	const struct conn_buf *b = &c->in;
+
+	while (c->rleft == 0) {
+		if (b->len - c->rpos < IO_MUX_HDR_SIZE)
+			goto dry;
+
+		io_mux_hdr_unpack(b->data + c->rpos, &c->rtag, &c->rleft);
+		c->rpos += IO_MUX_HDR_SIZE;
+	}
+
+	size_t avail = b->len - c->rpos;
+	if (avail == 0)
+		goto dry;
+
+	if (len > c->rleft)
+		len = c->rleft;
+	if (len > avail)
+		len = avail;
+
+	memcpy(p, b->data + c->rpos, len);
+	c->rpos += len;
+	c->rleft -= len;
+	return len;
+
+dry:
+	c->dry = true;
+	return 0;
+}
+
+static ssize_t conn_writev(struct io *io, const struct iovec *iov, int cnt)
+{
+	struct conn *c = io->handle.ptr;
+	struct conn_buf *b = &c->out;
+	size_t len = 0;
+
+	for (int i = 0; i < cnt; ++i)
+		len += iov[i].iov_len;
+
+	if (!conn_buf_reserve(b, IO_MUX_HDR_SIZE + len, SIZE_MAX))
+		return -1;
+
+	io_mux_hdr_pack(b->data + b->len, c->rtag, len);
+	b->len += IO_MUX_HDR_SIZE;
+
+	for (int i = 0; i < cnt; ++i) {
+		memcpy(b->data + b->len, iov[i].iov_base, iov[i].iov_len);
+		b->len += iov[i].iov_len;
+	}
+
+	return len;
+}
+
+static ssize_t conn_write(struct io *io, const void *p, size_t len)
+{
+	return conn_writev(io, &(struct iovec){(void *)p, len}, 1);
+}
+
+/*
+ * The handle may be closed before the range is sent, so keep a dup.  The
+ * whole range is taken to be there, the datum tail is fixed if not, with
+ * the padding sent by conn_send().
+ */
+static ssize_t conn_sendfile(struct io *io, int fd, off_t offset, size_t len)
+{
+	struct conn *c = io->handle.ptr;
+	struct conn_buf *b = &c->out;
+	struct conn_file *f = malloc(sizeof(*f));
+
+	if (f == NULL || !conn_buf_reserve(b, IO_MUX_HDR_SIZE, SIZE_MAX) ||
+		(f->fd = dup(fd)) == -1) {
+		free(f);
+		return -1;
+	}
+
+	io_mux_hdr_pack(b->data + b->len, c->rtag, len);
+	b->len += IO_MUX_HDR_SIZE;
+
+	f->next = NULL;
+	f->at = b->len;
+	f->offset = offset;
+	f->len = len;
+	f->missing = 0;
+	f->tail = c->rs.tails;
+
+	*c->files_tail = f;
+	c->files_tail = &f->next;
+	return len;
+}
+
+/* The datum tail opens the frame after the file, it is not sent yet */
+static void conn_file_short(struct conn *c, const struct conn_file *f)
+{
+	uint8_t *p = c->out.data + f->at + IO_MUX_HDR_SIZE;
+	uint32_t got;
+
+	if (!f->tail || f->at + IO_MUX_HDR_SIZE + sizeof(got) > c->out.len)
+		return;
+
+	memcpy(&got, p, sizeof(got));
+	got = htonl(ntohl(got) - f->missing);
+	memcpy(p, &got, sizeof(got));
+}
+
+static void conn_file_free(struct conn *c)
+{
+	struct conn_file *f = c->files;
+
+	c->files = f->next;
+	if (c->files == NULL)
+		c->files_tail = &c->files;
+
+	close(f->fd);
+	free(f);
+}
+
+static bool conn_send(struct conn *);
+static bool conn_update(int, struct conn *);
+static void conn_close(struct conn *);
+
+static void conn_select(struct conn *c)
+{
+	rfs_select(&c->rs);
+	ipc.io.handle.ptr = c;
+	ipc.zip = &c->rs.zip;
+	ipc.wire = c->rs.wire;
+	ipc.tails = c->rs.tails;
+	ipc.wb.pos = 0;
+	ipc.file.fd = -1;
+}
+
+/* The reply of a deferred call goes out unless the client has gone */
+static void conn_op_done(struct uring_op *io)
+{
+	struct rfs_op *op = (struct rfs_op *)io;
+	struct conn *c = op->owner;
+
+	c->pending--;
+
+	if (c->fd == -1) {
+		rfs_op_done(NULL, op);
+		if (c->pending == 0)
+			free(c);
+		return;
+	}
+
+	conn_select(c);
+	c->rtag = op->tag;
+
+	if (!rfs_op_done(&ipc, op) || !conn_send(c) || !conn_update(conn_ep, c))
+		conn_close(c);
+}
+
+static void conn_defer(struct conn *c)
+{
+	struct rfs_op *op = c->rs.deferred;
+
+	c->rs.deferred = NULL;
+	op->io.done = conn_op_done;
+	op->owner = c;
+	op->tag = c->rtag;
+	c->pending++;
+}
+
+static bool conn_process(struct conn *c)
+{
+	while (c->pos < c->in.len) {
+		conn_select(c);
+		c->rpos = c->pos;
+		c->rtag = c->tag;
+		c->rleft = c->left;
+		c->dry = false;
+		ipc.rb.pos = ipc.rb.size = 0;
+		ipc.defer = uring_fd() != -1 && c->pending < CONN_MAX_OPS;
+
+		/* The buffers are shared, they only grow */
+		if (ipc.rb.cap < c->rs.buffer_size)
+			ipc_resize(&ipc, c->rs.buffer_size);
+
+		bool ok = ipc_process_rfs(&ipc);
+
+		if (c->rs.deferred != NULL)
+			conn_defer(c);
+
+		if (!ok) {
+			if (c->dry)
+				break;
+
+			return false;
+		}
+
+		size_t unread = ipc.rb.size - ipc.rb.pos;
+		c->pos = c->rpos - unread;
+		c->tag = c->rtag;
+		c->left = c->rleft + unread;
+	}
+
+	if (c->pos > 0) {
+		c->in.len -= c->pos;
+		memmove(c->in.data, c->in.data + c->pos, c->in.len);
+		c->pos = 0;
+	}
+
+	conn_buf_shrink(&c->in);
+	return true;
+}
+
+static bool conn_recv(struct conn *c)
+{
+	if (!conn_buf_reserve(&c->in, CONN_CHUNK, CONN_MAX_IN)) {
+		syslog(LOG_WARNING, "Request is too large");
+		return false;
+	}
+
+	struct conn_buf *b = &c->in;
+	ssize_t n = read(c->fd, b->data + b->len, b->size - b->len);
+
+	if (n > 0) {
+		b->len += n;
+		return conn_process(c);
+	}
+
+	return n == -1 && (errno == EAGAIN || errno == EINTR);
+}
+
+static bool conn_send(struct conn *c)
+{
+	static const uint8_t zeros[4096];
+	struct conn_buf *b = &c->out;
+
+	while (c->out_pos < b->len || c->files != NULL) {
+		struct conn_file *f = c->files;
+		ssize_t n;
+
+		if (f != NULL && f->len == 0) {
+			if (f->missing > 0)
+				conn_file_short(c, f);
+
+			conn_file_free(c);
+			continue;
+		}
+
+		if (f == NULL || c->out_pos < f->at) {
+			size_t end = (f != NULL) ? f->at : b->len;
+			n = write(c->fd, b->data + c->out_pos,
+				end - c->out_pos);
+
+			if (n > 0)
+				c->out_pos += n;
+		} else {
+			n = sendfile(c->fd, f->fd, &f->offset, f->len);
+
+			/* The file has got shorter, the length is sent */
+			if (n == 0) {
+				n = write(c->fd, zeros, (f->len < sizeof(zeros))
+					? f->len : sizeof(zeros));
+				if (n > 0)
+					f->missing += n;
+			}
+
+			if (n > 0)
+				f->len -= n;
+		}
+
+		if (n > 0)
+			continue;
+		else if (n == -1 && errno == EAGAIN)
+			return true;
+		else if (n == -1 && errno == EINTR)
+			continue;
+		else
+			return false;
+	}
+
+	b->len = c->out_pos = 0;
+	conn_buf_shrink(b);
+	return true;
+}
+
+static bool conn_update(int ep, struct conn *c)
+{
+	/* Stop reading requests while replies are not sent */
+	uint32_t events = (c->out.len > 0) ? EPOLLOUT : EPOLLIN;
+
+	if (events == c->events)
+		return true;
+
+	struct epoll_event ev = {.events = events, .data.ptr = c};
+	if (epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+		return false;
+
+	c->events = events;
+	return true;
+}
+
+static void conn_close(struct conn *c)
+{
+	syslog(LOG_DEBUG, "Closing RFS session");
+	log_zip(&c->rs.zip);
+	rfs_destroy(&c->rs);
+
+	if (close(c->fd) == -1)
+		syslog(LOG_WARNING, "Closing client socket: %s",
+			strerror(errno));
+
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		conns = c->next;
+
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+
+	while (c->files != NULL)
+		conn_file_free(c);
+
+	free(c->in.data);
+	free(c->out.data);
+
+	if (c->pending == 0)
+		free(c);
+	else
+		c->fd = -1;
+}
+
+static void conn_accept(int ep, int sock)
+{
+	for (;;) {
+		struct sockaddr_storage addr;
+		socklen_t addr_len = sizeof(addr);
+
+		int fd = accept(sock, (struct sockaddr *)&addr, &addr_len);
+		if (fd == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				syslog(LOG_WARNING,
+					"Accepting new connection: %s",
+					strerror(errno));
+			return;
+		}
+
+		log_peer((struct sockaddr *)&addr, addr_len);
+
+		struct conn *c = calloc(1, sizeof(*c));
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+
+		if (c == NULL ||
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) ||
+			epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			syslog(LOG_WARNING, "Failed to set up session: %s",
+				strerror(errno));
+			free(c);
+			close(fd);
+			continue;
+		}
+
+		syslog(LOG_DEBUG, "Starting RFS session");
+		c->fd = fd;
+		c->events = EPOLLIN;
+		c->files_tail = &c->files;
+		rfs_init(&c->rs);
+		c->rs.zip.sock = fd;
+
+		c->next = conns;
+		if (conns != NULL)
+			conns->prev = c;
+		conns = c;
+	}
+}
+
+static void worker_loop(int sock, unsigned queue_depth)
+{
+	syslog(LOG_DEBUG, "Running worker loop");
+
+	int ep = epoll_create(EPOLL_EVENTS);
+	if (ep == -1) {
+		syslog(LOG_ERR, "Failed to create epoll: %s", strerror(errno));
+		return;
+	}
+
+	conn_ep = ep;
+
+	/* Completions are told apart from connections by the pointer */
+	static int uring_ev;
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &uring_ev};
+
+	if (queue_depth == 0) {
+		syslog(LOG_INFO, "File I/O blocks, as requested");
+	} else if (!uring_init(queue_depth) ||
+		epoll_ctl(ep, EPOLL_CTL_ADD, uring_fd(), &ev) == -1) {
+		syslog(LOG_INFO, "File I/O blocks, io_uring is not available: "
+			"%s", strerror(errno));
+		uring_destroy();
+	}
+
+	ev.data.ptr = NULL;
+
+	if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1 ||
+		epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev) == -1) {
+		syslog(LOG_ERR, "Failed to watch listen socket: %s",
+			strerror(errno));
+		close(ep);
+		return;
+	}
+
+	if (!ipc_init(&ipc)) {
+		syslog(LOG_ERR, "Failed to allocate IPC buffers");
+		close(ep);
+		return;
+	}
+
+	mpool_keep(&ipc.mp, MPOOL_KEEP);
+	ipc.io.read = conn_read;
+	ipc.io.write = conn_write;
+	ipc.io.readv = NULL;
+	ipc.io.writev = conn_writev;
+	ipc.io.flush = NULL;
+	ipc.io.sendfile = conn_sendfile;
+
+	while (!should_stop) {
+		struct epoll_event events[EPOLL_EVENTS];
+
+		/* What the last pass has queued goes in one batch */
+		int n = epoll_wait(ep, events, EPOLL_EVENTS,
+				uring_submit() ? -1 : 1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			syslog(LOG_ERR, "Waiting for events: %s",
+				strerror(errno));
+			break;
+		}
+
+		bool reap = false;
+
+		for (int i = 0; i < n; ++i) {
+			struct conn *c = events[i].data.ptr;
+
+			if (c == NULL) {
+				conn_accept(ep, sock);
+				continue;
+			}
+
+			/* Replies may close connections, so they come last */
+			if (events[i].data.ptr == &uring_ev) {
+				reap = true;
+				continue;
+			}
+
+			bool ok;
+
+			if (events[i].events & EPOLLOUT)
+				ok = conn_send(c) &&
+					(c->out.len > 0 || conn_process(c));
+			else if (events[i].events & EPOLLIN)
+				ok = conn_recv(c);
+			else
+				ok = false;
+
+			ok = ok && conn_send(c) && conn_update(ep, c);
+
+			if (!ok)
+				conn_close(c);
+		}
+
+		if (reap)
+			uring_reap();
+	}
+
+	while (conns != NULL)
+		conn_close(conns);
+
+	uring_destroy();
+	ipc_destroy(&ipc);
+	close(ep);
+}
+
 static void set_term_sigs(void (*handler)(int))
 {
 	struct sigaction sa = {.sa_handler = handler};
@@ -92,7 +735,8 @@ static void rfsd_exit_one(int sig)
 		_exit(0);
 }
 
-static int setup_socket(const char *nodename, const char *servname)
+static int setup_socket(const char *nodename, const char *servname,
+			bool reuseport)
 {
 	syslog(LOG_INFO, "Requested to listen on %s:%s", nodename, servname);
 
@@ -132,13 +776,25 @@ static int setup_socket(const char *nodename, const char *servname)
 			continue;
 		}
 
+#ifdef SO_REUSEPORT
+		int one = 1;
+		if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+						&one, sizeof(one)) == -1) {
+			syslog(LOG_DEBUG, "Failed to enable SO_REUSEPORT: %s",
+				strerror(errno));
+			goto fail;
+		}
+#else
+		(void)reuseport;
+#endif
+
 		if (bind(sock, p->ai_addr, p->ai_addrlen) == -1) {
 			syslog(LOG_DEBUG, "Failed to bind: %s",
 				strerror(errno));
 			goto fail;
 		}
 
-		if (listen(sock, 1) == -1) {
+		if (listen(sock, SOMAXCONN) == -1) {
 			syslog(LOG_DEBUG, "Failed to listen: %s",
 				strerror(errno));
 			goto fail;
@@ -174,7 +830,40 @@ static int setup_socket(const char *nodename, const char *servname)
 	return sock;
 }
 
-static void main_loop(int sock)
+static int setup_local_socket(const char *path)
+{
+	syslog(LOG_INFO, "Requested to listen on %s", path);
+
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		syslog(LOG_ERR, "Socket path is too long");
+		return -1;
+	}
+
+	strcpy(addr.sun_path, path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1) {
+		syslog(LOG_ERR, "Failed to open socket: %s", strerror(errno));
+		return -1;
+	}
+
+	/* A socket left over by an earlier run is replaced */
+	unlink(path);
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+		listen(sock, SOMAXCONN) == -1) {
+		syslog(LOG_ERR, "Failed to listen on %s: %s", path,
+			strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	syslog(LOG_DEBUG, "Local socket is ready");
+	return sock;
+}
+
+static void main_loop(int sock, bool local)
 {
 	syslog(LOG_DEBUG, "Running main loop");
 
@@ -186,6 +875,8 @@ static void main_loop(int sock)
 		socklen_t addr_len = sizeof(addr);
 
 		int rsock = accept(sock, (struct sockaddr *)&addr, &addr_len);
+		if (rsock == -1 && should_stop)
+			return;
 		if (rsock == -1) {
 			syslog(LOG_WARNING, "Accepting new connection: %s",
 				strerror(errno));
@@ -204,7 +895,8 @@ static void main_loop(int sock)
 					"Closing listen socket: %s",
 					strerror(errno));
 
-			session(rsock, (struct sockaddr *)&addr, addr_len);
+			session(rsock, (struct sockaddr *)&addr, addr_len,
+				local);
 			return;
 		}
 
@@ -216,6 +908,96 @@ static void main_loop(int sock)
 	}
 }
 
+/* Local sessions are accepted by a process of their own */
+static bool local_listener(int usock, const int *socks, int nsock)
+{
+	sigset_t allsig, oldmask;
+	sigfillset(&allsig);
+	sigprocmask(SIG_BLOCK, &allsig, &oldmask);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		set_term_sigs(rfsd_exit_one);
+		sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+		for (int i = 0; i < nsock; ++i) {
+			if (close(socks[i]) == -1)
+				syslog(LOG_WARNING,
+					"Closing listen socket: %s",
+					strerror(errno));
+		}
+
+		main_loop(usock, true);
+		return true;
+	}
+
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+	if (pid == -1)
+		syslog(LOG_ERR, "Failed to start local listener: %s",
+			strerror(errno));
+
+	if (close(usock) == -1)
+		syslog(LOG_WARNING, "Closing local socket: %s",
+			strerror(errno));
+	return false;
+}
+
+static void workers_loop(const int *socks, int nsock, int workers,
+			unsigned queue_depth)
+{
+	syslog(LOG_DEBUG, "Starting %d workers", workers);
+
+	sigset_t allsig;
+	sigfillset(&allsig);
+
+	for (int i = 0; i < workers; ++i) {
+		sigset_t oldmask;
+		sigprocmask(SIG_BLOCK, &allsig, &oldmask);
+
+		pid_t pid = fork();
+		if (pid == 0) {
+			set_term_sigs(rfsd_exit_one);
+			sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+			for (int j = 0; j < nsock; ++j) {
+				if (j != i % nsock && close(socks[j]) == -1)
+					syslog(LOG_WARNING,
+						"Closing listen socket: %s",
+						strerror(errno));
+			}
+
+			worker_loop(socks[i % nsock], queue_depth);
+			return;
+		}
+
+		sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+		if (pid == -1)
+			syslog(LOG_ERR, "Failed to start worker: %s",
+				strerror(errno));
+	}
+
+	while (wait(NULL) != -1 || errno != ECHILD)
+		;
+}
+
+static const char usage[] =
+	"Usage: %s [-w workers] [-q queue_depth] [-b buffer_kib] "
+	"[-i max_io_kib] [-u local_socket] host port\n";
+
+/* A size in KiB from min to max bytes, 0 if it is not one */
+static uint32_t parse_kib(const char *s, uint32_t min, uint32_t max)
+{
+	char *end;
+	unsigned long kib = strtoul(s, &end, 10);
+
+	if (*s == '\0' || *end != '\0' || kib > max >> 10 ||
+		kib << 10 < min)
+		return 0;
+	return kib << 10;
+}
+
 int main(int argc, char **argv)
 {
 	openlog(argv[0],
@@ -224,34 +1006,121 @@ int main(int argc, char **argv)
 #endif
 		LOG_PID | LOG_CONS | LOG_NOWAIT, LOG_USER);
 
-	if (argc != 3) {
-		syslog(LOG_EMERG,
-			"%d arguments passed, while 2 are required", argc);
+	int workers = 0;
+	int queue_depth = 64;
+	uint32_t buffer_max = 1 << 20;
+	uint32_t io_max = 4 << 20;
+	const char *local_path = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:q:b:i:u:")) != -1) {
+		switch (opt) {
+		case 'w':
+			workers = atoi(optarg);
+			if (workers > 0 && workers <= MAX_WORKERS)
+				break;
+
+			syslog(LOG_EMERG, "Number of workers must be "
+				"from 1 to %d", MAX_WORKERS);
+			return 1;
+		case 'q':
+			queue_depth = atoi(optarg);
+			if (queue_depth >= 0 && queue_depth <= MAX_QUEUE_DEPTH)
+				break;
+
+			syslog(LOG_EMERG, "Queue depth must be from 0 to %d",
+				MAX_QUEUE_DEPTH);
+			return 1;
+		case 'b':
+			buffer_max = parse_kib(optarg, IPC_BUFFER_MIN,
+					IPC_BUFFER_MAX);
+			if (buffer_max != 0)
+				break;
+
+			syslog(LOG_EMERG, "Buffer size must be from %d to "
+				"%d KiB", IPC_BUFFER_MIN >> 10,
+				IPC_BUFFER_MAX >> 10);
+			return 1;
+		case 'i':
+			io_max = parse_kib(optarg, IPC_IO_MIN, UINT32_MAX);
+			if (io_max != 0)
+				break;
+
+			syslog(LOG_EMERG, "Maximum I/O size must be at least "
+				"%d KiB", IPC_IO_MIN >> 10);
+			return 1;
+		case 'u':
+			local_path = optarg;
+			break;
+		default:
+			fprintf(stderr, usage, argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind != 2) {
+		syslog(LOG_EMERG, "%d arguments passed, while 2 are required",
+			argc - optind);
+		fprintf(stderr, usage, argv[0]);
 		return 1;
 	}
 
+	rfs_limits(buffer_max, io_max);
+
 	setpgrp();
 	set_term_sigs(rfsd_shutdown);
 	sigignore(SIGCHLD);
 
-	int sock = setup_socket(argv[1], argv[2]);
-	if (sock == -1) {
-		syslog(LOG_EMERG, "Cannot listen requested address!");
-		return 1;
+	/* With SO_REUSEPORT every worker gets its own listen socket */
+	int socks[MAX_WORKERS];
+#ifdef SO_REUSEPORT
+	int nsock = (workers > 0) ? workers : 1;
+#else
+	int nsock = 1;
+#endif
+
+	for (int i = 0; i < nsock; ++i) {
+		socks[i] = setup_socket(argv[optind], argv[optind + 1],
+					workers > 0);
+		if (socks[i] == -1) {
+			syslog(LOG_EMERG, "Cannot listen requested address!");
+			return 1;
+		}
 	}
 
-	if (!sigsetjmp(exit_env, 0))
-		main_loop(sock);
-	else {
+	int usock = -1;
+	if (local_path != NULL) {
+		usock = setup_local_socket(local_path);
+		if (usock == -1) {
+			syslog(LOG_EMERG, "Cannot listen on local socket!");
+			return 1;
+		}
+	}
+
+	if (!sigsetjmp(exit_env, 0)) {
+		if (usock != -1 && local_listener(usock, socks, nsock)) {
+			/* The local listener, or one of its sessions, is done */
+		} else if (workers > 0) {
+			workers_loop(socks, nsock, workers, queue_depth);
+		} else {
+			main_loop(socks[0], false);
+		}
+	} else {
 		syslog(LOG_DEBUG, "Stopping the server");
 
-		if (close(sock) == -1)
-			syslog(LOG_WARNING, "Closing listen socket: %s",
-				strerror(errno));
+		for (int i = 0; i < nsock; ++i) {
+			if (close(socks[i]) == -1)
+				syslog(LOG_WARNING,
+					"Closing listen socket: %s",
+					strerror(errno));
+		}
 
 		syslog(LOG_DEBUG, "Waiting for children...");
 		while (wait(NULL) != -1 || errno != ECHILD)
 			;
+
+		if (local_path != NULL)
+			unlink(local_path);
 	}
 
 	syslog(LOG_INFO, "Bye-bye!");
@@ -1,4 +1,44 @@
+#include <avl.h>
+#include <handle.h>
 #include "rfs.h"
+#include "rfsd_uring.h"
 
-void rfs_init(void);
-void rfs_destroy(void);
+/*
+ * A call that replies once its I/O is done.  The function leaves it in
+ * the session, the session loop notes where the reply goes and calls
+ * rfs_op_done() on completion, with no ipc if the client has gone.
+ */
+struct rfs_op {
+	struct uring_op io;
+	void *owner;
+	uint32_t tag;
+};
+
+struct rfs_session {
+	struct handle_table handles;
+	struct avl paths;
+	struct ipc_zip zip;
+	enum ipc_wire wire;
+	bool tails;
+	uint32_t buffer_size;
+	uint32_t max_io;
+	struct rfs_op *deferred;
+};
+
+void rfs_limits(uint32_t buffer_max, uint32_t io_max);
+void rfs_init(struct rfs_session *);
+void rfs_select(struct rfs_session *);
+void rfs_destroy(struct rfs_session *);
+bool rfs_op_done(struct ipc *, struct rfs_op *);
+
+/* The parent directory of a path is at fd, the name is in it */
+struct at {
+	int fd;
+	const char *name;
+	struct dir *dir;
+};
+
+bool path_under(const char *path, const char *dir);
+void dcache_get(struct at *, const char *path);
+void dcache_put(struct dir *);
+void dcache_drop(const char *path);
@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rfsd.h"
+
+/*
+ * Directory cache.  Parents of the paths called on are kept open by path,
+ * so the kernel only walks the last name.  Renames and removals made here
+ * drop what they affect at once.  Those made by other processes, like
+ * sessions of other workers, are found by checking that the path still
+ * leads to the directory each time it is used.
+ */
+
+#define DIR_MAX 64
+
+struct dir {
+	struct avl_node avl;
+	struct dir *prev, *next;
+	const char *path;
+	size_t len;
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	uint32_t refs;
+	bool cached;
+};
+
+static int dir_cmp(const struct dir *x, const struct dir *y)
+{
+	size_t n = (x->len < y->len) ? x->len : y->len;
+	int res = memcmp(x->path, y->path, n);
+
+	return (res != 0) ? res : (x->len > y->len) - (x->len < y->len);
+}
+
+static struct {
+	size_t count;
+	struct avl dirs;
+	struct dir *head, *tail;
+} dc = {
+	.dirs = {NULL, offsetof(struct dir, avl), (avl_cmp_t)dir_cmp},
+};
+
+static void lru_unlink(struct dir *d)
+{
+	if (d->prev != NULL)
+		d->prev->next = d->next;
+	else
+		dc.head = d->next;
+
+	if (d->next != NULL)
+		d->next->prev = d->prev;
+	else
+		dc.tail = d->prev;
+}
+
+static void lru_push(struct dir *d)
+{
+	d->prev = NULL;
+	d->next = dc.head;
+
+	if (dc.head != NULL)
+		dc.head->prev = d;
+	else
+		dc.tail = d;
+
+	dc.head = d;
+}
+
+static void dir_free(struct dir *d)
+{
+	close(d->fd);
+	free(d);
+}
+
+/* Queued I/O may still refer to it, then the last dcache_put() closes it */
+static void dir_drop(struct dir *d)
+{
+	avl_remove(&dc.dirs, d);
+	lru_unlink(d);
+	d->cached = false;
+	--dc.count;
+
+	if (d->refs == 0)
+		dir_free(d);
+}
+
+static struct dir *dir_open(const char *path, size_t len)
+{
+	struct dir *d = malloc(sizeof(*d) + len + 1);
+	if (d == NULL)
+		return NULL;
+
+	char *p = (char *)(d + 1);
+	memcpy(p, path, len);
+	p[len] = '\0';
+
+	struct stat st;
+	d->fd = open(p, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (d->fd == -1 || fstat(d->fd, &st) == -1) {
+		if (d->fd != -1)
+			close(d->fd);
+		free(d);
+		return NULL;
+	}
+
+	d->path = p;
+	d->len = len;
+	d->dev = st.st_dev;
+	d->ino = st.st_ino;
+	d->refs = 0;
+	d->cached = true;
+
+	avl_insert(&dc.dirs, d);
+	lru_push(d);
+
+	if (++dc.count > DIR_MAX)
+		dir_drop(dc.tail);
+
+	return d;
+}
+
+/*
+ * Whether the path still leads to the directory.  It may change between
+ * the check and the call made in it, as it may while a path is walked.
+ */
+static bool dir_valid(const struct dir *d)
+{
+	struct stat st;
+
+	return stat(d->path, &st) == 0 && st.st_dev == d->dev &&
+		st.st_ino == d->ino;
+}
+
+bool path_under(const char *path, const char *dir)
+{
+	size_t len = strlen(dir);
+
+	return strncmp(path, dir, len) == 0 &&
+		(path[len] == '\0' || path[len] == '/');
+}
+
+/*
+ * Paths without a parent to speak of, like relative ones or those that
+ * end in a slash, are walked in full, so are those whose parent cannot
+ * be opened: the call then fails as it would have anyway.
+ */
+void dcache_get(struct at *at, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+
+	at->fd = AT_FDCWD;
+	at->name = path;
+	at->dir = NULL;
+
+	if (slash == NULL || slash[1] == '\0')
+		return;
+
+	/* The parent of a name in the root is the root itself */
+	size_t len = (slash > path) ? (size_t)(slash - path) : 1;
+	struct dir *d = avl_search(&dc.dirs, &(struct dir){.path = path,
+				.len = len});
+
+	if (d != NULL && !dir_valid(d)) {
+		dir_drop(d);
+		d = NULL;
+	}
+
+	if (d != NULL) {
+		lru_unlink(d);
+		lru_push(d);
+	} else {
+		d = dir_open(path, len);
+		if (d == NULL)
+			return;
+	}
+
+	++d->refs;
+	at->fd = d->fd;
+	at->name = slash + 1;
+	at->dir = d;
+}
+
+void dcache_put(struct dir *d)
+{
+	if (d != NULL && --d->refs == 0 && !d->cached)
+		dir_free(d);
+}
+
+/* A name has gone or changed, so have the directories under it */
+void dcache_drop(const char *path)
+{
+	struct dir *next;
+
+	for (struct dir *d = dc.head; d != NULL; d = next) {
+		next = d->next;
+		if (path_under(d->path, path))
+			dir_drop(d);
+	}
+}
@@ -1,84 +1,425 @@
-#define _XOPEN_SOURCE 600
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <linux/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <time.h>
 #include <unistd.h>
-#include <utime.h>
-
-#include <avl.h>
 
 #include "rfsd.h"
 
-static bool fd_key_set;
-static uint64_t fd_key;
+#define DIR_BATCH_MAX 4096
+#define SLOW_NS 200000
+#define SLOW_CALLS 1024
+
+#define STREAK_MIN 3
+#define SEQ_SLACK 4
+#define WINDOW_MIN (256 << 10)
+#define WINDOW_MAX (8 << 20)
+#define STRIDE_AHEAD 4
+#define DROP_MIN (32 << 20)
+#define DROP_LAG (8 << 20)
+#define DROP_CHUNK (4 << 20)
+
+enum access_pattern {
+	ACCESS_NONE,
+	ACCESS_SEQUENTIAL,
+	ACCESS_STRIDED,
+	ACCESS_RANDOM,
+};
 
+/*
+ * Reads of an open file.  A pattern is taken once enough reads in a row
+ * follow it, and the kernel is told: sequential reads get a growing
+ * window read ahead of them, strided ones the next few records.  A
+ * sequential pass over a large file from its start is most likely a
+ * copy, like a backup, so pages well behind it are dropped.  Only those
+ * it brought in: chunks are looked at in the page cache before the pass
+ * gets to them, and those that had any page cached are left alone.
+ */
+struct access {
+	enum access_pattern pattern;
+	enum access_pattern seen;
+	uint32_t streak;
+	x_off last;
+	x_off next;
+	x_off stride;
+	x_off run_start;
+	x_off hinted;
+	x_off dropped;
+	x_off probed;
+	bool *warm;
+	size_t chunks;
+	uint32_t window;
+};
+
+/*
+ * Files and directories share the key space, dir is NULL for files.
+ * Open files are also found by path, one for each, so that calls by path
+ * can use the descriptor.  Someone else may have put another file under
+ * the name since, so each use checks that the name is still the file.
+ */
 struct file_node {
-	struct avl_node avl;
-	uint64_t key;
 	int fd;
+	DIR *dir;
+	x_off pos;
+	struct access acc;
+	struct avl_node avl;
+	char *path;
+	bool writable;
+	dev_t dev;
+	ino_t ino;
 };
-static struct avl files;
 
-struct dir_node {
-	struct avl_node avl;
-	uint64_t key;
-	DIR *dir;
+enum op_call {
+	OP_READ,
+	OP_WRITE,
+	OP_FSYNC,
+	OP_FDATASYNC,
+	OP_GETATTR,
+	OP_OPEN,
 };
-static struct avl dirs;
 
-static int file_node_cmp(const struct file_node *x, const struct file_node *y)
+/* The buffer follows, with the data read or written or with the path */
+struct op {
+	struct rfs_op base;
+	enum op_call call;
+	struct ipc_call stats;
+	struct dir *dir;
+	int32_t flags;
+	struct statx stx;
+	uint8_t buf[];
+};
+
+static struct rfs_session *cur;
+static uint32_t buffer_max = 1 << 20;
+static uint32_t io_max = 4 << 20;
+
+/*
+ * io_uring hands stat over to a kernel thread, which costs more than a
+ * cached lstat(), so attributes are only fetched that way for a while
+ * after an lstat() has been slow
+ */
+static uint32_t slow_stats;
+
+/* Queued I/O may use the descriptor, submitted I/O holds on to the file */
+static int file_node_close(struct file_node *p)
 {
-	if (x->key < y->key)
-		return -1;
-	else if (x->key == y->key)
-		return 0;
+	uring_submit();
+	free(p->acc.warm);
+
+	if (p->dir != NULL)
+		return closedir(p->dir);
 	else
-		return 1;
+		return close(p->fd);
 }
 
 static void file_node_free(struct file_node *p)
 {
-	close(p->fd);
-	free(p);
+	free(p->path);
+	file_node_close(p);
 }
 
-static int dir_node_cmp(const struct dir_node *x, const struct dir_node *y)
+static int file_node_cmp(const struct file_node *x, const struct file_node *y)
 {
-	if (x->key < y->key)
-		return -1;
-	else if (x->key == y->key)
-		return 0;
+	return strcmp(x->path, y->path);
+}
+
+static void file_node_init(struct file_node *p, int fd)
+{
+	p->fd = fd;
+	p->dir = NULL;
+	p->path = NULL;
+	memset(&p->acc, 0, sizeof(p->acc));
+}
+
+static struct file_node *file_by_path(const char *path)
+{
+	return avl_search(&cur->paths,
+		&(struct file_node){.path = (char *)path});
+}
+
+static void file_index(struct file_node *p, const char *path, int flags)
+{
+	if (file_by_path(path) != NULL)
+		return;
+
+	struct stat st;
+	if (fstat(p->fd, &st) == -1)
+		return;
+
+	p->path = strdup(path);
+	if (p->path == NULL)
+		return;
+
+	p->writable = (flags & O_ACCMODE) != O_RDONLY;
+	p->dev = st.st_dev;
+	p->ino = st.st_ino;
+	avl_insert(&cur->paths, p);
+}
+
+static void file_unindex(struct file_node *p)
+{
+	if (p->path == NULL)
+		return;
+
+	avl_remove(&cur->paths, p);
+	free(p->path);
+	p->path = NULL;
+}
+
+/* Only hints, it is of no matter if they fail */
+static void advise(int fd, x_off offset, x_off len, int advice)
+{
+	(void)posix_fadvise(fd, offset, len, advice);
+}
+
+/* Whether any page of the chunk at offset is in the page cache */
+static bool chunk_cached(int fd, x_off offset)
+{
+	static long page;
+	unsigned char vec[DROP_CHUNK / 4096];
+
+	if (page == 0)
+		page = sysconf(_SC_PAGESIZE);
+
+	void *m = mmap(NULL, DROP_CHUNK, PROT_READ, MAP_SHARED, fd, offset);
+	if (m == MAP_FAILED)
+		return true;
+
+	bool cached = mincore(m, DROP_CHUNK, vec) == -1;
+	for (long i = 0; !cached && i < DROP_CHUNK / page; ++i)
+		cached = vec[i] & 1;
+
+	munmap(m, DROP_CHUNK);
+	return cached;
+}
+
+/* Chunks up to end are seen as they were before the pass */
+static void access_probe(struct file_node *p, x_off end)
+{
+	struct access *a = &p->acc;
+
+	while (a->probed < end) {
+		size_t i = a->probed / DROP_CHUNK;
+
+		if (i >= a->chunks) {
+			size_t n = (a->chunks > 0) ? a->chunks * 2 : 64;
+			bool *warm = realloc(a->warm, n * sizeof(*warm));
+			if (warm == NULL)
+				return;
+
+			a->warm = warm;
+			a->chunks = n;
+		}
+
+		a->warm[i] = chunk_cached(p->fd, a->probed);
+		a->probed += DROP_CHUNK;
+	}
+}
+
+/* Drop what the pass brought into [from, to), nothing it has not seen */
+static void access_drop(struct file_node *p, x_off from, x_off to)
+{
+	struct access *a = &p->acc;
+
+	if (to > a->probed)
+		to = a->probed;
+
+	while (from < to) {
+		bool warm = a->warm[from / DROP_CHUNK];
+		x_off end = from - from % DROP_CHUNK + DROP_CHUNK;
+
+		while (end < to && a->warm[end / DROP_CHUNK] == warm)
+			end += DROP_CHUNK;
+
+		if (end > to)
+			end = to;
+
+		if (!warm)
+			advise(p->fd, from, end - from, POSIX_FADV_DONTNEED);
+
+		from = end;
+	}
+}
+
+static void access_switch(struct file_node *p, enum access_pattern pattern)
+{
+	struct access *a = &p->acc;
+
+	a->pattern = pattern;
+
+	switch (pattern) {
+	case ACCESS_SEQUENTIAL:
+		advise(p->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		a->hinted = a->next;
+		a->window = WINDOW_MIN;
+		a->dropped = a->run_start;
+		break;
+	case ACCESS_STRIDED:
+		/* The kernel would read ahead what is skipped */
+		advise(p->fd, 0, 0, POSIX_FADV_RANDOM);
+		for (int i = 1; i < STRIDE_AHEAD; ++i) {
+			x_off at = a->last + i * a->stride;
+			if (at >= 0)
+				advise(p->fd, at, a->next - a->last,
+					POSIX_FADV_WILLNEED);
+		}
+		break;
+	case ACCESS_RANDOM:
+		advise(p->fd, 0, 0, POSIX_FADV_RANDOM);
+		break;
+	case ACCESS_NONE:
+		break;
+	}
+}
+
+static void access_sequential(struct file_node *p)
+{
+	struct access *a = &p->acc;
+
+	/* Half a window is still ahead, as with the kernel's readahead */
+	if (a->next + a->window / 2 > a->hinted) {
+		x_off from = (a->hinted > a->next) ? a->hinted : a->next;
+
+		if (a->run_start == 0)
+			access_probe(p, a->next + a->window);
+
+		advise(p->fd, from, a->next + a->window - from,
+			POSIX_FADV_WILLNEED);
+		a->hinted = a->next + a->window;
+		if (a->window < WINDOW_MAX)
+			a->window <<= 1;
+	}
+
+	/* Earlier replies may still be sent from the cache, so it lags */
+	x_off upto = a->last - DROP_LAG;
+
+	if (a->run_start == 0 && a->next >= DROP_MIN &&
+		upto - a->dropped >= DROP_CHUNK) {
+		access_drop(p, a->dropped, upto);
+		a->dropped = upto;
+	}
+}
+
+static void access_track(struct file_node *p, x_off offset, uint32_t len)
+{
+	struct access *a = &p->acc;
+	x_off gap = offset - a->next;
+	x_off slack = SEQ_SLACK * (x_off)len;
+	x_off delta = offset - a->last;
+	enum access_pattern seen;
+
+	/* Reads of several client threads come a bit out of order */
+	if (gap >= -slack && gap <= slack)
+		seen = ACCESS_SEQUENTIAL;
+	else if (delta == a->stride && delta != 0)
+		seen = ACCESS_STRIDED;
 	else
-		return 1;
+		seen = ACCESS_RANDOM;
+
+	if (seen != ACCESS_SEQUENTIAL)
+		a->run_start = offset;
+
+	a->streak = (seen == a->seen) ? a->streak + 1 : 1;
+	a->seen = seen;
+	a->stride = delta;
+	a->last = offset;
+
+	if (seen != ACCESS_SEQUENTIAL || a->next < offset + len)
+		a->next = offset + len;
+
+	if (a->streak >= STREAK_MIN && a->pattern != seen)
+		access_switch(p, seen);
+
+	if (seen != a->pattern)
+		return;
+
+	if (seen == ACCESS_SEQUENTIAL) {
+		access_sequential(p);
+	} else if (seen == ACCESS_STRIDED) {
+		x_off at = offset + STRIDE_AHEAD * delta;
+		if (at >= 0)
+			advise(p->fd, at, len, POSIX_FADV_WILLNEED);
+	}
+}
+
+/*
+ * What a one-pass copy has read is of no use to anyone else.  Pages that
+ * were still being sent when dropped have stayed, so all of it goes.
+ */
+static void access_done(struct file_node *p)
+{
+	struct access *a = &p->acc;
+
+	if (a->pattern == ACCESS_SEQUENTIAL && a->run_start == 0 &&
+		a->next >= DROP_MIN)
+		access_drop(p, 0, a->next);
+}
+
+static struct file_node *file_get(uint64_t key)
+{
+	struct file_node *p = handle_get(&cur->handles, key);
+	return (p != NULL && p->dir == NULL) ? p : NULL;
 }
 
-static void dir_node_free(struct dir_node *p)
+static struct file_node *dir_get(uint64_t key)
 {
-	closedir(p->dir);
-	free(p);
+	struct file_node *p = handle_get(&cur->handles, key);
+	return (p != NULL && p->dir != NULL) ? p : NULL;
 }
 
-void rfs_init(void)
+void rfs_limits(uint32_t buffer, uint32_t io)
 {
-	avl_init(&files, offsetof(struct file_node, avl),
+	buffer_max = buffer;
+	io_max = io;
+}
+
+void rfs_init(struct rfs_session *s)
+{
+	handle_init(&s->handles, sizeof(struct file_node));
+	avl_init(&s->paths, offsetof(struct file_node, avl),
 		(avl_cmp_t)file_node_cmp);
-	avl_init(&dirs, offsetof(struct dir_node, avl),
-		(avl_cmp_t)dir_node_cmp);
+	ipc_zip_init(&s->zip);
+	s->wire = IPC_WIRE_FIXED;
+	s->tails = false;
+	s->buffer_size = IPC_BUFFER_SIZE;
+	s->max_io = io_max;
+	s->deferred = NULL;
 
 	umask(0);
+	rfs_select(s);
+}
+
+void rfs_select(struct rfs_session *s)
+{
+	cur = s;
 }
 
-void rfs_destroy(void)
+void rfs_destroy(struct rfs_session *s)
 {
-	avl_traverse(&files, (avl_process_t)file_node_free);
-	avl_traverse(&dirs, (avl_process_t)dir_node_free);
+	handle_traverse(&s->handles, (handle_process_t)file_node_free);
+	handle_destroy(&s->handles);
+
+	if (cur == s)
+		cur = NULL;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 static void stat2x_stat(x_stat *dst, const struct stat *src)
@@ -89,30 +430,226 @@ static void stat2x_stat(x_stat *dst, const struct stat *src)
 	dst->gid = src->st_gid;
 	dst->rdev = src->st_rdev;
 	dst->size = src->st_size;
-	dst->atime = src->st_atime;
-	dst->mtime = src->st_mtime;
-	dst->ctime = src->st_ctime;
+	dst->atime = src->st_atim.tv_sec;
+	dst->mtime = src->st_mtim.tv_sec;
+	dst->ctime = src->st_ctim.tv_sec;
+	dst->atime_nsec = src->st_atim.tv_nsec;
+	dst->mtime_nsec = src->st_mtim.tv_nsec;
+	dst->ctime_nsec = src->st_ctim.tv_nsec;
+}
+
+static void statx2x_stat(x_stat *dst, const struct statx *src)
+{
+	dst->mode = src->stx_mode;
+	dst->nlink = src->stx_nlink;
+	dst->uid = src->stx_uid;
+	dst->gid = src->stx_gid;
+	dst->rdev = makedev(src->stx_rdev_major, src->stx_rdev_minor);
+	dst->size = src->stx_size;
+	dst->atime = src->stx_atime.tv_sec;
+	dst->mtime = src->stx_mtime.tv_sec;
+	dst->ctime = src->stx_ctime.tv_sec;
+	dst->atime_nsec = src->stx_atime.tv_nsec;
+	dst->mtime_nsec = src->stx_mtime.tv_nsec;
+	dst->ctime_nsec = src->stx_ctime.tv_nsec;
+}
+
+/*
+ * Calls are deferred when the session loop can take them and there is
+ * room in the queue, otherwise they block as usual.
+ */
+static struct op *op_new(struct ipc *ipc, enum op_call call, size_t size)
+{
+	if (!ipc->defer)
+		return NULL;
+
+	struct op *op = malloc(sizeof(*op) + size);
+	if (op != NULL) {
+		op->call = call;
+		op->stats = ipc->call;
+		op->dir = NULL;
+	}
+	return op;
+}
+
+static int32_t op_defer(struct op *op)
+{
+	cur->deferred = &op->base;
+	return IPC_DEFERRED;
+}
+
+static bool op_reply_open(struct ipc *ipc, struct op *op, int32_t res)
+{
+	uint64_t key = 0;
+	int32_t err = (res < 0) ? -res : 0;
+
+	if (res >= 0) {
+		struct file_node *p = handle_alloc(&cur->handles, &key);
+		if (p == NULL) {
+			close(res);
+			err = ENOMEM;
+		} else {
+			file_node_init(p, res);
+			file_index(p, (const char *)op->buf, op->flags);
+		}
+	}
+
+	return ipc_reply_r_open(ipc, err, &key);
+}
+
+bool rfs_op_done(struct ipc *ipc, struct rfs_op *base)
+{
+	struct op *op = (struct op *)base;
+	int32_t res = op->base.io.res;
+	int32_t err = (res < 0) ? -res : 0;
+	uint32_t n = (res > 0) ? res : 0;
+	x_stat st;
+	bool ok = true;
+
+	dcache_put(op->dir);
+
+	if (ipc == NULL) {
+		if (op->call == OP_OPEN && res >= 0)
+			close(res);
+
+		free(op);
+		return true;
+	}
+
+	ipc->call = op->stats;
+
+	switch (op->call) {
+	case OP_READ:
+		ok = ipc_reply_r_read(ipc, err, &(datum){n, op->buf});
+		break;
+	case OP_WRITE:
+		ok = ipc_reply_r_write(ipc, err, &n);
+		break;
+	case OP_FSYNC:
+		ok = ipc_reply_r_fsync(ipc, err);
+		break;
+	case OP_FDATASYNC:
+		ok = ipc_reply_r_fdatasync(ipc, err);
+		break;
+	case OP_GETATTR:
+		statx2x_stat(&st, &op->stx);
+		ok = ipc_reply_r_getattr(ipc, err, &st);
+		break;
+	case OP_OPEN:
+		ok = op_reply_open(ipc, op, res);
+		break;
+	}
+
+	free(op);
+	return ok;
 }
 
 int32_t r_set_key(struct ipc *ipc, const uint64_t *key)
 {
 	(void)ipc;
 
-	if (fd_key)
+	if (cur->handles.used != 0)
 		return EEXIST;
 
-	fd_key = *key;
-	fd_key_set = true;
+	/* Keys of the new session never match the keys of the last one */
+	handle_base(&cur->handles, (*key >> 32) + 1);
 	return 0;
 }
 
-int32_t r_getattr(struct ipc *ipc, const string *path, x_stat *buf)
+static uint32_t clamp(uint32_t x, uint32_t min, uint32_t max)
+{
+	return (x < min) ? min : (x > max) ? max : x;
+}
+
+int32_t r_hello(struct ipc *ipc, const x_hello *offer, x_hello *agreed)
 {
 	(void)ipc;
 
+	if (cur->handles.used != 0)
+		return EEXIST;
+
+	if (offer->version < IPC_VERSION_MIN)
+		return EPROTONOSUPPORT;
+
+	agreed->version = (offer->version < IPC_VERSION) ?
+		offer->version : IPC_VERSION;
+	agreed->features = offer->features & ipc_features();
+	agreed->buffer_size = clamp(offer->buffer_size, IPC_BUFFER_MIN,
+				buffer_max);
+	agreed->max_io = clamp(offer->max_io, IPC_IO_MIN, io_max);
+
+	/* Replies use what is agreed on from the next call on */
+	cur->zip.on = agreed->features & IPC_FEATURE_ZIP;
+	cur->wire = ipc_wire_of(agreed->features);
+	cur->tails = agreed->features & IPC_FEATURE_TAIL;
+	cur->buffer_size = agreed->buffer_size;
+	cur->max_io = agreed->max_io;
+	return 0;
+}
+
+/*
+ * The open file under a path, if it still is.  The calls of the session
+ * that change names drop it at once, those of others are found here.
+ */
+static struct file_node *file_at(const struct at *at, const char *path)
+{
+	struct file_node *p = file_by_path(path);
+	if (p == NULL)
+		return NULL;
+
 	struct stat st;
-	if (lstat(path->cs, &st) == -1)
-		return errno;
+	if (fstatat(at->fd, at->name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+		st.st_dev != p->dev || st.st_ino != p->ino) {
+		file_unindex(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+static const char *changed;
+
+static void file_drop(struct file_node *p)
+{
+	if (p->path != NULL && path_under(p->path, changed))
+		file_unindex(p);
+}
+
+/* A name is gone or stands for another file now, so are names under it */
+static void path_changed(const char *path)
+{
+	dcache_drop(path);
+	changed = path;
+	handle_traverse(&cur->handles, (handle_process_t)file_drop);
+}
+
+int32_t r_getattr(struct ipc *ipc, const string *path, x_stat *buf)
+{
+	struct at at;
+	dcache_get(&at, path->cs);
+
+	struct op *op = (slow_stats > 0) ?
+		op_new(ipc, OP_GETATTR, strlen(at.name) + 1) : NULL;
+	if (op != NULL && uring_lstat(&op->base.io, at.fd,
+			strcpy((char *)op->buf, at.name), &op->stx)) {
+		slow_stats--;
+		op->dir = at.dir;
+		return op_defer(op);
+	}
+
+	free(op);
+
+	struct stat st;
+	uint64_t start = now_ns();
+	int err = (fstatat(at.fd, at.name, &st, AT_SYMLINK_NOFOLLOW) == -1) ?
+		errno : 0;
+
+	dcache_put(at.dir);
+
+	if (ipc->defer && now_ns() - start > SLOW_NS)
+		slow_stats = SLOW_CALLS;
+	if (err != 0)
+		return err;
 
 	stat2x_stat(buf, &st);
 	return 0;
@@ -125,9 +662,15 @@ int32_t r_readlink(struct ipc *ipc, const string *path, const uint32_t *len,
 	if (buf->s == NULL)
 		return ENOMEM;
 
-	ssize_t n = readlink(path->cs, buf->s, *len - 1);
-	if (n == -1)
-		return errno;
+	struct at at;
+	dcache_get(&at, path->cs);
+
+	ssize_t n = readlinkat(at.fd, at.name, buf->s, *len - 1);
+	int err = (n == -1) ? errno : 0;
+
+	dcache_put(at.dir);
+	if (err != 0)
+		return err;
 
 	buf->s[n] = '\0';
 	return 0;
@@ -138,28 +681,53 @@ int32_t r_mknod(struct ipc *ipc, const string *path, const x_mode *mode,
 {
 	(void)ipc;
 
-	return mknod(path->cs, *mode, *dev) == -1 ? errno : 0;
+	struct at at;
+	dcache_get(&at, path->cs);
+
+	int err = (mknodat(at.fd, at.name, *mode, *dev) == -1) ? errno : 0;
+
+	dcache_put(at.dir);
+	return err;
 }
 
 int32_t r_mkdir(struct ipc *ipc, const string *path, const x_mode *mode)
 {
 	(void)ipc;
 
-	return mkdir(path->cs, *mode) == -1 ? errno : 0;
+	struct at at;
+	dcache_get(&at, path->cs);
+
+	int err = (mkdirat(at.fd, at.name, *mode) == -1) ? errno : 0;
+
+	dcache_put(at.dir);
+	return err;
+}
+
+static int32_t remove_at(const string *path, int flags)
+{
+	struct at at;
+	dcache_get(&at, path->cs);
+
+	int err = (unlinkat(at.fd, at.name, flags) == -1) ? errno : 0;
+
+	dcache_put(at.dir);
+	if (err == 0)
+		path_changed(path->cs);
+	return err;
 }
 
 int32_t r_unlink(struct ipc *ipc, const string *path)
 {
 	(void)ipc;
 
-	return unlink(path->cs) == -1 ? errno : 0;
+	return remove_at(path, 0);
 }
 
 int32_t r_rmdir(struct ipc *ipc, const string *path)
 {
 	(void)ipc;
 
-	return rmdir(path->cs) == -1 ? errno : 0;
+	return remove_at(path, AT_REMOVEDIR);
 }
 
 int32_t r_symlink(struct ipc *ipc, const string *oldpath,
@@ -167,28 +735,67 @@ int32_t r_symlink(struct ipc *ipc, const string *oldpath,
 {
 	(void)ipc;
 
-	return symlink(oldpath->cs, newpath->cs) == -1 ? errno : 0;
+	struct at at;
+	dcache_get(&at, newpath->cs);
+
+	int err = (symlinkat(oldpath->cs, at.fd, at.name) == -1) ? errno : 0;
+
+	dcache_put(at.dir);
+	return err;
 }
 
+/* Both directories are held, so the second cannot push out the first */
 int32_t r_rename(struct ipc *ipc, const string *oldpath, const string *newpath)
 {
 	(void)ipc;
 
-	return rename(oldpath->cs, newpath->cs) == -1 ? errno : 0;
+	struct at from, to;
+	dcache_get(&from, oldpath->cs);
+	dcache_get(&to, newpath->cs);
+
+	int err = (renameat(from.fd, from.name, to.fd, to.name) == -1) ?
+		errno : 0;
+
+	dcache_put(from.dir);
+	dcache_put(to.dir);
+
+	if (err == 0) {
+		path_changed(oldpath->cs);
+		path_changed(newpath->cs);
+	}
+	return err;
 }
 
 int32_t r_link(struct ipc *ipc, const string *oldpath, const string *newpath)
 {
 	(void)ipc;
 
-	return link(oldpath->cs, newpath->cs) == -1 ? errno : 0;
+	struct at from, to;
+	dcache_get(&from, oldpath->cs);
+	dcache_get(&to, newpath->cs);
+
+	int err = (linkat(from.fd, from.name, to.fd, to.name, 0) == -1) ?
+		errno : 0;
+
+	dcache_put(from.dir);
+	dcache_put(to.dir);
+	return err;
 }
 
 int32_t r_chmod(struct ipc *ipc, const string *path, const x_mode *mode)
 {
 	(void)ipc;
 
-	return chmod(path->cs, *mode) == -1 ? errno : 0;
+	struct at at;
+	dcache_get(&at, path->cs);
+
+	struct file_node *p = file_at(&at, path->cs);
+	int res = (p != NULL) ? fchmod(p->fd, *mode) :
+		fchmodat(at.fd, at.name, *mode, 0);
+	int err = (res == -1) ? errno : 0;
+
+	dcache_put(at.dir);
+	return err;
 }
 
 int32_t r_chown(struct ipc *ipc, const string *path, const x_uid *owner,
@@ -196,49 +803,117 @@ int32_t r_chown(struct ipc *ipc, const string *path, const x_uid *owner,
 {
 	(void)ipc;
 
-	return chown(path->cs, *owner, *group) == -1 ? errno : 0;
+	struct at at;
+	dcache_get(&at, path->cs);
+
+	struct file_node *p = file_at(&at, path->cs);
+	int res = (p != NULL) ? fchown(p->fd, *owner, *group) :
+		fchownat(at.fd, at.name, *owner, *group, 0);
+	int err = (res == -1) ? errno : 0;
+
+	dcache_put(at.dir);
+	return err;
 }
 
+/* There is no truncateat(), without the file open the path is walked */
 int32_t r_truncate(struct ipc *ipc, const string *path, const x_off *length)
 {
 	(void)ipc;
 
-	return truncate(path->cs, *length) == -1 ? errno : 0;
+	struct at at;
+	dcache_get(&at, path->cs);
+
+	struct file_node *p = file_at(&at, path->cs);
+	int res = (p != NULL && p->writable) ? ftruncate(p->fd, *length) :
+		truncate(path->cs, *length);
+	int err = (res == -1) ? errno : 0;
+
+	dcache_put(at.dir);
+	return err;
 }
 
 int32_t r_open(struct ipc *ipc, const string *path, const int32_t *flags,
 	const x_mode *mode, uint64_t *key)
 {
-	(void)ipc;
+	struct at at;
+	dcache_get(&at, path->cs);
+
+	/* The whole path is kept for the file, the name is in it */
+	struct op *op = op_new(ipc, OP_OPEN, strlen(path->cs) + 1);
+	if (op != NULL && uring_open(&op->base.io, at.fd,
+			strcpy((char *)op->buf, path->cs) +
+			(at.name - path->cs), *flags, *mode)) {
+		op->dir = at.dir;
+		op->flags = *flags;
+		return op_defer(op);
+	}
 
-	struct file_node *p = malloc(sizeof(struct file_node));
-	if (p == NULL)
-		return ENOMEM;
+	free(op);
 
-	p->fd = open(path->cs, *flags, *mode);
-	if (p->fd == -1) {
-		free(p);
-		return errno;
+	int fd = openat(at.fd, at.name, *flags, *mode);
+	int err = (fd == -1) ? errno : 0;
+
+	dcache_put(at.dir);
+	if (err != 0)
+		return err;
+
+	struct file_node *p = handle_alloc(&cur->handles, key);
+	if (p == NULL) {
+		close(fd);
+		return ENOMEM;
 	}
 
-	*key = p->key = fd_key++;
-	avl_insert(&files, p);
+	file_node_init(p, fd);
+	file_index(p, path->cs, *flags);
 	return 0;
 }
 
 int32_t r_read(struct ipc *ipc, const uint64_t *key, const uint32_t *size,
 	const x_off *offset, datum *buf)
 {
-	struct file_node *p;
-	p = avl_search(&files, &(struct file_node){.key = *key});
+	struct file_node *p = file_get(*key);
 	if (p == NULL)
 		return EBADF;
 
-	buf->p = mpool_alloc(&ipc->mp, *size);
+	if (*offset < 0)
+		return EINVAL;
+
+	/* Clients keep to the agreed size, it is not trusted though */
+	uint32_t len = (*size < cur->max_io) ? *size : cur->max_io;
+
+	access_track(p, *offset, len);
+
+	/*
+	 * Larger ranges of regular files are sent straight to the socket,
+	 * to clients that learn where the file ended if it got shorter.
+	 * That saves the copies, though sendfile() may wait for the disk
+	 * where a queued read would not, so io_uring gets the smaller ones.
+	 */
+	struct stat st;
+	if (ipc->tails && fstat(p->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		x_off left = (*offset < st.st_size) ? st.st_size - *offset : 0;
+
+		buf->n = (left < len) ? left : len;
+		if (buf->n >= IPC_FILE_MIN) {
+			buf->p = NULL;
+			ipc->file.fd = p->fd;
+			ipc->file.offset = *offset;
+			return 0;
+		}
+	}
+
+	struct op *op = op_new(ipc, OP_READ, len);
+	if (op != NULL &&
+		uring_read(&op->base.io, p->fd, op->buf, len, *offset))
+		return op_defer(op);
+
+	free(op);
+
+	buf->p = mpool_alloc(&ipc->mp, len);
 	if (buf->p == NULL)
 		return ENOMEM;
 
-	int32_t n = pread(p->fd, buf->p, *size, *offset);
+	int32_t n = pread(p->fd, buf->p, len, *offset);
 	if (n == -1)
 		return errno;
 
@@ -249,13 +924,23 @@ int32_t r_read(struct ipc *ipc, const uint64_t *key, const uint32_t *size,
 int32_t r_write(struct ipc *ipc, const uint64_t *key, const x_off *offset,
 		const datum *data, uint32_t *done)
 {
-	(void)ipc;
-
-	struct file_node *p;
-	p = avl_search(&files, &(struct file_node){.key = *key});
+	struct file_node *p = file_get(*key);
 	if (p == NULL)
 		return EBADF;
 
+	/* Nothing to queue, data->p is NULL */
+	if (data->n == 0) {
+		*done = 0;
+		return 0;
+	}
+
+	struct op *op = op_new(ipc, OP_WRITE, data->n);
+	if (op != NULL && uring_write(&op->base.io, p->fd,
+			memcpy(op->buf, data->p, data->n), data->n, *offset))
+		return op_defer(op);
+
+	free(op);
+
 	ssize_t res = pwrite(p->fd, data->p, data->n, *offset);
 	if (res == -1)
 		return errno;
@@ -286,37 +971,45 @@ int32_t r_release(struct ipc *ipc, const uint64_t *key)
 {
 	(void)ipc;
 
-	struct file_node *p;
-	p = avl_remove(&files, &(struct file_node){.key = *key});
+	struct file_node *p = file_get(*key);
 	if (p == NULL)
 		return EBADF;
 
-	int res = close(p->fd);
-	free(p);
+	access_done(p);
+	file_unindex(p);
+
+	int res = file_node_close(p);
+	handle_free(&cur->handles, *key);
 	return res == -1 ? errno : 0;
 }
 
 int32_t r_fsync(struct ipc *ipc, const uint64_t *key)
 {
-	(void)ipc;
-
-	struct file_node *p;
-	p = avl_remove(&files, &(struct file_node){.key = *key});
+	struct file_node *p = file_get(*key);
 	if (p == NULL)
 		return EBADF;
 
+	struct op *op = op_new(ipc, OP_FSYNC, 0);
+	if (op != NULL && uring_fsync(&op->base.io, p->fd, false))
+		return op_defer(op);
+
+	free(op);
+
 	return fsync(p->fd) == -1 ? errno : 0;
 }
 
 int32_t r_fdatasync(struct ipc *ipc, const uint64_t *key)
 {
-	(void)ipc;
-
-	struct file_node *p;
-	p = avl_remove(&files, &(struct file_node){.key = *key});
+	struct file_node *p = file_get(*key);
 	if (p == NULL)
 		return EBADF;
 
+	struct op *op = op_new(ipc, OP_FDATASYNC, 0);
+	if (op != NULL && uring_fsync(&op->base.io, p->fd, true))
+		return op_defer(op);
+
+	free(op);
+
 	return fdatasync(p->fd) == -1 ? errno : 0;
 }
 
@@ -324,30 +1017,44 @@ int32_t r_opendir(struct ipc *ipc, const string *path, uint64_t *key)
 {
 	(void)ipc;
 
-	struct dir_node *p = malloc(sizeof(struct dir_node));
-	if (p == NULL)
-		return ENOMEM;
+	struct at at;
+	dcache_get(&at, path->cs);
 
-	p->dir = opendir(path->cs);
-	if (p->dir == NULL) {
-		free(p);
-		return errno;
+	int fd = openat(at.fd, at.name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	int err = (fd == -1) ? errno : 0;
+
+	dcache_put(at.dir);
+	if (err != 0)
+		return err;
+
+	DIR *dir = fdopendir(fd);
+	if (dir == NULL) {
+		err = errno;
+		close(fd);
+		return err;
 	}
 
-	*key = p->key = fd_key++;
-	avl_insert(&dirs, p);
+	struct file_node *p = handle_alloc(&cur->handles, key);
+	if (p == NULL) {
+		closedir(dir);
+		return ENOMEM;
+	}
+
+	file_node_init(p, fd);
+	p->dir = dir;
+	p->pos = 0;
 	return 0;
 }
 
 int32_t r_readdir(struct ipc *ipc, const uint64_t *key, list_string *names)
 {
-	struct dir_node *p;
-	p = avl_search(&dirs, &(struct dir_node){.key = *key});
+	struct file_node *p = dir_get(*key);
 	if (p == NULL)
 		return EBADF;
 
 	memset(names, 0, sizeof(list_string));
 	rewinddir(p->dir);
+	p->pos = -1;
 
 	for (;;) {
 		errno = 0;
@@ -372,17 +1079,70 @@ int32_t r_readdir(struct ipc *ipc, const uint64_t *key, list_string *names)
 	return 0;
 }
 
+int32_t r_readdirplus(struct ipc *ipc, const uint64_t *key,
+		const x_off *cookie, const uint32_t *count,
+		list_x_dirent *entries)
+{
+	struct file_node *p = dir_get(*key);
+	if (p == NULL)
+		return EBADF;
+
+	memset(entries, 0, sizeof(list_x_dirent));
+
+	/* Cookies are telldir() positions, seek only if not there yet */
+	if (*cookie == 0)
+		rewinddir(p->dir);
+	else if (*cookie != p->pos)
+		seekdir(p->dir, *cookie);
+
+	p->pos = *cookie;
+
+	uint32_t n = (*count < DIR_BATCH_MAX) ? *count : DIR_BATCH_MAX;
+	int fd = dirfd(p->dir);
+
+	while (entries->n < n) {
+		errno = 0;
+
+		struct dirent *de = readdir(p->dir);
+		if (de == NULL) {
+			if (errno != 0)
+				return errno;
+			break;
+		}
+
+		x_dirent ent;
+		ent.name.s = mpool_alloc(&ipc->mp, strlen(de->d_name) + 1);
+		if (ent.name.s == NULL)
+			return ENOMEM;
+
+		strcpy(ent.name.s, de->d_name);
+
+		/* The entry may be gone already, mode 0 tells it */
+		struct stat st;
+		if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+			stat2x_stat(&ent.st, &st);
+		else
+			memset(&ent.st, 0, sizeof(ent.st));
+
+		ent.cookie = p->pos = telldir(p->dir);
+
+		if (!list_append_x_dirent(&ipc->mp, entries, &ent))
+			return ENOMEM;
+	}
+
+	return 0;
+}
+
 int32_t r_releasedir(struct ipc *ipc, const uint64_t *key)
 {
 	(void)ipc;
 
-	struct dir_node *p;
-	p = avl_remove(&dirs, &(struct dir_node){.key = *key});
+	struct file_node *p = dir_get(*key);
 	if (p == NULL)
 		return EBADF;
 
-	int res = closedir(p->dir);
-	free(p);
+	int res = file_node_close(p);
+	handle_free(&cur->handles, *key);
 	return res == -1 ? errno : 0;
 }
 
@@ -390,15 +1150,20 @@ int32_t r_access(struct ipc *ipc, const string *path, const int32_t *mode)
 {
 	(void)ipc;
 
-	return access(path->cs, *mode) == -1 ? errno : 0;
+	struct at at;
+	dcache_get(&at, path->cs);
+
+	int err = (faccessat(at.fd, at.name, *mode, 0) == -1) ? errno : 0;
+
+	dcache_put(at.dir);
+	return err;
 }
 
 int32_t r_ftruncate(struct ipc *ipc, const uint64_t *key, const x_off *length)
 {
 	(void)ipc;
 
-	struct file_node *p;
-	p = avl_search(&files, &(struct file_node){.key = *key});
+	struct file_node *p = file_get(*key);
 	if (p == NULL)
 		return EBADF;
 
@@ -409,8 +1174,7 @@ int32_t r_fgetattr(struct ipc *ipc, const uint64_t *key, x_stat *buf)
 {
 	(void)ipc;
 
-	struct file_node *p;
-	p = avl_search(&files, &(struct file_node){.key = *key});
+	struct file_node *p = file_get(*key);
 	if (p == NULL)
 		return EBADF;
 
@@ -427,9 +1191,65 @@ int32_t r_utimens(struct ipc *ipc, const string *path,
 {
 	(void)ipc;
 
-	struct utimbuf buf;
-	buf.actime = atime->sec;
-	buf.modtime = mtime->sec;
+	struct timespec ts[2] = {
+		{atime->sec, atime->nsec},
+		{mtime->sec, mtime->nsec},
+	};
+
+	struct at at;
+	dcache_get(&at, path->cs);
 
-	return utime(path->cs, &buf) == -1 ? errno : 0;
+	struct file_node *p = file_at(&at, path->cs);
+	int res = (p != NULL) ? futimens(p->fd, ts) :
+		utimensat(at.fd, at.name, ts, 0);
+	int err = (res == -1) ? errno : 0;
+
+	dcache_put(at.dir);
+	return err;
+}
+
+/* Up to the last bucket with calls in it */
+static list_uint64_t hist_list(uint64_t *hist)
+{
+	uint32_t n = IPC_HIST_BUCKETS;
+
+	while (n > 0 && hist[n - 1] == 0)
+		n--;
+	return (list_uint64_t){.n = n, ._n = n, .p = hist};
+}
+
+/* Those of this process: of the session, or of all a worker has served */
+int32_t r_stats(struct ipc *ipc, list_x_func_stats *stats)
+{
+	const uint32_t funcs = sizeof(ipc_stats_rfs) / sizeof(*ipc_stats_rfs);
+
+	memset(stats, 0, sizeof(list_x_func_stats));
+
+	for (uint32_t id = 0; id < funcs; ++id) {
+		struct ipc_stats *s = &ipc_stats_rfs[id];
+		if (s->calls == 0)
+			continue;
+
+		x_func_stats f = {
+			.id = id,
+			.calls = s->calls,
+			.bytes_in = s->bytes_in,
+			.bytes_out = s->bytes_out,
+			.decode = hist_list(s->hist[IPC_PHASE_DECODE]),
+			.handler = hist_list(s->hist[IPC_PHASE_HANDLER]),
+			.encode = hist_list(s->hist[IPC_PHASE_ENCODE]),
+		};
+
+		for (int32_t err = 0; err < IPC_ERRNO_MAX; ++err) {
+			if (s->errors[err] != 0 &&
+				!list_append_x_errors(&ipc->mp, &f.errors,
+					&(x_errors){err, s->errors[err]}))
+				return ENOMEM;
+		}
+
+		if (!list_append_x_func_stats(&ipc->mp, stats, &f))
+			return ENOMEM;
+	}
+
+	return 0;
 }
@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "rfsd_uring.h"
+
+static const uint8_t ops_used[] = {
+	IORING_OP_READ,
+	IORING_OP_WRITE,
+	IORING_OP_FSYNC,
+	IORING_OP_STATX,
+	IORING_OP_OPENAT,
+};
+
+struct uring {
+	int fd;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+
+	unsigned sq_entries;
+	unsigned cq_entries;
+	unsigned queued;
+	unsigned in_flight;
+};
+
+static struct uring ring = {.fd = -1};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(unsigned to_submit)
+{
+	return syscall(__NR_io_uring_enter, ring.fd, to_submit, 0, 0, NULL, 0);
+}
+
+static bool ops_supported(void)
+{
+	size_t size = sizeof(struct io_uring_probe) +
+		256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	bool ok = probe != NULL &&
+		syscall(__NR_io_uring_register, ring.fd,
+			IORING_REGISTER_PROBE, probe, 256) == 0;
+
+	for (size_t i = 0; ok && i < sizeof(ops_used); ++i) {
+		ok = ops_used[i] <= probe->last_op &&
+			(probe->ops[ops_used[i]].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	free(probe);
+	return ok;
+}
+
+static void *map(size_t size, off_t offset)
+{
+	return mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring.fd, offset);
+}
+
+bool uring_init(unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	ring.fd = uring_setup(entries, &p);
+	if (ring.fd == -1)
+		return false;
+
+	if (!ops_supported()) {
+		uring_destroy();
+		errno = ENOSYS;
+		return false;
+	}
+
+	ring.sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_map_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	/* Both rings may come in one mapping */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_map_size > ring.sq_map_size)
+			ring.sq_map_size = ring.cq_map_size;
+		ring.cq_map_size = 0;
+	}
+
+	ring.sq_map = map(ring.sq_map_size, IORING_OFF_SQ_RING);
+	ring.cq_map = (ring.cq_map_size == 0) ? ring.sq_map :
+		map(ring.cq_map_size, IORING_OFF_CQ_RING);
+	ring.sqes = map(ring.sqes_size, IORING_OFF_SQES);
+
+	if (ring.sq_map == MAP_FAILED || ring.cq_map == MAP_FAILED ||
+		ring.sqes == MAP_FAILED) {
+		uring_destroy();
+		return false;
+	}
+
+	uint8_t *sq = ring.sq_map;
+	uint8_t *cq = ring.cq_map;
+
+	ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring.sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring.cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	ring.sq_entries = p.sq_entries;
+	ring.cq_entries = p.cq_entries;
+	ring.queued = ring.in_flight = 0;
+	return true;
+}
+
+void uring_destroy(void)
+{
+	if (ring.sqes != NULL && ring.sqes != MAP_FAILED)
+		munmap(ring.sqes, ring.sqes_size);
+	if (ring.cq_map_size != 0 && ring.cq_map != NULL &&
+		ring.cq_map != MAP_FAILED)
+		munmap(ring.cq_map, ring.cq_map_size);
+	if (ring.sq_map != NULL && ring.sq_map != MAP_FAILED)
+		munmap(ring.sq_map, ring.sq_map_size);
+	if (ring.fd != -1)
+		close(ring.fd);
+
+	memset(&ring, 0, sizeof(ring));
+	ring.fd = -1;
+}
+
+int uring_fd(void)
+{
+	return ring.fd;
+}
+
+/*
+ * No more operations are taken than completions fit in the queue, so
+ * that submitting never fails for a completion queue overflow.
+ */
+static struct io_uring_sqe *sqe_get(struct uring_op *op, uint8_t opcode)
+{
+	if (ring.fd == -1 || ring.in_flight >= ring.cq_entries)
+		return NULL;
+
+	unsigned tail = *ring.sq_tail;
+	unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+
+	if (tail - head >= ring.sq_entries) {
+		if (!uring_submit())
+			return NULL;
+
+		head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= ring.sq_entries)
+			return NULL;
+	}
+
+	struct io_uring_sqe *sqe = &ring.sqes[tail & ring.sq_mask];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->user_data = (uintptr_t)op;
+
+	ring.sq_array[tail & ring.sq_mask] = tail & ring.sq_mask;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	ring.queued++;
+	ring.in_flight++;
+	return sqe;
+}
+
+bool uring_read(struct uring_op *op, int fd, void *buf, uint32_t len,
+		uint64_t offset)
+{
+	struct io_uring_sqe *sqe = sqe_get(op, IORING_OP_READ);
+	if (sqe == NULL)
+		return false;
+
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	return true;
+}
+
+bool uring_write(struct uring_op *op, int fd, const void *buf, uint32_t len,
+		uint64_t offset)
+{
+	struct io_uring_sqe *sqe = sqe_get(op, IORING_OP_WRITE);
+	if (sqe == NULL)
+		return false;
+
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	return true;
+}
+
+bool uring_fsync(struct uring_op *op, int fd, bool datasync)
+{
+	struct io_uring_sqe *sqe = sqe_get(op, IORING_OP_FSYNC);
+	if (sqe == NULL)
+		return false;
+
+	sqe->fd = fd;
+	sqe->fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0;
+	return true;
+}
+
+bool uring_lstat(struct uring_op *op, int dirfd, const char *path,
+		struct statx *buf)
+{
+	struct io_uring_sqe *sqe = sqe_get(op, IORING_OP_STATX);
+	if (sqe == NULL)
+		return false;
+
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)path;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->off = (uintptr_t)buf;
+	sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+	return true;
+}
+
+bool uring_open(struct uring_op *op, int dirfd, const char *path, int flags,
+		mode_t mode)
+{
+	struct io_uring_sqe *sqe = sqe_get(op, IORING_OP_OPENAT);
+	if (sqe == NULL)
+		return false;
+
+	sqe->fd = dirfd;
+	sqe->addr = (uintptr_t)path;
+	sqe->len = mode;
+	sqe->open_flags = flags;
+	return true;
+}
+
+/* The kernel holds on to the files once they are submitted */
+bool uring_submit(void)
+{
+	while (ring.queued > 0) {
+		int n = uring_enter(ring.queued);
+
+		if (n > 0)
+			ring.queued -= n;
+		else if (n == -1 && errno == EINTR)
+			continue;
+		else
+			return false;
+	}
+
+	return true;
+}
+
+void uring_reap(void)
+{
+	if (ring.fd == -1)
+		return;
+
+	unsigned head = *ring.cq_head;
+
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+		const struct io_uring_cqe *cqe =
+			&ring.cqes[head & ring.cq_mask];
+		struct uring_op *op = (struct uring_op *)(uintptr_t)
+			cqe->user_data;
+
+		op->res = cqe->res;
+		__atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+		ring.in_flight--;
+
+		op->done(op);
+	}
+}
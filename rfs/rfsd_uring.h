@@ -0,0 +1,41 @@
+/*
+ *               Asynchronous file I/O
+ *
+ * A thin io_uring wrapper for the event-driven workers.  Operations are
+ * queued as calls come in and submitted in one batch per pass of the
+ * loop; the ring descriptor is readable once some have completed and
+ * uring_reap() then runs their done() callbacks.
+ *
+ * uring_init() fails when the kernel lacks io_uring or any of the
+ * operations used, so are the others if the ring is full, and callers
+ * then do the blocking calls themselves.
+ */
+
+#ifndef __RFSD_URING_H__
+#define __RFSD_URING_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct statx;
+
+struct uring_op {
+	void (*done)(struct uring_op *);
+	int32_t res;
+};
+
+bool uring_init(unsigned);
+void uring_destroy(void);
+int uring_fd(void);
+
+bool uring_read(struct uring_op *, int, void *, uint32_t, uint64_t);
+bool uring_write(struct uring_op *, int, const void *, uint32_t, uint64_t);
+bool uring_fsync(struct uring_op *, int, bool);
+bool uring_lstat(struct uring_op *, int, const char *, struct statx *);
+bool uring_open(struct uring_op *, int, const char *, int, mode_t);
+
+bool uring_submit(void);
+void uring_reap(void);
+
+#endif